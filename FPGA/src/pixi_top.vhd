@@ -812,6 +812,13 @@ begin
       gpio3_oe_vfd <= "00"; -- when startup or testmode else wreg(reg_vfd)(13);
       gpio3_tr_vfd <= "00";
 
+      -- FIFO status, so that software can keep the FIFO topped up without overflowing it
+      rreg(reg_vfd_status)(7 downto 0) <= lcd_fifo_level;
+      rreg(reg_vfd_status)(8) <= lcd_fifo_full;
+      rreg(reg_vfd_status)(9) <= lcd_fifo_empty;
+      rreg(reg_vfd_status)(14 downto 10) <= (others => '0');
+      rreg(reg_vfd_status)(15) <= '1'; -- Status register present (reads 0 in older builds)
+
       -- Debug...
       leds(20)(6 downto 0) <= lcd_fifo_level(6 downto 0);
       leds(20)(7) <= lcd_fifo_full;
@@ -1234,7 +1241,18 @@ your_instance_name : fifo_generator_v9_3
 -- Take care not to drive them outside this range when using this to control R/C servos
 
 -- The default no. of bits for the PWM controller is 10 bits (0 to 1023)
--- Note: frequency is currently fixed to 50Hz but this can be changed. See PWM_PHASE_MAX definition
+-- Note: the default frequency is fixed to 50Hz but this can be changed. See PWM_PHASE_MAX definition
+
+-- Each channel can instead run from its own timebase, set at run time (eg. tens of kHz for DC motors):
+--    reg_pwm_periodN: counts per PWM cycle (the resolution), 0 = use the default 50Hz / PWM_BITS timebase
+--    reg_pwm_divN:    clk_33m cycles per count, less one
+--    Frequency = 33.33MHz / ((reg_pwm_divN + 1) * reg_pwm_periodN)
+-- In this mode the channel is high for reg_pwmN(14 downto 0) counts of each cycle; bit 15 is the direction as before.
+
+-- Hardware calibration of channels on the default timebase (eg. a set of servos that all need the same correction):
+--    reg_pwm_gain:   8.8 fixed-point gain (X"0100" = 1.0), 0 = off
+--    reg_pwm_offset: signed offset added after the gain
+--    Level = (reg_pwmN * reg_pwm_gain / 256) + reg_pwm_offset, limited to 0..2^PWM_BITS-1
 
    pwm_gen : if ENABLE_PWM_GEN generate -- Use a block to keep any new signal definitions declared within this section of code only - keeps things tidy...
       constant PWM_HIGH : std_logic_vector(PWM_BITS-1 downto 0) := (others => '1');
@@ -1246,6 +1264,14 @@ your_instance_name : fifo_generator_v9_3
       signal pwm_out : std_logic_vector(PWM_CHANNELS-1 downto 0);
       signal pwm_test_pos : t_slv16_vector(PWM_CHANNELS-1 downto 0);
       signal pwm_test_dir : std_logic_vector(PWM_CHANNELS-1 downto 0);
+      signal pwm_reg : t_slv16_vector(PWM_CHANNELS-1 downto 0); -- Control values in use: as written, or as last committed
+      signal pwm_shadow : t_slv16_vector(PWM_CHANNELS-1 downto 0);
+      signal pwm_commit_mode : std_logic_vector(PWM_CHANNELS-1 downto 0) := (others => '0');
+      signal pwm_custom : std_logic_vector(PWM_CHANNELS-1 downto 0); -- Channel has its own timebase
+      signal pwm_div_count : t_slv16_vector(PWM_CHANNELS-1 downto 0);
+      signal pwm_count : t_slv16_vector(PWM_CHANNELS-1 downto 0);
+      signal pwm_cal : t_slv16_vector(PWM_CHANNELS-1 downto 0); -- Control values after gain & offset
+      signal pwm_src : t_slv16_vector(PWM_CHANNELS-1 downto 0); -- Control values from the registers or the sequencer
    begin
 
       -- PWM clock-enable generator
@@ -1281,32 +1307,100 @@ your_instance_name : fifo_generator_v9_3
       end process;
 
 
+      -- Atomic update of several channels:
+      -- Writing reg_pwm_commit copies reg_pwm0..7 to the channels selected in bits 7..0, all on the same
+      -- clock edge, and from then on those channels ignore reg_pwm0..7 until the next commit.
+      -- Writing it with bit 15 set returns the selected channels to following reg_pwm0..7 directly.
+      process(startup_reset, clk_33m)
+      begin
+         if startup_reset = '1' then
+            pwm_commit_mode <= (others => '0');
+         elsif rising_edge(clk_33m) then
+            if wen(reg_pwm_commit) = '1' then
+               for i in 0 to PWM_CHANNELS-1 loop
+                  if wreg(reg_pwm_commit)(i) = '1' then
+                     pwm_shadow(i) <= wreg(reg_pwm0 + i);
+                     pwm_commit_mode(i) <= not wreg(reg_pwm_commit)(15);
+                  end if;
+               end loop;
+            end if;
+         end if;
+      end process;
+
       pwm_ch_gen : for i in 0 to PWM_CHANNELS-1 generate
       begin
 
-         -- Set PWM level from register or sequencer...
---         pwm_level(i)(PWM_BITS-1 downto 0) <= wreg(reg_pwm0 + i)(PWM_BITS-1 downto 0) when wreg(reg_pwm_cfg)(i) = '0' else pwm_pos(i)(PWM_BITS-1 downto 0);
-         pwm_level(i)(PWM_BITS-1 downto 0) <= wreg(reg_pwm0 + i)(PWM_BITS-1 downto 0) when SW(4) = '0' else std_logic_vector(conv_unsigned(102,10));
+         pwm_reg(i) <= pwm_shadow(i) when pwm_commit_mode(i) = '1' else wreg(reg_pwm0 + i);
+
+         -- Set PWM level from register or sequencer (reg_pwm_cfg bit i)...
+         pwm_src(i) <= pwm_reg(i) when wreg(reg_pwm_cfg)(i) = '0' else pwm_pos(i);
 
          process(clk_33m)
+            variable product : std_logic_vector(PWM_BITS+15 downto 0);
+            variable sum : std_logic_vector(PWM_BITS+9 downto 0);
          begin
             if rising_edge(clk_33m) then
-               if en_pwm = '1' then
-                  if pwm_level(i)(PWM_BITS-1 downto 0) < pwm_phase or pwm_level(i)(PWM_BITS-1 downto 0) = all_zeros(PWM_BITS-1 downto 0) then
-                      pwm_out(i) <= '0';
+               product := pwm_src(i)(PWM_BITS-1 downto 0) * wreg(reg_pwm_gain);
+               sum := ("00" & product(PWM_BITS+15 downto 8)) + sxt(wreg(reg_pwm_offset), PWM_BITS+10);
+               if sum(PWM_BITS+9) = '1' then -- Below zero
+                  pwm_cal(i)(PWM_BITS-1 downto 0) <= (others => '0');
+               elsif sum(PWM_BITS+8 downto PWM_BITS) /= all_zeros(PWM_BITS+8 downto PWM_BITS) then -- Above full scale
+                  pwm_cal(i)(PWM_BITS-1 downto 0) <= (others => '1');
+               else
+                  pwm_cal(i)(PWM_BITS-1 downto 0) <= sum(PWM_BITS-1 downto 0);
+               end if;
+            end if;
+         end process;
+
+         pwm_level(i)(PWM_BITS-1 downto 0) <= std_logic_vector(conv_unsigned(102,10)) when SW(4) = '1' else
+                                              pwm_src(i)(PWM_BITS-1 downto 0) when wreg(reg_pwm_gain) = X"0000" else
+                                              pwm_cal(i)(PWM_BITS-1 downto 0);
+
+         pwm_custom(i) <= '0' when wreg(reg_pwm_period0 + i) = X"0000" else '1';
+
+         process(clk_33m)
+         begin
+            if rising_edge(clk_33m) then
+               if pwm_custom(i) = '0' then
+                  pwm_div_count(i) <= (others => '0');
+                  pwm_count(i) <= (others => '0');
+                  if en_pwm = '1' then
+                     if pwm_level(i)(PWM_BITS-1 downto 0) < pwm_phase or pwm_level(i)(PWM_BITS-1 downto 0) = all_zeros(PWM_BITS-1 downto 0) then
+                         pwm_out(i) <= '0';
+                     else
+                         pwm_out(i) <= '1';
+                     end if;
+                  end if;
+               elsif pwm_div_count(i) >= wreg(reg_pwm_div0 + i) then
+                  pwm_div_count(i) <= (others => '0');
+                  if pwm_count(i) >= wreg(reg_pwm_period0 + i) - 1 then
+                     pwm_count(i) <= (others => '0');
                   else
+                     pwm_count(i) <= pwm_count(i) + 1;
+                  end if;
+                  if pwm_count(i) < ('0' & pwm_src(i)(14 downto 0)) then
                       pwm_out(i) <= '1';
+                  else
+                      pwm_out(i) <= '0';
                   end if;
+               else
+                  pwm_div_count(i) <= pwm_div_count(i) + 1;
                end if;
             end if;
          end process;
 
+         rreg(reg_pwm_div0 + i) <= wreg(reg_pwm_div0 + i);
+         rreg(reg_pwm_period0 + i) <= wreg(reg_pwm_period0 + i);
+
          -- GPIO2 PWM low-current drivers:
          gpio2a_pwm(i) <= not pwm_out(i);
          -- GPIO2 PWM high-current drivers:
-         gpio2b_pwm(i) <= wreg(reg_pwm0 + i)(15) when wreg(reg_pwm_cfg)(i) = '0' else pwm_pos(i)(15);
+         gpio2b_pwm(i) <= pwm_src(i)(15);
 
       end generate;
+
+      rreg(reg_pwm_gain) <= wreg(reg_pwm_gain);
+      rreg(reg_pwm_offset) <= wreg(reg_pwm_offset);
       
 
       -- PWM (servo control) test function channel(0)
@@ -1381,13 +1475,47 @@ your_instance_name : fifo_generator_v9_3
       signal pwm_fifo_level : std_logic_vector(7 downto 0);
       signal pwm_fifo_ren : std_logic;
       signal pwm_fifo_rdata : std_logic_vector(63 downto 0);
+      signal pwm_fifo_wen : std_logic;
+      signal pwm_fifo_wdata : std_logic_vector(63 downto 0);
+      signal pwm_seq_word : integer range 0 to 3;
       signal pwm_seq_en : std_logic;
       signal pwm_seq_override : std_logic;
+      signal pwm_seq_fast : std_logic;
       constant pwm_mid : std_logic_vector(PWM_BITS-1 downto 0) := std_logic_vector(conv_unsigned(((2**PWM_BITS - 1) * 2000/2000),PWM_BITS));
       constant pwm_min : std_logic_vector(PWM_BITS-1 downto 0) := std_logic_vector(conv_unsigned(((2**PWM_BITS - 1) * 1000/2000),PWM_BITS));
       constant pwm_max : std_logic_vector(PWM_BITS-1 downto 0) := std_logic_vector(conv_unsigned(((2**PWM_BITS - 1) * 0/2000),PWM_BITS));
    begin
 
+      -- Frames are written to reg_pwm_seq_data as four words, PWM4 first, and the fourth
+      -- queues the frame. They never reach reg_pwm4..7, so the outputs only change as the
+      -- sequencer plays them. Writing reg_pwm_seq_status starts a new frame.
+      process(startup_reset, clk_33m)
+      begin
+         if startup_reset = '1' then
+            pwm_seq_word <= 0;
+            pwm_fifo_wen <= '0';
+         elsif rising_edge(clk_33m) then
+            pwm_fifo_wen <= '0';
+            if wen(reg_pwm_seq_status) = '1' then
+               pwm_seq_word <= 0;
+            elsif wen(reg_pwm_seq_data) = '1' then
+               case pwm_seq_word is
+                  when 0 => pwm_fifo_wdata(15 downto 0)  <= wreg(reg_pwm_seq_data);
+                  when 1 => pwm_fifo_wdata(31 downto 16) <= wreg(reg_pwm_seq_data);
+                  when 2 => pwm_fifo_wdata(47 downto 32) <= wreg(reg_pwm_seq_data);
+                  when others =>
+                     pwm_fifo_wdata(63 downto 48) <= wreg(reg_pwm_seq_data);
+                     pwm_fifo_wen <= '1';
+               end case;
+               if pwm_seq_word = 3 then
+                  pwm_seq_word <= 0;
+               else
+                  pwm_seq_word <= pwm_seq_word + 1;
+               end if;
+            end if;
+         end if;
+      end process;
+
       -- PWM Sequencer FIFO
       pwm_fifo : entity work.fifo 
       generic map (
@@ -1405,11 +1533,8 @@ your_instance_name : fifo_generator_v9_3
       port map(
          RESET => startup_reset,
          CLK => clk_33m,
-         WR_EN => wen(reg_pwm7),
-         DIN(15 downto 0)  => wreg(reg_pwm4),
-         DIN(31 downto 16) => wreg(reg_pwm5),
-         DIN(47 downto 32) => wreg(reg_pwm6),
-         DIN(63 downto 48) => wreg(reg_pwm7),
+         WR_EN => pwm_fifo_wen,
+         DIN => pwm_fifo_wdata,
          RD_EN => pwm_fifo_ren,
          DOUT => pwm_fifo_rdata,
          -- Status
@@ -1421,15 +1546,31 @@ your_instance_name : fifo_generator_v9_3
       leds(17)(6) <= pwm_seq_en;
       leds(17)(7) <= pwm_seq_override;
 
+      -- FIFO status, so that software can keep the sequencer fed
+      rreg(reg_pwm_seq_status)(7 downto 0) <= pwm_fifo_level;
+      rreg(reg_pwm_seq_status)(8) <= pwm_fifo_empty;
+      rreg(reg_pwm_seq_status)(14 downto 9) <= (others => '0');
+      rreg(reg_pwm_seq_status)(15) <= '1'; -- Status register present (reads 0 in older builds)
+
       pwm_seq_en <= wreg(reg_pwm_cfg)(8); -- Set this bit to enable the sequencer to run at 1Hz
       pwm_seq_override <= wreg(reg_pwm_cfg)(9); -- Set this bit to enable the sequencer to run immediately 
+      pwm_seq_fast <= wreg(reg_pwm_cfg)(10); -- Set this bit (with bit 8) to run the sequencer at 50Hz, once per servo frame
+
+      -- The sequencer only plays PWM4..7, with PWM_BITS of duty and the direction in bit 15
+      pwm_pos(0) <= (others => '0');
+      pwm_pos(1) <= (others => '0');
+      pwm_pos(2) <= (others => '0');
+      pwm_pos(3) <= (others => '0');
+      pwm_pos_gen : for i in 4 to 7 generate
+         pwm_pos(i)(14 downto PWM_BITS) <= (others => '0');
+      end generate;
       
       process(startup_reset, clk_33m)
       begin
          if startup_reset = '1' then
          elsif rising_edge(clk_33m) then
             pwm_fifo_ren <= '0';
-            if (en_1hz = '1' and pwm_seq_en = '1') or pwm_seq_override = '1' then
+            if (en_1hz = '1' and pwm_seq_en = '1' and pwm_seq_fast = '0') or (en_50hz = '1' and pwm_seq_en = '1' and pwm_seq_fast = '1') or pwm_seq_override = '1' then
                if pwm_fifo_empty = '0' then
                   pwm_pos(4)(PWM_BITS-1 downto 0) <= pwm_fifo_rdata(PWM_BITS-1 downto 0);
                   pwm_pos(4)(15)                  <= pwm_fifo_rdata(15);
@@ -63,6 +63,7 @@ package registers_pkg is
 
    constant reg_vfd          : integer := 16#38#;
    constant reg_vfd_ctrl     : integer := 16#39#;
+   constant reg_vfd_status   : integer := 16#3A#;
 
    constant reg_pwm0         : integer := 16#40#;
    constant reg_pwm1         : integer := 16#41#;
@@ -74,6 +75,9 @@ package registers_pkg is
    constant reg_pwm7         : integer := 16#47#;
    constant reg_pwm_gain     : integer := 16#48#;
    constant reg_pwm_offset   : integer := 16#49#;
+   constant reg_pwm_seq_data : integer := 16#4A#;
+   constant reg_pwm_commit   : integer := 16#4C#;
+   constant reg_pwm_seq_status : integer := 16#4D#;
    constant reg_pwm_cfg      : integer := 16#4F#;
    constant reg_timer0       : integer := 16#50#;
    constant reg_timer1       : integer := 16#51#;
@@ -82,6 +86,23 @@ package registers_pkg is
    constant reg_counter1     : integer := 16#59#;
    constant reg_counter_cfg  : integer := 16#5C#;
 
+   constant reg_pwm_div0     : integer := 16#60#;
+   constant reg_pwm_div1     : integer := 16#61#;
+   constant reg_pwm_div2     : integer := 16#62#;
+   constant reg_pwm_div3     : integer := 16#63#;
+   constant reg_pwm_div4     : integer := 16#64#;
+   constant reg_pwm_div5     : integer := 16#65#;
+   constant reg_pwm_div6     : integer := 16#66#;
+   constant reg_pwm_div7     : integer := 16#67#;
+   constant reg_pwm_period0  : integer := 16#68#;
+   constant reg_pwm_period1  : integer := 16#69#;
+   constant reg_pwm_period2  : integer := 16#6A#;
+   constant reg_pwm_period3  : integer := 16#6B#;
+   constant reg_pwm_period4  : integer := 16#6C#;
+   constant reg_pwm_period5  : integer := 16#6D#;
+   constant reg_pwm_period6  : integer := 16#6E#;
+   constant reg_pwm_period7  : integer := 16#6F#;
+
    constant reg_runtime0     : integer := 16#F0#;
    constant reg_runtime1     : integer := 16#F1#;
    constant reg_demoseq      : integer := 16#F8#;
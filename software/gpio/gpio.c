@@ -26,18 +26,41 @@
  */
 
 
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE	// For pthread_setaffinity_np
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <fcntl.h>
+#include <grp.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/spi/spidev.h>
 
 #include <wiringPi.h>
+#include <wiringPiSPI.h>
 #include <gertboard.h>
 
+#include "pixid.h"
+
 #ifndef TRUE
 #  define	TRUE	(1==1)
 #  define	FALSE	(1==2)
@@ -50,24 +73,64 @@
  * PiXi-200 Specific definitions
  ***********************************************************************
 */
-#define FPGAFILE     "/home/pixi-200/pixi.bin"          // FPGA default configuration file
-#define FPGADEMO_001 "/home/pixi-200/pixi_demo_001.bin" // FPGA demo configuration file
-#define FPGADEMO_002 "/home/pixi-200/pixi_demo_002.bin" // FPGA demo configuration file
-#define FPGADEMO_003 "/home/pixi-200/pixi_demo_003.bin" // FPGA demo configuration file
-#define FPGADEMO_004 "/home/pixi-200/pixi_demo_004.bin" // FPGA demo configuration file
-#define FPGADEMO_005 "/home/pixi-200/pixi_demo_005.bin" // FPGA demo configuration file
-#define FPGADEMO_006 "/home/pixi-200/pixi_demo_006.bin" // FPGA demo configuration file
+#define PIXI_IMAGE_DIR "/home/pixi-200"                 // FPGA image store
+#define PIXI_IMAGE_MANIFEST "pixi-images.manifest"      // Image store index, in PIXI_IMAGE_DIR
+#define PIXI_IMAGE_DEFAULT "pixi"                       // FPGA default configuration (pixi.bin)
+#define PIXI_IMAGE_MAX 32                               // Max. no. of images in the store
+#define PIXI_PROG_ATTEMPTS 3                            // Loads tried before giving up
+#define PIXI_PROG_VERIFY_US 100000                      // Max. wait for a new build to answer over SPI
 #define PROG_PIN 6                                      // GPIO(6)
 #define INIT_PIN 2                                      // GPIO(2) Note this pin is different for a rev1 or rev 2 board but wiringPi sorts this out very nicely!
 #define CCLK_PIN 0                                      // GPIO(0)
 #define DATA_PIN 1                                      // GPIO(1)
+#define BCM_GPIO_OFFSET 0x200000                        // GPIO block, from the peripheral base
+#define BCM_GPIO_GPSET0 7                               // GPSET0 word offset in the GPIO block
+#define BCM_GPIO_GPCLR0 10                              // GPCLR0 word offset in the GPIO block
+#define PIXI_PROG_CHUNK 16384                           // Decompressed bitstream ring: bytes per slot
+#define PIXI_PROG_SLOTS 8                               // Decompressed bitstream ring: no. of slots
+#define PIXI_PROG_GZIP "/bin/gzip"                      // Decompressors for .bin.gz...
+#define PIXI_PROG_ZSTD "/usr/bin/zstd"                  // ...and .bin.zst bitstreams (run without a shell)
+#define PIXI_SPI_SPEED 8000000                          // FPGA SPI clock (Hz)
+#define PIXI_BATCH_MAX 64                               // Max. no. of register frames in one batched SPI transfer
+#define PIXI_ASYNC_SIZE 256                             // Async SPI request ring size (must be a power of 2)
+#define PIXI_STATS_BUCKETS 128                          // SPI latency histogram buckets (4 per power of 2 ns)
+#define PIXI_BURST_BYTES 256                            // Max. data bytes in one burst transfer (258-byte frame)
+#define PIXI_SAMPLE_REGS 16                             // Max. no. of registers read per sample
+#define PIXI_SAMPLE_RING 4096                           // Sample ring size (must be a power of 2)
+#define PIXI_LCD_STATE "/dev/shm/pixi-lcd"              // LCD / VFD framebuffer, shared by all gpio commands
+#define PIXI_SHADOW_STATE "/dev/shm/pixi-shadow"        // FPGA write-register shadow copy, shared by all gpio commands
+#define PIXI_LCD_ROWS 2                                 // LCD / VFD display RAM: rows...
+#define PIXI_LCD_COLS 40                                // ...and characters per row
+#define PIXI_LCD_FIFO_DEPTH 96                          // Display FIFO entries (lcd_fifo DEPTH in pixi_top.vhd)
+#define PIXI_LCD_STREAM_MAX 256                         // Display entries queued before they must be sent
+#define PIXI_FPGA_CLOCK 33333333                        // FPGA system clock (clk_33m, Hz)
+#define PIXI_PWMSEQ_DEPTH 64                            // PWM sequencer FIFO frames (pwm_fifo DEPTH in pixi_top.vhd)
+#define PIXI_PWMSEQ_RING 1024                           // PWM sequencer host-side frame ring (must be a power of 2)
+#define PIXI_PWMSEQ_DATA 0x4a                           // reg_pwm_seq_data: sequencer frames, four words (PWM 4..7) each
+#define PIXI_PWMSEQ_STATUS 0x4d                         // reg_pwm_seq_status: FIFO level; writing it starts a new frame
+#define PIXI_PWM_COMMIT 0x4c                            // reg_pwm_commit: latch PWM 0..7 (bits 7..0) on one clock edge
+#define PIXI_PWM_DIV 0x60                               // reg_pwm_div0..7: clk_33m cycles per PWM count, less one
+#define PIXI_PWM_PERIOD 0x68                            // reg_pwm_period0..7: PWM counts per cycle, 0 = default 50Hz timebase
+
+// Diagnostic tracing. Build with -DPIXI_TRACE=0 to compile the trace calls out
+// altogether; otherwise they print to stderr when the verbosity (-d) allows.
+#ifndef PIXI_TRACE
+#  define PIXI_TRACE 1
+#endif
+
+#if PIXI_TRACE
+#  define pixi_trace(level, ...) do { if (pixiVerbose >= (level)) fprintf (stderr, __VA_ARGS__) ; } while (0)
+#else
+#  define pixi_trace(level, ...) do { } while (0)
+#endif
 
 
 static int wpMode ;
+static int pixiVerbose = 0 ;                            // Diagnostic level, raised by each -d
 
 char *usage = "Usage: gpio -v\n"
               "       gpio -h\n"
-              "       gpio [-g] <read/write/pwm/mode> ...\n"
+              "       gpio [-d ...] [-g] <read/write/pwm/mode> ...\n"
               "       gpio [-p] <read/write/mode> ...\n"
 	      "       gpio readall\n"
 	      "       gpio unexportall/exports ...\n"
@@ -79,9 +142,24 @@ char *usage = "Usage: gpio -v\n"
 	      "       gpio load spi/i2c\n"
 	      "       gpio gbr <channel>\n"
 	      "       gpio gbw <channel> <value>\n"
-	      "       gpio pixi_prog\n"
+	      "       gpio pixi_prog [fast]\n"
+	      "       gpio fpga_list\n"
+	      "       gpio fpga_index\n"
+	      "       gpio fpga_load <name> [fast]\n"
+	      "       gpio fpga_bench <name> [count] [real]\n"
 	      "       gpio spi_set <address> <data>\n"
-	      "       gpio spi_get <address> <data>" ;	// No trailing newline needed here.
+	      "       gpio spi_get <address> <data>\n"
+	      "       gpio spi_batch <channel> <w:address:data | r:address> ...\n"
+	      "       gpio spi_setmask <channel> <address> <data> <mask>\n"
+	      "       gpio spi_stress <count> [cpu]\n"
+	      "       gpio spi_selftest\n"
+	      "       gpio spi_stats <channel> <count> [address]\n"
+	      "       gpio spi_sample <channel> <reg,...> <rate> <count> [csv|bin]\n"
+	      "       gpio spi_mirror <address> [max_age_ms]\n"
+	      "       gpio pixi_lcdredraw\n"
+	      "       gpio pixi_pwmstream <file|-> [1|50]\n"
+	      "       gpio pwm_freq <pin> <hz> [bits]\n"
+	      "       gpio pwm_skew [count]" ;	// No trailing newline needed here.
 
 
 /*
@@ -826,6 +904,617 @@ static void doPwmClock (int argc, char *argv [])
 }
 
 
+/*
+ * pixi_daemon:
+ *	Client side of pixid, the SPI daemon (software/pixid). If pixid is
+ *	listening when a channel is first opened, all register access goes
+ *	through it instead of spidev, so it can't interleave with other
+ *	programs using the PiXi. Set PIXI_DIRECT in the environment to bypass
+ *	the daemon. Only single-word frames can go through pixid; multi-word
+ *	bursts fail with EOPNOTSUPP.
+ *********************************************************************************
+ */
+
+static int pixiDaemonFd = -1 ;
+static int pixiDaemonTried = FALSE ;
+static uint32_t pixiDaemonTag ;
+static pthread_mutex_t pixiDaemonLock = PTHREAD_MUTEX_INITIALIZER ;
+
+static void pixi_daemon_connect (void)
+{
+  struct sockaddr_un addr ;
+  const char *path = getenv ("PIXID_SOCKET") ;
+
+  pixiDaemonTried = TRUE ;
+  if (getenv ("PIXI_DIRECT") != NULL)
+    return ;
+  if (path == NULL)
+    path = PIXID_SOCKET ;
+
+  if ((pixiDaemonFd = socket (AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+    return ;
+
+  memset (&addr, 0, sizeof (addr)) ;
+  addr.sun_family = AF_UNIX ;
+  strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1) ;
+
+  if (connect (pixiDaemonFd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+  {
+    close (pixiDaemonFd) ;
+    pixiDaemonFd = -1 ;
+    return ;
+  }
+  pixi_trace (1, "Using pixid on %s\n", path) ;
+}
+
+// Send a request and wait for its reply. Returns 0, or -1 with errno set.
+static int pixi_daemon_call (pixid_request *request, pixid_reply *reply)
+{
+  int length ;
+
+  pthread_mutex_lock (&pixiDaemonLock) ;
+  request->tag = ++pixiDaemonTag ;
+  if (send (pixiDaemonFd, request, PIXID_REQUEST_SIZE (request->count), 0) < 0)
+    length = -1 ;
+  else
+    length = recv (pixiDaemonFd, reply, sizeof (*reply), 0) ;
+  pthread_mutex_unlock (&pixiDaemonLock) ;
+
+  if (length < 0)
+    return -1 ;
+  if ((length < (int)PIXID_REPLY_SIZE (0)) || (reply->tag != request->tag))
+  {
+    errno = EPROTO ;
+    return -1 ;
+  }
+  if (reply->status < 0)
+  {
+    errno = -reply->status ;
+    return -1 ;
+  }
+  return 0 ;
+}
+
+// Translate register frames (address, control, data) into pixid operations
+static int pixi_daemon_frames (int channel, uint8_t (*frame)[4], int count)
+{
+  pixid_request request ;
+  pixid_reply reply ;
+  int i ;
+
+  for (i = 0 ; i < count ; i++)
+  {
+    if      ((frame [i][1] == 0x40) || (frame [i][1] == 0x50)) request.op [i].op = PIXID_SET ;
+    else if ((frame [i][1] == 0x80) || (frame [i][1] == 0x90)) request.op [i].op = PIXID_GET ;
+    else
+    {
+      errno = EOPNOTSUPP ;
+      return -1 ;
+    }
+    request.op [i].channel  = channel ;
+    request.op [i].address  = frame [i][0] ;
+    request.op [i].reserved = 0 ;
+    request.op [i].data     = (frame [i][2] << 8) | frame [i][3] ;
+    request.op [i].mask     = 0 ;
+  }
+  request.count    = count ;
+  request.reserved = 0 ;
+
+  if (pixi_daemon_call (&request, &reply) < 0)
+    return -1 ;
+
+  for (i = 0 ; i < count ; i++)
+  {
+    if (reply.result [i] < 0)
+    {
+      errno = -reply.result [i] ;
+      return -1 ;
+    }
+    frame [i][2] = reply.result [i] >> 8 ;
+    frame [i][3] = reply.result [i] ;
+  }
+  return 0 ;
+}
+
+static int pixi_daemon_transfer (int channel, unsigned char *buffer, int length)
+{
+  if (length != 4)
+  {
+    errno = EOPNOTSUPP ;
+    return -1 ;
+  }
+  return (pixi_daemon_frames (channel, (uint8_t (*)[4])buffer, 1) < 0) ? -1 : length ;
+}
+
+// Masked write, resolved by the daemon. Returns the previous value, or -1.
+static int pixi_daemon_set_masked (int channel, int address, int data, int mask)
+{
+  pixid_request request ;
+  pixid_reply reply ;
+
+  memset (&request, 0, sizeof (request)) ;
+  request.count          = 1 ;
+  request.op [0].op      = PIXID_SET_MASKED ;
+  request.op [0].channel = channel ;
+  request.op [0].address = address ;
+  request.op [0].data    = data ;
+  request.op [0].mask    = mask ;
+
+  if (pixi_daemon_call (&request, &reply) < 0)
+    return -1 ;
+  if (reply.result [0] < 0)
+  {
+    errno = -reply.result [0] ;
+    return -1 ;
+  }
+  return reply.result [0] ;
+}
+
+
+// Have pixid reload its shadow copy of both channels, e.g. after the FPGA is reprogrammed
+static void pixi_daemon_reset (void)
+{
+  pixid_request request ;
+  pixid_reply reply ;
+  int channel ;
+
+  if (!pixiDaemonTried)
+    pixi_daemon_connect () ;
+  if (pixiDaemonFd < 0)
+    return ;
+
+  memset (&request, 0, sizeof (request)) ;
+  request.count = 2 ;
+  for (channel = 0 ; channel < 2 ; channel++)
+  {
+    request.op [channel].op      = PIXID_RESET ;
+    request.op [channel].channel = channel ;
+  }
+  if (pixi_daemon_call (&request, &reply) < 0)
+    fprintf (stderr, "Unable to reset the pixid shadow copy: %s\n", strerror (errno)) ;
+}
+
+
+/*
+ * pixi_spi_open:
+ *	Open and configure a PiXi-200 SPI channel once per process.
+ *	wiringPi keeps the file descriptor, so every later transfer on the
+ *	channel is a single ioctl. Open channels are closed again at exit.
+ *********************************************************************************
+ */
+
+static int spiChannelOpen [2] ;
+
+static void pixi_spi_close_all (void)
+{
+  int channel ;
+
+  for (channel = 0 ; channel < 2 ; channel++)
+  {
+    if (spiChannelOpen [channel] && (pixiDaemonFd < 0))
+      close (wiringPiSPIGetFd (channel)) ;
+    spiChannelOpen [channel] = FALSE ;
+  }
+
+  if (pixiDaemonFd >= 0)
+  {
+    close (pixiDaemonFd) ;
+    pixiDaemonFd = -1 ;
+  }
+}
+
+void pixi_spi_open (int channel)
+{
+  static int closeRegistered = FALSE ;
+
+  channel &= 1 ;
+  if (spiChannelOpen [channel])
+    return ;
+
+  if (!pixiDaemonTried)
+    pixi_daemon_connect () ;
+
+  if ((pixiDaemonFd < 0) && (wiringPiSPISetup (channel, PIXI_SPI_SPEED) < 0)) { // setup for 8MHz
+    fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
+    exit(1);
+  }
+  spiChannelOpen [channel] = TRUE ;
+
+  if (!closeRegistered)
+  {
+    atexit (pixi_spi_close_all) ;
+    closeRegistered = TRUE ;
+  }
+}
+
+
+/*
+ * pixi_spi_stats:
+ *	Opt-in SPI instrumentation. When enabled, each transfer records its
+ *	frame & byte counts, any error and its latency (CLOCK_MONOTONIC) in a
+ *	histogram. Every thread has its own counters, so recording takes no
+ *	locks. The lock is only taken when a thread records for the first time
+ *	and when the counters are summed. Set PIXI_SPI_STATS in the environment
+ *	to dump the totals to stderr at exit.
+ *********************************************************************************
+ */
+
+typedef struct
+{
+  unsigned long transfers ;       // ioctls
+  unsigned long frames ;          // 32-bit register frames (or burst transfers)
+  unsigned long long bytes ;
+  unsigned long errors ;
+  unsigned long long totalNs ;
+  unsigned long long maxNs ;
+  unsigned long histogram [PIXI_STATS_BUCKETS] ;
+} pixi_spi_stats ;
+
+typedef struct pixi_spi_thread_stats
+{
+  pixi_spi_stats channel [2] ;
+  struct pixi_spi_thread_stats *next ;
+} pixi_spi_thread_stats ;
+
+static volatile int pixiStatsEnabled ;
+static struct timespec pixiStatsStart ;
+static pixi_spi_thread_stats *pixiStatsList ;
+static pthread_mutex_t pixiStatsLock = PTHREAD_MUTEX_INITIALIZER ;
+static __thread pixi_spi_thread_stats *pixiThreadStats ;
+
+static unsigned long long pixi_stats_ns (const struct timespec *from, const struct timespec *to)
+{
+  return (unsigned long long)(to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec ;
+}
+
+// Histogram bucket: the top bit of the latency plus the next two bits
+static int pixi_stats_bucket (unsigned long long ns)
+{
+  int msb ;
+
+  if (ns < 4)
+    return (int)ns ;
+  msb = 63 - __builtin_clzll (ns) ;
+  if (msb > 31)
+    return PIXI_STATS_BUCKETS - 1 ;
+  return (msb << 2) | (int)((ns >> (msb - 2)) & 3) ;
+}
+
+// Lowest latency (ns) that falls in a bucket
+static unsigned long long pixi_stats_bucket_ns (int bucket)
+{
+  if (bucket < 8)
+    return bucket ;
+  return (unsigned long long)(4 | (bucket & 3)) << ((bucket >> 2) - 2) ;
+}
+
+static void pixi_spi_stats_record (int channel, int frames, int bytes, int result, const struct timespec *start)
+{
+  pixi_spi_stats *stats ;
+  struct timespec end ;
+  unsigned long long ns ;
+
+  clock_gettime (CLOCK_MONOTONIC, &end) ;
+  ns = pixi_stats_ns (start, &end) ;
+
+  if (pixiThreadStats == NULL)
+  {
+    if ((pixiThreadStats = calloc (1, sizeof (pixi_spi_thread_stats))) == NULL)
+      return ;
+    pthread_mutex_lock (&pixiStatsLock) ;
+    pixiThreadStats->next = pixiStatsList ;
+    pixiStatsList = pixiThreadStats ;
+    pthread_mutex_unlock (&pixiStatsLock) ;
+  }
+
+  stats = &pixiThreadStats->channel [channel & 1] ;
+  stats->transfers++ ;
+  stats->frames  += frames ;
+  stats->bytes   += bytes ;
+  stats->totalNs += ns ;
+  if (result < 0)
+    stats->errors++ ;
+  if (ns > stats->maxNs)
+    stats->maxNs = ns ;
+  stats->histogram [pixi_stats_bucket (ns)]++ ;
+}
+
+/*
+ * pixi_state_map:
+ *	Map one of gpio's state files in /dev/shm, shared by every gpio
+ *	process. /dev/shm is world-writable and gpio runs setuid root, so the
+ *	file is only used if it is a plain file (no symlinks, no extra hard
+ *	links) owned by us and writable by nobody else; it is created 0600.
+ *	A file of the wrong size is reset to 'initial'. Returns the mapping,
+ *	with its descriptor (for flock) in *fd, or NULL if the file can't be
+ *	trusted, in which case the caller keeps a private copy.
+ *********************************************************************************
+ */
+
+static void *pixi_state_map (const char *path, const void *initial, size_t size, int *fd)
+{
+  struct stat st ;
+  void *map = MAP_FAILED ;
+
+  if ((*fd = open (path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0)
+    return NULL ;
+
+  flock (*fd, LOCK_EX) ;
+  if ((fstat (*fd, &st) == 0) && S_ISREG (st.st_mode) && (st.st_nlink == 1) &&
+      (st.st_uid == geteuid ()) && ((st.st_mode & 0077) == 0))
+  {
+    if ((st.st_size == (off_t)size) || ((ftruncate (*fd, 0) == 0) && (pwrite (*fd, initial, size, 0) == (ssize_t)size)))
+      map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0) ;
+  }
+  flock (*fd, LOCK_UN) ;
+
+  if (map == MAP_FAILED)
+  {
+    close (*fd) ;
+    *fd = -1 ;
+    return NULL ;
+  }
+  return map ;
+}
+
+
+/*
+ * pixi_shadow:
+ *	Host-side copy of the FPGA write registers (wreg in pixi_top.vhd), one per
+ *	SPI channel. It lives in PIXI_SHADOW_STATE, so it outlives each gpio
+ *	command and is shared by all of them (and all their threads). Every
+ *	write frame gpio sends is recorded, by pixi_spi_transfer() and
+ *	pixi_spi_batch_submit(), under a lock held across the transfer, so the
+ *	copy follows the order the FPGA saw the writes in. Masked writes are
+ *	worked out from it and sent as a single write, with no read-back first;
+ *	this also works for write-only registers such as the PI GPIO config.
+ *	Writes made without gpio (libpixi, Python) are not seen. The copy goes
+ *	back to the reset values when the FPGA is reprogrammed. Without
+ *	/dev/shm, or if the file there can't be trusted (see pixi_state_map),
+ *	it is kept for the one process only.
+ *********************************************************************************
+ */
+
+typedef struct
+{
+  uint16_t reg [2][256] ;
+} pixi_shadow ;
+
+static pixi_shadow *pixiShadow ;
+static int pixiShadowFd = -1 ;
+static int pixiShadowDepth ;      // Lock nesting (only touched by the thread holding pixiShadowLock)
+static pthread_mutex_t pixiShadowLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP ;
+
+// Registers whose read value mirrors the last write (see rreg assignments in pixi_top.vhd)
+static const uint8_t pixiReadbackRegs [] =
+{
+  0x03, 0x04, 0x05, 0x06, 0x07,                   // reg_test3..7 (reg_test4 reads back inverted)
+  0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D,       // GPIO mode registers
+  0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, // PWM control registers (ENABLE_PWM_READBACK)
+} ;
+
+// The FPGA reset values of the write registers
+static void pixi_shadow_defaults (pixi_shadow *shadow)
+{
+  int channel ;
+
+  memset (shadow, 0, sizeof (*shadow)) ;
+  for (channel = 0 ; channel < 2 ; channel++)
+    shadow->reg [channel][0x39] = 0x8000 ; // reg_vfd_ctrl: default LCD/VFD timing
+}
+
+// Take the shadow lock: other threads, and other gpio processes through flock. It nests.
+static pixi_shadow *pixi_shadow_open (void) ;
+
+static void pixi_shadow_lock (void)
+{
+  pixi_shadow_open () ;
+  pthread_mutex_lock (&pixiShadowLock) ;
+  if ((pixiShadowDepth++ == 0) && (pixiShadowFd >= 0))
+    flock (pixiShadowFd, LOCK_EX) ;
+}
+
+static void pixi_shadow_unlock (void)
+{
+  if ((--pixiShadowDepth == 0) && (pixiShadowFd >= 0))
+    flock (pixiShadowFd, LOCK_UN) ;
+  pthread_mutex_unlock (&pixiShadowLock) ;
+}
+
+static pixi_shadow *pixi_shadow_open (void)
+{
+  static pixi_shadow local ;
+  pixi_shadow *map ;
+
+  if (pixiShadow != NULL)
+    return pixiShadow ;
+
+  pthread_mutex_lock (&pixiShadowLock) ;
+  if (pixiShadow == NULL)
+  {
+    pixi_shadow_defaults (&local) ;
+    map = pixi_state_map (PIXI_SHADOW_STATE, &local, sizeof (local), &pixiShadowFd) ;
+    __sync_synchronize () ;
+    pixiShadow = (map != NULL) ? map : &local ;
+  }
+  pthread_mutex_unlock (&pixiShadowLock) ;
+  return pixiShadow ;
+}
+
+// Record a value written to the FPGA
+static void pixi_shadow_update (int channel, int address, int data)
+{
+  pixi_shadow_lock () ;
+  pixiShadow->reg [channel & 1][address & 0xff] = data & 0xffff ;
+  pixi_shadow_unlock () ;
+}
+
+// Record a frame that has been sent: spi_slave latches the 16 bits after the
+// address and control bytes into the register when the write bit (0x40) is set
+static void pixi_shadow_sent (int channel, int address, int control, int data)
+{
+  if (control & 0x40)
+    pixi_shadow_update (channel, address, data) ;
+}
+
+// Last value written to a register (or its reset value)
+int pixi_shadow_get (int channel, int address)
+{
+  return pixi_shadow_open ()->reg [channel & 1][address & 0xff] ;
+}
+
+// Back to the reset values, e.g. when the FPGA is reprogrammed. pixid's copy too.
+void pixi_shadow_reset (void)
+{
+  pixi_shadow_lock () ;
+  pixi_shadow_defaults (pixiShadow) ;
+  pixi_shadow_unlock () ;
+  pixi_daemon_reset () ;
+}
+
+
+// Single SPI transfer through pixid or wiringPi, timed when instrumentation is enabled
+// Write frames are recorded in the shadow copy.
+static int pixi_spi_transfer (int channel, unsigned char *buffer, int length)
+{
+  struct timespec start ;
+  int write = (length >= 4) && (buffer [1] & 0x40) ;
+  int address = buffer [0] ;
+  int control = buffer [1] ;
+  int data = (length >= 4) ? (buffer [2] << 8) | buffer [3] : 0 ;
+  int result ;
+
+  if (write)
+    pixi_shadow_lock () ;
+
+  if (!pixiStatsEnabled)
+    result = (pixiDaemonFd >= 0) ? pixi_daemon_transfer (channel, buffer, length) : wiringPiSPIDataRW (channel, buffer, length) ;
+  else
+  {
+    clock_gettime (CLOCK_MONOTONIC, &start) ;
+    result = (pixiDaemonFd >= 0) ? pixi_daemon_transfer (channel, buffer, length) : wiringPiSPIDataRW (channel, buffer, length) ;
+    pixi_spi_stats_record (channel, 1, length, result, &start) ;
+  }
+
+  if (write)
+  {
+    if (result >= 0)
+      pixi_shadow_sent (channel, address, control, data) ;
+    pixi_shadow_unlock () ;
+  }
+  return result ;
+}
+
+// Sum the counters of every thread for one channel
+void pixi_spi_stats_get (int channel, pixi_spi_stats *total)
+{
+  pixi_spi_thread_stats *thread ;
+  pixi_spi_stats *stats ;
+  int i ;
+
+  memset (total, 0, sizeof (*total)) ;
+  pthread_mutex_lock (&pixiStatsLock) ;
+  for (thread = pixiStatsList ; thread != NULL ; thread = thread->next)
+  {
+    stats = &thread->channel [channel & 1] ;
+    total->transfers += stats->transfers ;
+    total->frames    += stats->frames ;
+    total->bytes     += stats->bytes ;
+    total->errors    += stats->errors ;
+    total->totalNs   += stats->totalNs ;
+    if (stats->maxNs > total->maxNs)
+      total->maxNs = stats->maxNs ;
+    for (i = 0 ; i < PIXI_STATS_BUCKETS ; i++)
+      total->histogram [i] += stats->histogram [i] ;
+  }
+  pthread_mutex_unlock (&pixiStatsLock) ;
+}
+
+// Zero the counters of every thread and restart the rate clock. A thread that
+// is mid-transfer may still add its current transfer after the reset.
+void pixi_spi_stats_reset (void)
+{
+  pixi_spi_thread_stats *thread ;
+
+  pthread_mutex_lock (&pixiStatsLock) ;
+  for (thread = pixiStatsList ; thread != NULL ; thread = thread->next)
+    memset (thread->channel, 0, sizeof (thread->channel)) ;
+  clock_gettime (CLOCK_MONOTONIC, &pixiStatsStart) ;
+  pthread_mutex_unlock (&pixiStatsLock) ;
+}
+
+// Latency (ns) below which 'percent' of the transfers fall (to histogram resolution)
+unsigned long long pixi_spi_stats_percentile (const pixi_spi_stats *stats, int percent)
+{
+  unsigned long long target = ((unsigned long long)stats->transfers * percent + 99) / 100 ;
+  unsigned long long count = 0 ;
+  int i ;
+
+  for (i = 0 ; i < PIXI_STATS_BUCKETS ; i++)
+  {
+    count += stats->histogram [i] ;
+    if ((count >= target) && (count > 0))
+      return (pixi_stats_bucket_ns (i + 1) < stats->maxNs) ? pixi_stats_bucket_ns (i + 1) : stats->maxNs ;
+  }
+  return stats->maxNs ;
+}
+
+void pixi_spi_stats_dump (FILE *fp, int histogram)
+{
+  pixi_spi_stats stats ;
+  struct timespec now ;
+  double seconds ;
+  int channel ;
+  int i ;
+
+  clock_gettime (CLOCK_MONOTONIC, &now) ;
+  seconds = pixi_stats_ns (&pixiStatsStart, &now) / 1e9 ;
+
+  for (channel = 0 ; channel < 2 ; channel++)
+  {
+    pixi_spi_stats_get (channel, &stats) ;
+    if (stats.transfers == 0)
+      continue ;
+
+    fprintf (fp, "SPI channel %d: %lu transfers, %lu frames, %llu bytes, %lu errors\n",
+      channel, stats.transfers, stats.frames, stats.bytes, stats.errors) ;
+    fprintf (fp, "  rate: %.0f transfers/s, %.0f frames/s, %.0f bytes/s over %.3fs\n",
+      stats.transfers / seconds, stats.frames / seconds, stats.bytes / seconds, seconds) ;
+    fprintf (fp, "  latency (us): mean %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+      stats.totalNs / 1000.0 / stats.transfers,
+      pixi_spi_stats_percentile (&stats, 50) / 1000.0,
+      pixi_spi_stats_percentile (&stats, 99) / 1000.0,
+      stats.maxNs / 1000.0) ;
+
+    if (histogram)
+      for (i = 0 ; i < PIXI_STATS_BUCKETS ; i++)
+        if (stats.histogram [i] != 0)
+          fprintf (fp, "  %10lluns+ : %lu\n", pixi_stats_bucket_ns (i), stats.histogram [i]) ;
+  }
+}
+
+static void pixi_spi_stats_exit (void)
+{
+  pixi_spi_stats_dump (stderr, FALSE) ;
+}
+
+// Start (or stop) recording. The rate figures are measured from the first call.
+void pixi_spi_stats_enable (int enable)
+{
+  static int exitRegistered = FALSE ;
+
+  if (enable && (pixiStatsStart.tv_sec == 0) && (pixiStatsStart.tv_nsec == 0))
+    clock_gettime (CLOCK_MONOTONIC, &pixiStatsStart) ;
+  pixiStatsEnabled = enable ;
+
+  if (enable && (getenv ("PIXI_SPI_STATS") != NULL) && !exitRegistered)
+  {
+    atexit (pixi_spi_stats_exit) ;
+    exitRegistered = TRUE ;
+  }
+}
+
+
 /*
  * doSPIset:
  *	gpio SPI register write ...
@@ -836,10 +1525,7 @@ int pixi_spi_set (int channel, int address, int data)
 {
   uint8_t outbuffer [4] ;
   
-//  if (wiringPiSPISetup (channel, 8000000) < 0) { // setup for 8MHz
-//    fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-//    exit(1);
-//  }
+  pixi_spi_open (channel) ;
  
   // load output buffer and send it out
   outbuffer [0] =  address & 0x00ff;
@@ -847,7 +1533,7 @@ int pixi_spi_set (int channel, int address, int data)
   outbuffer [2] = (data    & 0xff00) >> 8;
   outbuffer [3] =  data    & 0x00ff;
  
-  wiringPiSPIDataRW (channel, outbuffer, 4) ;
+  pixi_spi_transfer (channel, outbuffer, 4) ;
 
   return(outbuffer[3] + (outbuffer[2] << 8));
 }
@@ -863,10 +1549,7 @@ int pixi_spi_get (int channel, int address, int data)
 {
   uint8_t outbuffer [4] ;
 
-//  if (wiringPiSPISetup (channel, 8000000) < 0) { // setup for 8MHz
-//    fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-//    exit(1);
-//  }
+  pixi_spi_open (channel) ;
  
   // load output buffer and send it out
   outbuffer [0] =  address & 0x00ff;
@@ -874,39 +1557,456 @@ int pixi_spi_get (int channel, int address, int data)
   outbuffer [2] = (data    & 0xff00) >> 8;
   outbuffer [3] =  data    & 0x00ff;
  
-  wiringPiSPIDataRW (channel, outbuffer, 4) ;
+  pixi_spi_transfer (channel, outbuffer, 4) ;
 
   return(outbuffer[3] + (outbuffer[2] << 8));
 }
 
 
 /*
- * doPixiGPIOCheck
- * gpio test function
+ * pixi_spi_batch:
+ *	Queue a number of register reads / writes and send them to the PiXi-200
+ *	as a single SPI_IOC_MESSAGE ioctl. Each register access is still a
+ *	separate 32-bit frame (address, control, 16-bit data) as expected by
+ *	spi_slave.vhd, with chip-select released between frames (cs_change).
  *********************************************************************************
  */
 
-int pixi_gpiocheck (int test, int test_data)
+typedef struct
 {
-  int reg_a;
-  int reg_b;
-  int spi_dout;
-  int spi_din;
-  int invert = 0x0000;
-  int gpio_errors;
-  
+  int channel ;
+  int count ;
+  uint8_t  address [PIXI_BATCH_MAX] ; // Frame contents as queued (the frames are overwritten by the returned data)
+  uint8_t  control [PIXI_BATCH_MAX] ;
+  uint16_t data    [PIXI_BATCH_MAX] ;
+  uint8_t frame [PIXI_BATCH_MAX][4] ;
+  struct spi_ioc_transfer xfer [PIXI_BATCH_MAX] ;
+} pixi_spi_batch ;
+
+void pixi_spi_batch_init (pixi_spi_batch *batch, int channel)
+{
+  batch->channel = channel ;
+  batch->count   = 0 ;
+}
 
-  if (test == 1) {
-    reg_a = 0x20;
-    reg_b = 0x21;
-    // Setup GPIO1a for output (all bits)
-    pixi_spi_set(0, 0x27, 0x5555);
-    // Setup GPIO1b for input (all bits)
-    pixi_spi_set(0, 0x28, 0x0000);
-    // Setup GPIO1c for input (all bits)
-    pixi_spi_set(0, 0x29, 0x0000);
-  }
-  
+// Add a single frame to the batch. Returns the frame index (used to fetch the result) or -1 if the batch is full
+static int pixi_spi_batch_add (pixi_spi_batch *batch, int address, int control, int data)
+{
+  int i = batch->count ;
+  uint8_t *frame ;
+
+  if (i >= PIXI_BATCH_MAX)
+    return -1 ;
+
+  batch->address [i] = address & 0x00ff ;
+  batch->control [i] = control & 0x00ff ;
+  batch->data    [i] = data    & 0xffff ;
+
+  frame = batch->frame [i] ;
+  frame [0] =  address & 0x00ff;
+  frame [1] =  control & 0x00ff;
+  frame [2] = (data    & 0xff00) >> 8;
+  frame [3] =  data    & 0x00ff;
+
+  memset (&batch->xfer [i], 0, sizeof (batch->xfer [i])) ;
+  batch->xfer [i].tx_buf        = (unsigned long)frame ;
+  batch->xfer [i].rx_buf        = (unsigned long)frame ;
+  batch->xfer [i].len           = 4 ;
+  batch->xfer [i].speed_hz      = PIXI_SPI_SPEED ;
+  batch->xfer [i].bits_per_word = 8 ;
+  batch->xfer [i].cs_change     = 1 ; // Release chip-select between frames so the FPGA sees each one
+
+  batch->count++ ;
+  return i ;
+}
+
+int pixi_spi_batch_set (pixi_spi_batch *batch, int address, int data)
+{
+  return pixi_spi_batch_add (batch, address, 0x0040, data) ; // Enable write
+}
+
+int pixi_spi_batch_get (pixi_spi_batch *batch, int address)
+{
+  return pixi_spi_batch_add (batch, address, 0x0080, 0) ; // Enable read
+}
+
+// Data returned by the FPGA for frame 'index' of a submitted batch
+int pixi_spi_batch_result (pixi_spi_batch *batch, int index)
+{
+  return(batch->frame [index][3] + (batch->frame [index][2] << 8));
+}
+
+// Send all queued frames in one ioctl. If results is not NULL it receives the returned data for every frame.
+int pixi_spi_batch_submit (pixi_spi_batch *batch, int *results)
+{
+  struct timespec start ;
+  int writes = FALSE ;
+  int result ;
+  int i ;
+
+  if (batch->count == 0)
+    return 0 ;
+
+  pixi_spi_open (batch->channel) ;
+
+  batch->xfer [batch->count - 1].cs_change = 0 ; // Leave chip-select released after the last frame
+
+  for (i = 0 ; i < batch->count ; i++)
+    if (batch->control [i] & 0x40)
+      writes = TRUE ;
+  if (writes)
+    pixi_shadow_lock () ;
+
+  if (pixiStatsEnabled)
+    clock_gettime (CLOCK_MONOTONIC, &start) ;
+
+  if (pixiDaemonFd >= 0)
+    result = pixi_daemon_frames (batch->channel, batch->frame, batch->count) ;
+  else
+    result = ioctl (wiringPiSPIGetFd (batch->channel), SPI_IOC_MESSAGE (batch->count), batch->xfer) ;
+
+  if (pixiStatsEnabled)
+    pixi_spi_stats_record (batch->channel, batch->count, batch->count * 4, result, &start) ;
+
+  if (result < 0)
+  {
+    if (writes)
+      pixi_shadow_unlock () ;
+    fprintf (stderr, "SPI batch transfer failed: %s\n", strerror (errno));
+    return -1 ;
+  }
+
+  for (i = 0 ; i < batch->count ; i++)
+  {
+    pixi_shadow_sent (batch->channel, batch->address [i], batch->control [i], batch->data [i]) ;
+    if (results != NULL)
+      results [i] = pixi_spi_batch_result (batch, i) ;
+  }
+  if (writes)
+    pixi_shadow_unlock () ;
+
+  return 0 ;
+}
+
+
+/*
+ * pixi_spi_set_masked:
+ *	Set the bits of a register selected by mask, leaving the other bits as
+ *	they were last written. The new value is worked out from the shadow
+ *	copy so this is one SPI write. Returns the previous register value.
+ *********************************************************************************
+ */
+
+int pixi_spi_set_masked (int channel, int address, int data, int mask)
+{
+  int previous ;
+
+  pixi_spi_open (channel) ;
+
+  pixi_shadow_lock () ; // Nobody else may write the register between reading the copy and the write
+
+  if (pixiDaemonFd >= 0)  // pixid owns the real shadow copy, let it do the merge
+  {
+    if ((previous = pixi_daemon_set_masked (channel, address, data, mask)) >= 0)
+      pixi_shadow_update (channel, address, (previous & ~mask) | (data & mask)) ;
+  }
+  else
+  {
+    previous = pixi_shadow_get (channel, address) ;
+    pixi_spi_set (channel, address, (previous & ~mask) | (data & mask)) ;
+  }
+
+  pixi_shadow_unlock () ;
+  return previous ;
+}
+
+
+/*
+ * pixi_shadow_resync:
+ *	Reload the shadow copy from the hardware, for every register the FPGA
+ *	can read back (all in one batched transfer). Registers with no
+ *	read-back keep their last written (or reset) value.
+ *********************************************************************************
+ */
+
+int pixi_shadow_resync (int channel)
+{
+  pixi_spi_batch batch ;
+  int results [PIXI_BATCH_MAX] ;
+  int i ;
+
+  pixi_spi_batch_init (&batch, channel) ;
+  for (i = 0 ; i < (int)sizeof (pixiReadbackRegs) ; i++)
+    pixi_spi_batch_get (&batch, pixiReadbackRegs [i]) ;
+
+  if (pixi_spi_batch_submit (&batch, results) < 0)
+    return -1 ;
+
+  for (i = 0 ; i < batch.count ; i++)
+  {
+    if (pixiReadbackRegs [i] == 0x04)
+      results [i] = ~results [i] ; // reg_test4 reads back inverted
+    pixi_shadow_update (channel, pixiReadbackRegs [i], results [i]) ;
+  }
+
+  return 0 ;
+}
+
+
+/*
+ * pixi_spi_async:
+ *	Asynchronous register access. Callers push requests into a lock-free
+ *	ring and return straight away. A dedicated I/O thread drains the ring
+ *	and sends the queued requests as batched transfers (up to PIXI_BATCH_MAX
+ *	frames per ioctl). It then runs each request's completion callback, on
+ *	the I/O thread. Pushing never blocks: a full ring returns -1. Any
+ *	number of threads may push; requests are sent in the order they were
+ *	queued.
+ *
+ *	The ring is a bounded queue with a sequence number per slot. The I/O
+ *	thread sleeps on an eventfd when the ring is empty; producers only
+ *	signal it when it is asleep.
+ *********************************************************************************
+ */
+
+typedef void (*pixi_spi_callback) (void *context, int address, int result) ;
+
+typedef struct
+{
+  volatile unsigned sequence ;
+  int address ;
+  int control ;
+  int data ;
+  pixi_spi_callback callback ;
+  void *context ;
+} pixi_spi_request ;
+
+typedef struct
+{
+  pixi_spi_request ring [PIXI_ASYNC_SIZE] ;
+  volatile unsigned enqueuePos ;  // Next slot to fill (shared by producers)
+  unsigned dequeuePos ;           // Next slot to send (I/O thread only)
+  volatile unsigned completed ;   // No. of requests sent & called back
+  volatile int sleeping ;         // I/O thread is waiting on wakeFd
+  volatile int running ;
+  int channel ;
+  int wakeFd ;
+  pthread_t thread ;
+  pthread_mutex_t lock ;          // Only used to wait for completions in pixi_spi_async_flush
+  pthread_cond_t done ;
+} pixi_spi_queue ;
+
+static int pixi_spi_async_push (pixi_spi_queue *queue, int address, int control, int data, pixi_spi_callback callback, void *context)
+{
+  pixi_spi_request *request ;
+  unsigned pos = queue->enqueuePos ;
+  int diff ;
+  uint64_t one = 1 ;
+
+  for (;;)
+  {
+    request = &queue->ring [pos & (PIXI_ASYNC_SIZE - 1)] ;
+    diff = (int)(request->sequence - pos) ;
+    __sync_synchronize () ;
+
+    if (diff == 0)
+    {
+      if (__sync_bool_compare_and_swap (&queue->enqueuePos, pos, pos + 1))
+        break ;
+    }
+    else if (diff < 0)
+      return -1 ; // Ring full
+    pos = queue->enqueuePos ;
+  }
+
+  request->address  = address ;
+  request->control  = control ;
+  request->data     = data ;
+  request->callback = callback ;
+  request->context  = context ;
+  __sync_synchronize () ;
+  request->sequence = pos + 1 ; // Publish to the I/O thread
+
+  __sync_synchronize () ;
+  if (queue->sleeping)
+    write (queue->wakeFd, &one, sizeof (one)) ;
+
+  return (int)((pos + 1) & 0x7fffffff) ; // Ticket (use with pixi_spi_async_flush)
+}
+
+int pixi_spi_async_set (pixi_spi_queue *queue, int address, int data, pixi_spi_callback callback, void *context)
+{
+  return pixi_spi_async_push (queue, address, 0x0040, data, callback, context) ; // Enable write
+}
+
+int pixi_spi_async_get (pixi_spi_queue *queue, int address, pixi_spi_callback callback, void *context)
+{
+  return pixi_spi_async_push (queue, address, 0x0080, 0, callback, context) ; // Enable read
+}
+
+// Take up to PIXI_BATCH_MAX published requests off the ring. Returns the no. taken.
+static int pixi_spi_async_drain (pixi_spi_queue *queue, pixi_spi_request *requests)
+{
+  pixi_spi_request *request ;
+  int count = 0 ;
+
+  while (count < PIXI_BATCH_MAX)
+  {
+    request = &queue->ring [queue->dequeuePos & (PIXI_ASYNC_SIZE - 1)] ;
+    if (request->sequence != queue->dequeuePos + 1)
+      break ; // Empty, or the next producer hasn't finished filling its slot yet
+    __sync_synchronize () ;
+
+    requests [count++] = *request ;
+    __sync_synchronize () ;
+    request->sequence = queue->dequeuePos + PIXI_ASYNC_SIZE ; // Hand the slot back to the producers
+    queue->dequeuePos++ ;
+  }
+  return count ;
+}
+
+static void *pixi_spi_async_thread (void *arg)
+{
+  pixi_spi_queue *queue = (pixi_spi_queue *)arg ;
+  pixi_spi_request requests [PIXI_BATCH_MAX] ;
+  pixi_spi_batch batch ;
+  int results [PIXI_BATCH_MAX] ;
+  int count ;
+  int i ;
+  uint64_t value ;
+
+  while (queue->running)
+  {
+    count = pixi_spi_async_drain (queue, requests) ;
+    if (count == 0)
+    {
+      // Nothing queued: go to sleep, re-checking after raising the flag so a push can't be missed
+      queue->sleeping = TRUE ;
+      __sync_synchronize () ;
+      count = pixi_spi_async_drain (queue, requests) ;
+      if ((count == 0) && queue->running)
+        read (queue->wakeFd, &value, sizeof (value)) ;
+      queue->sleeping = FALSE ;
+      if (count == 0)
+        continue ;
+    }
+
+    pixi_spi_batch_init (&batch, queue->channel) ;
+    for (i = 0 ; i < count ; i++)
+      pixi_spi_batch_add (&batch, requests [i].address, requests [i].control, requests [i].data) ;
+
+    if (pixi_spi_batch_submit (&batch, results) < 0)
+      for (i = 0 ; i < count ; i++)
+        results [i] = -1 ;
+
+    for (i = 0 ; i < count ; i++)
+      if (requests [i].callback != NULL)
+        requests [i].callback (requests [i].context, requests [i].address, results [i]) ;
+
+    pthread_mutex_lock (&queue->lock) ;
+    queue->completed += count ;
+    pthread_cond_broadcast (&queue->done) ;
+    pthread_mutex_unlock (&queue->lock) ;
+  }
+  return NULL ;
+}
+
+// Start the I/O thread for an SPI channel, pinned to 'cpu' (or not pinned if cpu < 0)
+int pixi_spi_async_start (pixi_spi_queue *queue, int channel, int cpu)
+{
+  cpu_set_t cpus ;
+  unsigned i ;
+
+  for (i = 0 ; i < PIXI_ASYNC_SIZE ; i++)
+    queue->ring [i].sequence = i ;
+  queue->enqueuePos = 0 ;
+  queue->dequeuePos = 0 ;
+  queue->completed  = 0 ;
+  queue->sleeping   = FALSE ;
+  queue->running    = TRUE ;
+  queue->channel    = channel ;
+
+  if ((queue->wakeFd = eventfd (0, 0)) < 0)
+  {
+    fprintf (stderr, "Unable to create SPI queue eventfd: %s\n", strerror (errno)) ;
+    return -1 ;
+  }
+  pthread_mutex_init (&queue->lock, NULL) ;
+  pthread_cond_init  (&queue->done, NULL) ;
+
+  pixi_spi_open (channel) ; // Open from this thread, before the I/O thread uses it
+
+  if (pthread_create (&queue->thread, NULL, pixi_spi_async_thread, queue) != 0)
+  {
+    fprintf (stderr, "Unable to start SPI I/O thread\n") ;
+    close (queue->wakeFd) ;
+    return -1 ;
+  }
+
+  if (cpu >= 0)
+  {
+    CPU_ZERO (&cpus) ;
+    CPU_SET (cpu, &cpus) ;
+    if (pthread_setaffinity_np (queue->thread, sizeof (cpus), &cpus) != 0)
+      fprintf (stderr, "Unable to pin SPI I/O thread to CPU %d\n", cpu) ;
+  }
+  return 0 ;
+}
+
+// Barrier: wait until every request pushed before this call has been sent and called back
+void pixi_spi_async_flush (pixi_spi_queue *queue)
+{
+  unsigned target = queue->enqueuePos ;
+
+  pthread_mutex_lock (&queue->lock) ;
+  while ((int)(queue->completed - target) < 0)
+    pthread_cond_wait (&queue->done, &queue->lock) ;
+  pthread_mutex_unlock (&queue->lock) ;
+}
+
+// Flush outstanding requests and stop the I/O thread
+void pixi_spi_async_stop (pixi_spi_queue *queue)
+{
+  uint64_t one = 1 ;
+
+  pixi_spi_async_flush (queue) ;
+  queue->running = FALSE ;
+  __sync_synchronize () ;
+  write (queue->wakeFd, &one, sizeof (one)) ;
+  pthread_join (queue->thread, NULL) ;
+  close (queue->wakeFd) ;
+  pthread_mutex_destroy (&queue->lock) ;
+  pthread_cond_destroy  (&queue->done) ;
+}
+
+
+/*
+ * doPixiGPIOCheck
+ * gpio test function
+ *********************************************************************************
+ */
+
+int pixi_gpiocheck (int test, int test_data)
+{
+  int reg_a;
+  int reg_b;
+  int spi_dout;
+  int spi_din;
+  int invert = 0x0000;
+  int gpio_errors;
+  
+
+  if (test == 1) {
+    reg_a = 0x20;
+    reg_b = 0x21;
+    // Setup GPIO1a for output (all bits)
+    pixi_spi_set(0, 0x27, 0x5555);
+    // Setup GPIO1b for input (all bits)
+    pixi_spi_set(0, 0x28, 0x0000);
+    // Setup GPIO1c for input (all bits)
+    pixi_spi_set(0, 0x29, 0x0000);
+  }
+  
   if (test == 2) {
     reg_a = 0x20;
     reg_b = 0x22;
@@ -1079,10 +2179,7 @@ void doPixiGPIOCheck (void)
   int i;
   int gpio_errors = 0;
 
-  if (wiringPiSPISetup (0, 8000000) < 0) { // setup for 8MHz
-    fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-    exit(1);
-  }
+  pixi_spi_open (0) ;
  
   for (i = 0; i <= 255; i++)
   gpio_errors = gpio_errors + pixi_gpiocheck (1, i);
@@ -1148,10 +2245,7 @@ void doSPIset (int argc, char *argv [])
   address = atoi (argv [3]) ;
   data = atoi (argv [4]) ;
 
-  if (wiringPiSPISetup (channel, 8000000) < 0) { // setup for 8MHz
-    fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-    exit(1);
-  }
+  pixi_spi_open (channel) ;
  
   // load output buffer and send it out
   outbuffer [0] =  address & 0x00ff;
@@ -1159,8 +2253,11 @@ void doSPIset (int argc, char *argv [])
   outbuffer [2] = (data    & 0xff00) >> 8;
   outbuffer [3] =  data    & 0x00ff;
  
-  wiringPiSPIDataRW (channel, outbuffer, 4) ;
-  printf ("Returned: 0x%02x, 0x%02x, 0x%04x\n", outbuffer[0], outbuffer[1], outbuffer[3] | outbuffer[2] << 8);
+  pixi_spi_transfer (channel, outbuffer, 4) ;
+  if (pixiDaemonFd >= 0)  // pixid only returns the data word
+    printf ("Returned: 0x%04x\n", outbuffer[3] | outbuffer[2] << 8);
+  else
+    printf ("Returned: 0x%02x, 0x%02x, 0x%04x\n", outbuffer[0], outbuffer[1], outbuffer[3] | outbuffer[2] << 8);
  
   printf ("Done\n") ;
 }
@@ -1189,10 +2286,7 @@ void doSPIget (int argc, char *argv [])
   address = atoi (argv [3]) ;
   data = atoi (argv [4]) ;
 
-  if (wiringPiSPISetup (channel, 8000000) < 0) { // setup for 8MHz
-    fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-    exit(1);
-  }
+  pixi_spi_open (channel) ;
  
   // load output buffer and send it out
   outbuffer [0] =  address & 0x00ff;
@@ -1200,529 +2294,2965 @@ void doSPIget (int argc, char *argv [])
   outbuffer [2] = (data    & 0xff00) >> 8;
   outbuffer [3] =  data    & 0x00ff;
  
-  wiringPiSPIDataRW (channel, outbuffer, 4) ;
-  printf ("Returned: 0x%02x, 0x%02x, 0x%04x\n", outbuffer[0], outbuffer[1], outbuffer[3] | outbuffer[2] << 8);
+  pixi_spi_transfer (channel, outbuffer, 4) ;
+  if (pixiDaemonFd >= 0)  // pixid only returns the data word
+    printf ("Returned: 0x%04x\n", outbuffer[3] | outbuffer[2] << 8);
+  else
+    printf ("Returned: 0x%02x, 0x%02x, 0x%04x\n", outbuffer[0], outbuffer[1], outbuffer[3] | outbuffer[2] << 8);
  
   printf ("Done\n") ;
 }
 
 /*
- * spi_single_read:
- * gpio SPI single register read ...
+ * doSPIbatch:
+ *	gpio SPI batched register read / write ...
+ *	Each argument is either w:<address>:<data> or r:<address>, all sent in one transfer
  *********************************************************************************
  */
 
-int spi_single_read (int channel, int address)
+void doSPIbatch (int argc, char *argv [])
 {
-  int data = 0;
-  uint8_t outbuffer [4] ;
-  
-  if (wiringPiSPISetup (channel, 8000000) < 0) { // setup for 8MHz
-    fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-    exit(1);
+  pixi_spi_batch batch ;
+  int results [PIXI_BATCH_MAX] ;
+  int channel ;
+  int address ;
+  int data ;
+  int i ;
+  char *arg ;
+  char *end ;
+
+  if ((argc < 4) || (argc - 3 > PIXI_BATCH_MAX))
+  {
+    fprintf (stderr, "Usage: %s spi_batch channel w:address:data|r:address ... (max %d)\n", argv [0], PIXI_BATCH_MAX) ;
+    exit (1) ;
   }
- 
-  // load output buffer and send it out
-  outbuffer [0] =  address & 0x00ff;
-  outbuffer [1] =            0x0080; // Enable read
-  outbuffer [2] = (data    & 0xff00) >> 8;
-  outbuffer [3] =  data    & 0x00ff;
- 
-  wiringPiSPIDataRW (channel, outbuffer, 4) ;
-  printf ("Returned: 0x%02x, 0x%02x, 0x%04x\n", outbuffer[0], outbuffer[1], outbuffer[3] | outbuffer[2] << 8);
 
-  data = outbuffer[3] + (outbuffer[2] << 8);
-  printf("Single Read from ch. %d, address %d: %d\n", channel, address, data);
-  return(data);
-}
+  channel = atoi (argv [2]) ;
+  pixi_spi_batch_init (&batch, channel) ;
 
+  for (i = 3 ; i < argc ; i++)
+  {
+    arg = argv [i] ;
+    if (((arg [0] != 'w') && (arg [0] != 'r')) || (arg [1] != ':'))
+    {
+      fprintf (stderr, "%s: Invalid batch entry: %s\n", argv [0], arg) ;
+      exit (1) ;
+    }
 
-/*
- * pixi_write:
- * Basic function to write to the PiXi-200 over SPI ...
- * Supports byte, 16-bit or 32-bit writes
- * Also supports single write or n* writes
- *********************************************************************************
- */
-void pixi_spi_write(int channel, int address, int format, int num_writes, unsigned long *buffer)
-{
-   int i;
-   int num_bytes;
-   uint8_t outbuffer [258] ;
-   
-   if (wiringPiSPISetup (channel, 8000000) < 0) { // setup for 8MHz
-      fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-      exit(1);
-   }
+    address = strtol (arg + 2, &end, 0) ;
+    if (arg [0] == 'w')
+    {
+      if (*end != ':')
+      {
+        fprintf (stderr, "%s: Missing data in batch entry: %s\n", argv [0], arg) ;
+        exit (1) ;
+      }
+      data = strtol (end + 1, NULL, 0) ;
+      pixi_spi_batch_set (&batch, address, data) ;
+    }
+    else
+      pixi_spi_batch_get (&batch, address) ;
+  }
 
-     outbuffer [0] =  address & 0x00ff; // Address over SPI
-     if (format == 0) {
-        outbuffer [1] =            0x0040; // Enable 8-bit write
-        num_bytes = num_writes;
-     }
-     else if (format == 1) {
-        outbuffer [1] =            0x0050; // Enable 16-bit write
-        num_bytes = num_writes*2;
-     }
-     else {
-        outbuffer [1] =            0x0060; // Enable 32-bit write
-        num_bytes = num_writes*4;
-     }
-     
-     if (format == 0) { // Assemble output buffer with 8-bit data
-        for (i = 0; i < num_writes; i++) {
-           outbuffer [i*2+2] =  (buffer[i] & 0x000000ff);
-        }
-     }
-     else if (format == 1) { // Assemble output buffer with 16-bit data
-        for (i = 0; i < num_writes; i++) {
-           outbuffer [i*2+2] = ((buffer[i] & 0x0000ff00) >> 8);
-           outbuffer [i*2+3] =  (buffer[i] & 0x000000ff);
-        }
-     }
-     else { // Assemble output buffer with 32-bit data
-        for (i = 0; i < num_writes; i++) {
-           outbuffer [i*2+2] = ((buffer[i] & 0xff000000) >> 24);
-           outbuffer [i*2+3] = ((buffer[i] & 0x00ff0000) >> 16);
-           outbuffer [i*2+4] = ((buffer[i] & 0x0000ff00) >> 8);
-           outbuffer [i*2+5] =  (buffer[i] & 0x000000ff);
-        }
-     }
- 
-     printf ("Sending to ch%d: 0x%02x, 0x%02x, 0x%04x\n", channel, outbuffer[0], outbuffer[1], outbuffer[3] | outbuffer[2] << 8);
-     wiringPiSPIDataRW (channel, outbuffer, 2 + num_bytes) ;
-     printf ("Returned: 0x%02x, 0x%02x, 0x%04x\n", outbuffer[0], outbuffer[1], outbuffer[3] | outbuffer[2] << 8);
+  if (pixi_spi_batch_submit (&batch, results) < 0)
+    exit (1) ;
+
+  for (i = 0 ; i < batch.count ; i++)
+    printf ("0x%02x: 0x%04x\n", batch.frame [i][0], results [i]) ;
 }
 
 
 /*
- * pixi_read:
- * Basic function to data from the PiXi-200 over SPI ...
- * Supports byte, 16-bit or 32-bit writes
- * Also supports single read or n* reads
+ * doSPIsetmask:
+ *	gpio SPI masked register write ...
+ *	The shadow copy is first resynced from the hardware, so this is only
+ *	exact for registers the FPGA can read back.
  *********************************************************************************
  */
-void pixi_spi_read(int channel, int address, int format, int num_reads, unsigned long *buffer)
+
+void doSPIsetmask (int argc, char *argv [])
 {
-   int i;
-   int num_bytes;
-   uint8_t outbuffer [258] ;
-   
-   if (wiringPiSPISetup (channel, 8000000) < 0) { // setup for 8MHz
-      fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-      exit(1);
-   }
+  int channel ;
+  int address ;
+  int data ;
+  int mask ;
+  int previous ;
 
-     outbuffer [0] =  address & 0x00ff; // Address over SPI
-     if (format == 0) {
-        outbuffer [1] =            0x0080; // Enable 8-bit write
-        num_bytes = num_reads;
-     }
-     else if (format == 1) {
-        outbuffer [1] =            0x0090; // Enable 16-bit write
-        num_bytes = num_reads*2;
-     }
-     else {
-        outbuffer [1] =            0x00A0; // Enable 32-bit write
-        num_bytes = num_reads*4;
-     }
-     
-     if (format == 0) { // Assemble output buffer with 8-bit data
-        for (i = 0; i < num_reads; i++) {
-           outbuffer [i*2+2] =  (buffer[i] & 0x000000ff);
-        }
-     }
-     else if (format == 1) { // Assemble output buffer with 16-bit data
-        for (i = 0; i < num_reads; i++) {
-           outbuffer [i*2+2] = ((buffer[i] & 0x0000ff00) >> 8);
-           outbuffer [i*2+3] =  (buffer[i] & 0x000000ff);
-        }
-     }
-     else { // Assemble output buffer with 32-bit data
-        for (i = 0; i < num_reads; i++) {
-           outbuffer [i*2+2] = ((buffer[i] & 0xff000000) >> 24);
-           outbuffer [i*2+3] = ((buffer[i] & 0x00ff0000) >> 16);
-           outbuffer [i*2+4] = ((buffer[i] & 0x0000ff00) >> 8);
-           outbuffer [i*2+5] =  (buffer[i] & 0x000000ff);
-        }
-     }
- 
-     printf ("Sending to ch%d: 0x%02x, 0x%02x, 0x%04x\n", channel, outbuffer[0], outbuffer[1], outbuffer[3] | outbuffer[2] << 8);
-     wiringPiSPIDataRW (channel, outbuffer, 2 + num_bytes) ;
-     printf ("Returned: 0x%02x, 0x%02x, 0x%04x\n", outbuffer[0], outbuffer[1], outbuffer[3] | outbuffer[2] << 8);
+  if (argc != 6)
+  {
+    fprintf (stderr, "Usage: %s spi_setmask channel address data mask\n", argv [0]) ;
+    exit (1) ;
+  }
+
+  channel = atoi (argv [2]) ;
+  address = strtol (argv [3], NULL, 0) ;
+  data    = strtol (argv [4], NULL, 0) ;
+  mask    = strtol (argv [5], NULL, 0) ;
+
+  if (pixi_shadow_resync (channel) < 0)
+    exit (1) ;
+
+  previous = pixi_spi_set_masked (channel, address, data, mask) ;
+  printf ("Previous: 0x%04x, New: 0x%04x\n", previous, pixi_shadow_get (channel, address)) ;
 }
 
 
 /*
- * gpio1_mode:
- *	Basic function to select GPIO3 mode ...
+ * doSPIstress:
+ *	gpio SPI async queue stress test ...
+ *	Four producer threads each write & read back their own echo register
+ *	(reg_test3, 5, 6 & 7) through the async queue, checking every result.
  *********************************************************************************
  */
-void gpio1_mode(int mode)
+
+typedef struct
 {
-   unsigned long buffer[256];
+  pixi_spi_queue *queue ;
+  int address ;
+  int count ;
+  int expected ;
+  volatile int errors ;
+  volatile int full ;
+} pixi_spi_stress ;
+
+static void pixi_spi_stress_check (void *context, int address, int result)
+{
+  pixi_spi_stress *stress = (pixi_spi_stress *)context ;
 
-   if (mode == 0) {                  // All bits are configured for input
-      buffer[0] = (0x00000000);
-      pixi_spi_write(0, 0x27, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x28, 1, 1, buffer); // Configure middle byte
-      pixi_spi_write(0, 0x29, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 1) {             // All bits are configured as output, tied to gpio1_out register
-      buffer[0] = (0x00000001);
-      pixi_spi_write(0, 0x27, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x28, 1, 1, buffer); // Configure middle byte
-      pixi_spi_write(0, 0x29, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 2) {             // TBD (spare)
-      buffer[0] = (0x00000002);
-      pixi_spi_write(0, 0x27, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x28, 1, 1, buffer); // Configure middle byte
-      pixi_spi_write(0, 0x29, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 3) {             // TBD (spare)
-      buffer[0] = (0x00000003);
-      pixi_spi_write(0, 0x27, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x28, 1, 1, buffer); // Configure middle byte
-      pixi_spi_write(0, 0x29, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 8) {             // Factory Test Mode1
-      buffer[0] = (0x00000003);
-      pixi_spi_write(0, 0x27, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x28, 1, 1, buffer); // Configure middle byte
-      pixi_spi_write(0, 0x29, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 9) {             // Factory Test Mode2
-      buffer[0] = (0x00000003);
-      pixi_spi_write(0, 0x27, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x28, 1, 1, buffer); // Configure middle byte
-      pixi_spi_write(0, 0x29, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 10) {            // Factory Test Mode2
-      buffer[0] = (0x00000003);
-      pixi_spi_write(0, 0x27, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x28, 1, 1, buffer); // Configure middle byte
-      pixi_spi_write(0, 0x29, 1, 1, buffer); // Configure upper byte
-   }
+  // A completion for another register would mean the queue mixed requests up
+  if ((address != stress->address) || (result != stress->expected))
+  {
+    if (stress->errors++ == 0)
+      fprintf (stderr, "Register 0x%02x: read 0x%04x from 0x%02x, expected 0x%04x\n",
+        stress->address, result & 0xffff, address, stress->expected) ;
+  }
 }
- 
 
-/*
- * gpio2_mode:
- *	Basic function to select GPIO1 mode ...
+static void *pixi_spi_stress_thread (void *arg)
+{
+  pixi_spi_stress *stress = (pixi_spi_stress *)arg ;
+  int i ;
+
+  for (i = 0 ; i < stress->count ; i++)
+  {
+    // Wait for the previous read-back to complete before changing the expected value
+    pixi_spi_async_flush (stress->queue) ;
+    stress->expected = (stress->address << 8) | (i & 0xff) ;
+
+    while (pixi_spi_async_set (stress->queue, stress->address, stress->expected, NULL, NULL) < 0)
+    {
+      stress->full++ ;
+      sched_yield () ;
+    }
+    while (pixi_spi_async_get (stress->queue, stress->address, pixi_spi_stress_check, stress) < 0)
+    {
+      stress->full++ ;
+      sched_yield () ;
+    }
+  }
+  return NULL ;
+}
+
+void doSPIstress (int argc, char *argv [])
+{
+  static pixi_spi_queue queue ;
+  pixi_spi_stress stress [4] ;
+  pthread_t threads [4] ;
+  const int registers [4] = { 0x03, 0x05, 0x06, 0x07 } ;
+  int count ;
+  int cpu ;
+  int errors = 0 ;
+  int i ;
+
+  if ((argc < 3) || (argc > 4))
+  {
+    fprintf (stderr, "Usage: %s spi_stress count [cpu]\n", argv [0]) ;
+    exit (1) ;
+  }
+
+  count = atoi (argv [2]) ;
+  cpu   = (argc == 4) ? atoi (argv [3]) : -1 ;
+
+  if (pixi_spi_async_start (&queue, 0, cpu) < 0)
+    exit (1) ;
+
+  for (i = 0 ; i < 4 ; i++)
+  {
+    stress [i].queue   = &queue ;
+    stress [i].address = registers [i] ;
+    stress [i].count   = count ;
+    stress [i].errors  = 0 ;
+    stress [i].full    = 0 ;
+    pthread_create (&threads [i], NULL, pixi_spi_stress_thread, &stress [i]) ;
+  }
+
+  for (i = 0 ; i < 4 ; i++)
+  {
+    pthread_join (threads [i], NULL) ;
+    printf ("Register 0x%02x: %d errors, %d retries on full queue\n", stress [i].address, stress [i].errors, stress [i].full) ;
+    errors += stress [i].errors ;
+  }
+
+  pixi_spi_async_stop (&queue) ;
+  printf ("Total errors: %d\n", errors) ;
+}
+
+
+/*
+ * pixi_sampler:
+ *	Periodic register sampling. A sampling thread wakes at absolute
+ *	deadlines (clock_nanosleep with TIMER_ABSTIME, so timing errors don't
+ *	accumulate) and reads the whole register set in one batched transfer.
+ *	Each sample goes into a single-producer / single-consumer ring with its
+ *	CLOCK_MONOTONIC timestamp. If a deadline has already passed when the
+ *	thread gets to it, the missed periods are counted and skipped rather
+ *	than read in a burst. If the reader falls behind and the ring fills,
+ *	new samples are dropped and counted as overruns. A period whose transfer
+ *	fails is counted as an error and produces no sample.
  *********************************************************************************
  */
-void gpio2_mode(int mode)
+
+typedef struct
 {
-   unsigned long buffer[256];
+  uint64_t timestamp ;                    // CLOCK_MONOTONIC, ns
+  uint16_t value [PIXI_SAMPLE_REGS] ;
+} pixi_sample ;
 
-   if (mode == 0) {                  // All bits are configured for input
-      buffer[0] = (0x00000000);
-      pixi_spi_write(0, 0x2A, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x2B, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 1) {             // All bits are configured as output, tied to gpio3_out register
-      buffer[0] = (0x00000001);
-      pixi_spi_write(0, 0x2A, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x2B, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 2) {             // All bits are configured as output, specific for directly driving LCD or VFD. Tied to VFDLCD register
-      buffer[0] = (0x00000002);
-      pixi_spi_write(0, 0x2A, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x2B, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 3) {             // TBD (spare)
-      buffer[0] = (0x00000003);
-      pixi_spi_write(0, 0x2A, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x2B, 1, 1, buffer); // Configure upper byte
-   }
+typedef struct
+{
+  pixi_sample ring [PIXI_SAMPLE_RING] ;
+  volatile unsigned head ;                // Next slot to fill (sampling thread only)
+  volatile unsigned tail ;                // Next slot to read (reader only)
+  volatile int running ;
+  int channel ;
+  int count ;                             // No. of registers per sample
+  uint8_t address [PIXI_SAMPLE_REGS] ;
+  uint64_t periodNs ;
+  unsigned long limit ;                   // Stop after this many samples (0 = run until stopped)
+  unsigned long samples ;
+  unsigned long missed ;
+  unsigned long overruns ;
+  unsigned long errors ;
+  uint64_t startNs ;
+  uint64_t endNs ;
+  pthread_t thread ;
+} pixi_sampler ;
+
+static uint64_t pixi_sampler_now (void)
+{
+  struct timespec now ;
+
+  clock_gettime (CLOCK_MONOTONIC, &now) ;
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec ;
 }
- 
+
+static void *pixi_sampler_thread (void *arg)
+{
+  pixi_sampler *sampler = arg ;
+  pixi_spi_batch batch ;
+  struct timespec wake ;
+  uint64_t deadline ;
+  uint64_t now ;
+  int results [PIXI_SAMPLE_REGS] ;
+  pixi_sample *sample ;
+  int i ;
+
+  deadline = sampler->startNs = pixi_sampler_now () ;
+
+  while (sampler->running && ((sampler->limit == 0) || (sampler->samples < sampler->limit)))
+  {
+    wake.tv_sec  = deadline / 1000000000ULL ;
+    wake.tv_nsec = deadline % 1000000000ULL ;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+      ;
+
+    pixi_spi_batch_init (&batch, sampler->channel) ;
+    for (i = 0 ; i < sampler->count ; i++)
+      pixi_spi_batch_get (&batch, sampler->address [i]) ;
+    now = pixi_sampler_now () ;
+    if (pixi_spi_batch_submit (&batch, results) < 0)
+      sampler->errors++ ;                 // Nothing was read; leave a gap rather than push garbage
+    else if (sampler->head - sampler->tail < PIXI_SAMPLE_RING)
+    {
+      sample = &sampler->ring [sampler->head & (PIXI_SAMPLE_RING - 1)] ;
+      sample->timestamp = now ;
+      for (i = 0 ; i < sampler->count ; i++)
+        sample->value [i] = results [i] ;
+      __sync_synchronize () ;             // Publish the sample before the new head
+      sampler->head++ ;
+    }
+    else
+      sampler->overruns++ ;
+    sampler->samples++ ;
+
+    // Next deadline; skip (and count) any periods that have already gone by
+    deadline += sampler->periodNs ;
+    now = pixi_sampler_now () ;
+    if (now > deadline)
+    {
+      sampler->missed += (now - deadline) / sampler->periodNs + 1 ;
+      deadline += ((now - deadline) / sampler->periodNs + 1) * sampler->periodNs ;
+    }
+  }
+
+  sampler->endNs = pixi_sampler_now () ;
+  __sync_synchronize () ;
+  sampler->running = FALSE ;
+  return NULL ;
+}
+
+// Start sampling count registers every 1/rate seconds, stopping after limit samples (0 = never)
+int pixi_sampler_start (pixi_sampler *sampler, int channel, const uint8_t *address, int count, double rate, unsigned long limit)
+{
+  if ((count < 1) || (count > PIXI_SAMPLE_REGS) || (rate <= 0))
+    return -1 ;
+
+  memset (sampler, 0, sizeof (*sampler)) ;
+  memcpy (sampler->address, address, count) ;
+  sampler->channel  = channel ;
+  sampler->count    = count ;
+  sampler->periodNs = 1e9 / rate ;
+  sampler->limit    = limit ;
+  sampler->running  = TRUE ;
+  if (sampler->periodNs == 0)
+    sampler->periodNs = 1 ;
+
+  pixi_spi_open (channel) ;
+
+  if (pthread_create (&sampler->thread, NULL, pixi_sampler_thread, sampler) != 0)
+  {
+    fprintf (stderr, "Unable to start sampler thread\n") ;
+    return -1 ;
+  }
+  return 0 ;
+}
+
+// Take the oldest sample from the ring. Returns FALSE if the ring is empty.
+int pixi_sampler_read (pixi_sampler *sampler, pixi_sample *sample)
+{
+  if (sampler->tail == sampler->head)
+    return FALSE ;
+
+  __sync_synchronize () ;               // See the sample the head points past
+  *sample = sampler->ring [sampler->tail & (PIXI_SAMPLE_RING - 1)] ;
+  __sync_synchronize () ;
+  sampler->tail++ ;
+  return TRUE ;
+}
+
+void pixi_sampler_stop (pixi_sampler *sampler)
+{
+  sampler->running = FALSE ;
+  pthread_join (sampler->thread, NULL) ;
+}
+
+void pixi_sampler_report (pixi_sampler *sampler, FILE *fp)
+{
+  double seconds = (sampler->endNs - sampler->startNs) / 1e9 ;
+
+  fprintf (fp, "Samples: %lu in %.3fs, target %.1f/s, achieved %.1f/s\n",
+    sampler->samples, seconds, 1e9 / sampler->periodNs, (seconds > 0) ? sampler->samples / seconds : 0.0) ;
+  fprintf (fp, "Missed deadlines: %lu, ring overruns: %lu, SPI errors: %lu\n",
+    sampler->missed, sampler->overruns, sampler->errors) ;
+}
+
 
 /*
- * gpio3_mode:
- *	Basic function to select GPIO3 mode ...
+ * doSPIsample:
+ *	gpio register sampler ...
+ *	gpio spi_sample <channel> <reg,reg,...> <rate> <count> [csv|bin]
+ *	CSV lines are "time_us,reg,reg,..."; binary records are the 64-bit
+ *	timestamp (ns) followed by one 16-bit value per register, both in host
+ *	byte order. The summary goes to stderr.
  *********************************************************************************
  */
-void gpio3_mode(int mode)
+
+void doSPIsample (int argc, char *argv [])
 {
-   unsigned long buffer[256];
+  static pixi_sampler sampler ;
+  pixi_sample sample ;
+  uint8_t address [PIXI_SAMPLE_REGS] ;
+  uint64_t first = 0 ;
+  int binary = FALSE ;
+  int count = 0 ;
+  char *reg ;
+  int i ;
 
-   if (mode == 0) {                  // All bits are configured for input
-      buffer[0] = (0x00000000);
-      pixi_spi_write(0, 0x2C, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x2D, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 1) {             // All bits are configured as output, tied to gpio3_out register
-      buffer[0] = (0x00000001);
-      pixi_spi_write(0, 0x2C, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x2D, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 2) {             // All bits are configured as output, specific for directly driving LCD or VFD. Tied to VFDLCD register
-      buffer[0] = (0x00000002);
-      pixi_spi_write(0, 0x2C, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x2D, 1, 1, buffer); // Configure upper byte
-   }
-   else if (mode == 3) {             // TBD (spare)
-      buffer[0] = (0x00000003);
-      pixi_spi_write(0, 0x2C, 1, 1, buffer); // Configure lower byte
-      pixi_spi_write(0, 0x2D, 1, 1, buffer); // Configure upper byte
-   }
+  if ((argc < 6) || (argc > 7))
+  {
+    fprintf (stderr, "Usage: %s spi_sample channel reg[,reg...] rate count [csv|bin]\n", argv [0]) ;
+    exit (1) ;
+  }
+
+  for (reg = strtok (argv [3], ",") ; reg != NULL ; reg = strtok (NULL, ","))
+  {
+    if (count == PIXI_SAMPLE_REGS)
+    {
+      fprintf (stderr, "%s: no more than %d registers per sample\n", argv [0], PIXI_SAMPLE_REGS) ;
+      exit (1) ;
+    }
+    address [count++] = strtol (reg, NULL, 0) ;
+  }
+
+  if (argc == 7)
+  {
+    if      (strcasecmp (argv [6], "bin") == 0) binary = TRUE ;
+    else if (strcasecmp (argv [6], "csv") != 0)
+    {
+      fprintf (stderr, "%s: output format must be csv or bin\n", argv [0]) ;
+      exit (1) ;
+    }
+  }
+
+  if (pixi_sampler_start (&sampler, atoi (argv [2]), address, count, atof (argv [4]), strtoul (argv [5], NULL, 0)) < 0)
+  {
+    fprintf (stderr, "%s: unable to start sampling\n", argv [0]) ;
+    exit (1) ;
+  }
+
+  if (!binary)
+  {
+    printf ("time_us") ;
+    for (i = 0 ; i < count ; i++)
+      printf (",0x%02x", address [i]) ;
+    printf ("\n") ;
+  }
+
+  for (;;)
+  {
+    if (!pixi_sampler_read (&sampler, &sample))
+    {
+      if (!sampler.running)
+      {
+        __sync_synchronize () ;
+        if (!pixi_sampler_read (&sampler, &sample))
+          break ;
+      }
+      else
+      {
+        usleep (1000) ;
+        continue ;
+      }
+    }
+
+    if (binary)
+    {
+      fwrite (&sample.timestamp, sizeof (sample.timestamp), 1, stdout) ;
+      fwrite (sample.value, sizeof (sample.value [0]), count, stdout) ;
+    }
+    else
+    {
+      if (first == 0)
+        first = sample.timestamp ;
+      printf ("%.1f", (sample.timestamp - first) / 1000.0) ;
+      for (i = 0 ; i < count ; i++)
+        printf (",%u", sample.value [i]) ;
+      printf ("\n") ;
+    }
+  }
+
+  pixi_sampler_stop (&sampler) ;
+  fflush (stdout) ;
+  pixi_sampler_report (&sampler, stderr) ;
 }
- 
+
 
 /*
- * printlcd:
- *	Basic function to send a text string to the LCD / VFD ...
+ * pixi_mirror:
+ *	Reads of slowly changing registers (build time, switches, runtime
+ *	counter...) from the shared-memory mirror that pixid keeps up to date.
+ *	If the register is mirrored and the copy is recent enough, no SPI
+ *	transfer is needed. Otherwise the register is read from the FPGA as
+ *	usual.
  *********************************************************************************
  */
-void printlcd(char * a)
+
+#define PIXI_MIRROR_RETRIES 100   // Seqlock reads tried before giving up on the mirror
+
+static const pixid_mirror *pixiMirror ;
+static int pixiMirrorTried = FALSE ;
+
+// Only a mirror written by root (pixid) is trusted
+static void pixi_mirror_open (void)
 {
-   int i;
-   unsigned long buffer[256];
+  struct stat st ;
+  void *map ;
+  int fd ;
 
-   // Configure GPIO3 I/O mode as LCD/VFD
-   gpio3_mode(2);
-   
-   // Send string to display
-   for (i = 0; i < strlen(a); i++) {
-      buffer[0] = 0x00000200 + ((unsigned short)a[i] & 0x000000ff); // Set RS to '1' for display data & combine upper / lower bytes
-      pixi_spi_write(0, 0x38, 1, 1, buffer);
-   }
-//   pixi_spi_write(0, 0x38, 1, strlen(a), buffer); // For when the FPGA supports multiple write over SPI...
+  pixiMirrorTried = TRUE ;
+  if ((fd = open (PIXID_MIRROR, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+    return ;
+  if ((fstat (fd, &st) < 0) || !S_ISREG (st.st_mode) || (st.st_uid != 0) ||
+      (st.st_size < (off_t)sizeof (pixid_mirror)))
+  {
+    close (fd) ;
+    return ;
+  }
+  map = mmap (NULL, sizeof (pixid_mirror), PROT_READ, MAP_SHARED, fd, 0) ;
+  close (fd) ;
+  if (map != MAP_FAILED)
+    pixiMirror = map ;
 }
 
+// Mirrored value of a channel 0 register if no older than maxAgeMs, else -1. age receives its age in ns.
+int pixi_mirror_lookup (int address, int maxAgeMs, uint64_t *age)
+{
+  const pixid_mirror_entry *entry ;
+  struct timespec now ;
+  uint64_t timestamp ;
+  uint32_t sequence ;
+  int retries = PIXI_MIRROR_RETRIES ;
+  int value ;
+  int valid ;
+
+  if (!pixiMirrorTried)
+    pixi_mirror_open () ;
+  if ((pixiMirror == NULL) || (pixiMirror->magic != PIXID_MIRROR_MAGIC))
+    return -1 ;
+
+  // If pixid dies mid-update the sequence stays odd, so don't wait for ever:
+  // give up after a few tries and let the caller read the bus
+  entry = &pixiMirror->reg [address & 0xff] ;
+  for (;;)
+  {
+    if (retries-- == 0)
+      return -1 ;
+    if ((sequence = entry->sequence) & 1)
+      continue ;
+    __sync_synchronize () ;
+    value     = entry->value ;
+    valid     = entry->valid ;
+    timestamp = entry->timestamp ;
+    __sync_synchronize () ;
+    if (entry->sequence == sequence)
+      break ;
+  }
 
- /*
- * configurelcd:
- *	Basic function to send a config string to the LCD / VFD ...
+  if (!valid)
+    return -1 ;
+
+  clock_gettime (CLOCK_MONOTONIC, &now) ;
+  *age = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec - timestamp ;
+  if (*age > (uint64_t)maxAgeMs * 1000000ULL)
+    return -1 ;
+  return value ;
+}
+
+// Read a channel 0 register, accepting a mirrored value up to maxAgeMs old
+int pixi_mirror_get (int address, int maxAgeMs)
+{
+  uint64_t age ;
+  int value ;
+
+  if ((value = pixi_mirror_lookup (address, maxAgeMs, &age)) >= 0)
+    return value ;
+  return pixi_spi_get (0, address, 0) ;
+}
+
+
+/*
+ * doSPImirror:
+ *	gpio cached register read ...
+ *	gpio spi_mirror <address> [max_age_ms]
  *********************************************************************************
  */
-int configurelcd(char * cfg_name, int *cfg_values)
+
+void doSPImirror (int argc, char *argv [])
 {
-   // init        : cfg_values[0] = TBD...
-   // brightness  : cfg_values[0] = brightness, 0 => 25%, 1 => 50%, 2 => 75%, 3 => 100%
-   // goto_xy     : cfg_values[0] = x, cfg_values[1] = y
+  uint64_t age ;
+  int address ;
+  int maxAge = 1000 ;
+  int value ;
 
-   unsigned long buffer[256];
+  if ((argc < 3) || (argc > 4))
+  {
+    fprintf (stderr, "Usage: %s spi_mirror address [max_age_ms]\n", argv [0]) ;
+    exit (1) ;
+  }
 
-   // Configure GPIO3 I/O mode as LCD/VFD
-   gpio3_mode(2);
-   
-   if      (strcasecmp (cfg_name, "init")       == 0) { buffer[0] = 0x0030; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x30 = Function Set
-                                                        buffer[0] = 0x0203; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x83 = Brightness Control (low)
-                                                        buffer[0] = 0x0001; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x01 = Display Clear
-                                                        buffer[0] = 0x0002; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x02 = Cursor Home
-                                                        buffer[0] = 0x0006; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x06 = Entry Mode Set
-                                                        buffer[0] = 0x000C; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x0C = Display On
-                                                        printlcd("Welcome to the PiXi-200!");
-                                                        return(0);}
-   else if (strcasecmp (cfg_name, "init1")      == 0) { buffer[0] = 0x0030; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x30 = Function Set
-                                                        buffer[0] = 0x0200; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x83 = Brightness Control (full)
-                                                        buffer[0] = 0x0001; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x01 = Display Clear
-                                                        buffer[0] = 0x0002; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x02 = Cursor Home
-                                                        buffer[0] = 0x0006; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x06 = Entry Mode Set
-                                                        buffer[0] = 0x000F; pixi_spi_write(0, 0x38, 1, 1, buffer); // 0x0C = Display On, Cursor On, Curson Blink Enabled
-                                                        printlcd("Welcome to the PiXi-200!");
-                                                        return(0);}
-   else if (strcasecmp (cfg_name, "brightness") == 0) { buffer[0] = 0x0030; pixi_spi_write(0, 0x38, 1, 1, buffer); buffer[0] = 0x0200 + (cfg_values[0] & 0x0003); pixi_spi_write(0, 0x38, 1, 1, buffer); return(0);}
-   else if (strcasecmp (cfg_name, "clear")      == 0) { return(0);}
-   else if (strcasecmp (cfg_name, "goto_xy")    == 0) { buffer[0] = 0x0080 + ((cfg_values[1] & 0x3f) << 6) + (cfg_values[0] & 0x3f); pixi_spi_write(0, 0x38, 1, 1, buffer); return(0);}
-   else return(1);
+  address = strtol (argv [2], NULL, 0) ;
+  if (argc == 4)
+    maxAge = atoi (argv [3]) ;
 
+  if ((value = pixi_mirror_lookup (address, maxAge, &age)) >= 0)
+    printf ("0x%02x: 0x%04x (mirror, %.1fms old)\n", address, value, age / 1e6) ;
+  else
+    printf ("0x%02x: 0x%04x (SPI)\n", address, pixi_spi_get (0, address, 0)) ;
 }
 
 
 /*
- * lcdwritexy:
- *	gpio LCV / VFD display write ...
+ * doSPIstats:
+ *	gpio SPI latency / throughput measurement ...
+ *	Times count single register reads, then the same reads in batches
+ *********************************************************************************
+ */
+
+void doSPIstats (int argc, char *argv [])
+{
+  pixi_spi_batch batch ;
+  int channel ;
+  int address ;
+  int count ;
+  int i ;
+
+  if ((argc < 4) || (argc > 5))
+  {
+    fprintf (stderr, "Usage: %s spi_stats channel count [address]\n", argv [0]) ;
+    exit (1) ;
+  }
+
+  channel = atoi (argv [2]) ;
+  count   = atoi (argv [3]) ;
+  address = (argc == 5) ? strtol (argv [4], NULL, 0) : 0x00 ;
+
+  pixi_spi_open (channel) ;
+  pixi_spi_stats_enable (TRUE) ;
+
+  printf ("Single reads:\n") ;
+  for (i = 0 ; i < count ; i++)
+    pixi_spi_get (channel, address, 0) ;
+  pixi_spi_stats_dump (stdout, TRUE) ;
+
+  pixi_spi_stats_reset () ;
+
+  printf ("Batched reads (%d per transfer):\n", PIXI_BATCH_MAX) ;
+  pixi_spi_batch_init (&batch, channel) ;
+  for (i = 0 ; i < count ; i++)
+  {
+    pixi_spi_batch_get (&batch, address) ;
+    if ((batch.count == PIXI_BATCH_MAX) || (i == count - 1))
+    {
+      pixi_spi_batch_submit (&batch, NULL) ;
+      pixi_spi_batch_init (&batch, channel) ;
+    }
+  }
+  pixi_spi_stats_dump (stdout, TRUE) ;
+}
+
+
+/*
+ * spi_single_read:
+ * gpio SPI single register read ...
+ *********************************************************************************
+ */
+
+int spi_single_read (int channel, int address)
+{
+  int data = 0;
+  uint8_t outbuffer [4] ;
+  
+  pixi_spi_open (channel) ;
+ 
+  // load output buffer and send it out
+  outbuffer [0] =  address & 0x00ff;
+  outbuffer [1] =            0x0080; // Enable read
+  outbuffer [2] = (data    & 0xff00) >> 8;
+  outbuffer [3] =  data    & 0x00ff;
+ 
+  pixi_spi_transfer (channel, outbuffer, 4) ;
+  pixi_trace (1, "Returned: 0x%02x, 0x%02x, 0x%04x\n", outbuffer[0], outbuffer[1], outbuffer[3] | outbuffer[2] << 8);
+
+  data = outbuffer[3] + (outbuffer[2] << 8);
+  pixi_trace (1, "Single Read from ch. %d, address %d: %d\n", channel, address, data);
+  return(data);
+}
+
+
+/*
+ * pixi_spi_burst:
+ *	Multi-word register transfers. One frame holds the address, the control
+ *	byte (0x40/0x50/0x60 write, 0x80/0x90/0xA0 read, for 8, 16 or 32-bit
+ *	words) and then the words in big-endian order, packed back to back. A
+ *	frame carries at most PIXI_BURST_BYTES data bytes, so the limit is 256
+ *	bytes, 128 halfwords or 64 words. Each function returns the number of
+ *	words transferred, or -1 if there are too many of them or the transfer
+ *	fails.
  *********************************************************************************
  */
 
-void lcdwritexy (char * lcdstring, int x, int y)
+static int pixi_spi_burst (int channel, int address, int control, uint8_t *frame, int bytes)
+{
+  pixi_spi_open (channel) ;
+
+  frame [0] = address & 0xff ;
+  frame [1] = control ;
+
+  pixi_trace (1, "Sending to ch%d: 0x%02x, 0x%02x, %d bytes\n", channel, frame [0], frame [1], bytes) ;
+  if (pixi_spi_transfer (channel, frame, 2 + bytes) < 0)
+  {
+    fprintf (stderr, "SPI burst transfer failed: %s\n", strerror (errno)) ;
+    return -1 ;
+  }
+  pixi_trace (1, "Returned: 0x%02x, 0x%02x\n", frame [0], frame [1]) ;
+  return 0 ;
+}
+
+int pixi_spi_burst_write8 (int channel, int address, const uint8_t *data, int count)
+{
+  uint8_t frame [2 + PIXI_BURST_BYTES] ;
+
+  if ((count < 0) || (count > PIXI_BURST_BYTES))
+    return -1 ;
+
+  memcpy (frame + 2, data, count) ;
+  return (pixi_spi_burst (channel, address, 0x40, frame, count) < 0) ? -1 : count ;
+}
+
+int pixi_spi_burst_write16 (int channel, int address, const uint16_t *data, int count)
+{
+  uint8_t frame [2 + PIXI_BURST_BYTES] ;
+  uint8_t *out = frame + 2 ;
+  int i ;
+
+  if ((count < 0) || (count > PIXI_BURST_BYTES / 2))
+    return -1 ;
+
+  for (i = 0 ; i < count ; i++, out += 2)
+  {
+    out [0] = data [i] >> 8 ;
+    out [1] = data [i] ;
+  }
+  return (pixi_spi_burst (channel, address, 0x50, frame, count * 2) < 0) ? -1 : count ;
+}
+
+int pixi_spi_burst_write32 (int channel, int address, const uint32_t *data, int count)
+{
+  uint8_t frame [2 + PIXI_BURST_BYTES] ;
+  uint8_t *out = frame + 2 ;
+  int i ;
+
+  if ((count < 0) || (count > PIXI_BURST_BYTES / 4))
+    return -1 ;
+
+  for (i = 0 ; i < count ; i++, out += 4)
+  {
+    out [0] = data [i] >> 24 ;
+    out [1] = data [i] >> 16 ;
+    out [2] = data [i] >> 8 ;
+    out [3] = data [i] ;
+  }
+  return (pixi_spi_burst (channel, address, 0x60, frame, count * 4) < 0) ? -1 : count ;
+}
+
+int pixi_spi_burst_read8 (int channel, int address, uint8_t *data, int count)
+{
+  uint8_t frame [2 + PIXI_BURST_BYTES] ;
+
+  if ((count < 0) || (count > PIXI_BURST_BYTES))
+    return -1 ;
+
+  memset (frame + 2, 0, count) ;
+  if (pixi_spi_burst (channel, address, 0x80, frame, count) < 0)
+    return -1 ;
+  memcpy (data, frame + 2, count) ;
+  return count ;
+}
+
+int pixi_spi_burst_read16 (int channel, int address, uint16_t *data, int count)
+{
+  uint8_t frame [2 + PIXI_BURST_BYTES] ;
+  const uint8_t *in = frame + 2 ;
+  int i ;
+
+  if ((count < 0) || (count > PIXI_BURST_BYTES / 2))
+    return -1 ;
+
+  memset (frame + 2, 0, count * 2) ;
+  if (pixi_spi_burst (channel, address, 0x90, frame, count * 2) < 0)
+    return -1 ;
+  for (i = 0 ; i < count ; i++, in += 2)
+    data [i] = (in [0] << 8) | in [1] ;
+  return count ;
+}
+
+int pixi_spi_burst_read32 (int channel, int address, uint32_t *data, int count)
+{
+  uint8_t frame [2 + PIXI_BURST_BYTES] ;
+  const uint8_t *in = frame + 2 ;
+  int i ;
+
+  if ((count < 0) || (count > PIXI_BURST_BYTES / 4))
+    return -1 ;
+
+  memset (frame + 2, 0, count * 4) ;
+  if (pixi_spi_burst (channel, address, 0xA0, frame, count * 4) < 0)
+    return -1 ;
+  for (i = 0 ; i < count ; i++, in += 4)
+    data [i] = ((uint32_t)in [0] << 24) | ((uint32_t)in [1] << 16) | (in [2] << 8) | in [3] ;
+  return count ;
+}
+
+
+/*
+ * pixi_write:
+ * Basic function to write to the PiXi-200 over SPI ...
+ * Supports byte, 16-bit or 32-bit writes
+ * Also supports single write or n* writes, split into bursts of up to
+ * PIXI_BURST_BYTES. Returns num_writes, or -1 if any burst fails.
+ *********************************************************************************
+ */
+int pixi_spi_write(int channel, int address, int format, int num_writes, unsigned long *buffer)
+{
+   uint8_t  data8  [PIXI_BURST_BYTES] ;
+   uint16_t data16 [PIXI_BURST_BYTES / 2] ;
+   uint32_t data32 [PIXI_BURST_BYTES / 4] ;
+   int width = (format == 0) ? 1 : (format == 1) ? 2 : 4 ;
+   int done, count, result, i;
+
+   for (done = 0; done < num_writes; done += count) {
+      count = num_writes - done ;
+      if (count > PIXI_BURST_BYTES / width)
+         count = PIXI_BURST_BYTES / width ;
+
+      if (format == 0) {        // 8-bit data
+         for (i = 0; i < count; i++)
+            data8 [i] = buffer [done + i] ;
+         result = pixi_spi_burst_write8 (channel, address, data8, count) ;
+      }
+      else if (format == 1) {   // 16-bit data
+         for (i = 0; i < count; i++)
+            data16 [i] = buffer [done + i] ;
+         result = pixi_spi_burst_write16 (channel, address, data16, count) ;
+      }
+      else {                    // 32-bit data
+         for (i = 0; i < count; i++)
+            data32 [i] = buffer [done + i] ;
+         result = pixi_spi_burst_write32 (channel, address, data32, count) ;
+      }
+
+      if (result != count) {
+         fprintf (stderr, "SPI write to 0x%02x failed after %d of %d words\n", address, done, num_writes) ;
+         return -1 ;
+      }
+   }
+   return num_writes ;
+}
+
+
+/*
+ * pixi_read:
+ * Basic function to data from the PiXi-200 over SPI ...
+ * Supports byte, 16-bit or 32-bit reads
+ * Also supports single read or n* reads, returned in buffer, split into
+ * bursts of up to PIXI_BURST_BYTES. Returns num_reads, or -1 if any burst fails.
+ *********************************************************************************
+ */
+int pixi_spi_read(int channel, int address, int format, int num_reads, unsigned long *buffer)
+{
+   uint8_t  data8  [PIXI_BURST_BYTES] ;
+   uint16_t data16 [PIXI_BURST_BYTES / 2] ;
+   uint32_t data32 [PIXI_BURST_BYTES / 4] ;
+   int width = (format == 0) ? 1 : (format == 1) ? 2 : 4 ;
+   int done, count, i;
+
+   for (done = 0; done < num_reads; done += count) {
+      count = num_reads - done ;
+      if (count > PIXI_BURST_BYTES / width)
+         count = PIXI_BURST_BYTES / width ;
+
+      if (format == 0) {        // 8-bit data
+         if (pixi_spi_burst_read8 (channel, address, data8, count) != count)
+            break ;
+         for (i = 0; i < count; i++)
+            buffer [done + i] = data8 [i] ;
+      }
+      else if (format == 1) {   // 16-bit data
+         if (pixi_spi_burst_read16 (channel, address, data16, count) != count)
+            break ;
+         for (i = 0; i < count; i++)
+            buffer [done + i] = data16 [i] ;
+      }
+      else {                    // 32-bit data
+         if (pixi_spi_burst_read32 (channel, address, data32, count) != count)
+            break ;
+         for (i = 0; i < count; i++)
+            buffer [done + i] = data32 [i] ;
+      }
+   }
+
+   if (done < num_reads) {
+      fprintf (stderr, "SPI read from 0x%02x failed after %d of %d words\n", address, done, num_reads) ;
+      return -1 ;
+   }
+   return num_reads ;
+}
+
+
+/*
+ * doSPIselftest:
+ *	gpio SPI transfer self-check ...
+ *	Round-trips the FPGA test registers through single writes, batches and
+ *	bursts, including one longer than a single burst, and checks that
+ *	oversized bursts are refused. Exits non-zero if anything fails.
+ *	gpio spi_selftest
+ *********************************************************************************
+ */
+
+static int pixi_selftest_check (const char *name, int got, int expected)
+{
+  printf ("%-28s 0x%04x  %s\n", name, got & 0xffff, (got == expected) ? "ok" : "FAILED") ;
+  return (got == expected) ? 0 : 1 ;
+}
+
+void doSPIselftest (int argc, char *argv [])
+{
+  static unsigned long words [3 * PIXI_BURST_BYTES / 2] ;
+  pixi_spi_batch batch ;
+  unsigned long readback [2] ;
+  uint16_t over [PIXI_BURST_BYTES / 2 + 1] ;
+  int results [2] ;
+  int failed = 0 ;
+  int count = sizeof (words) / sizeof (words [0]) ;
+  int i ;
+
+  if (argc != 2)
+  {
+    fprintf (stderr, "Usage: %s spi_selftest\n", argv [0]) ;
+    exit (1) ;
+  }
+
+  pixi_spi_set (0, 0x03, 0xa55a) ;
+  failed += pixi_selftest_check ("single write/read", pixi_spi_get (0, 0x03, 0), 0xa55a) ;
+
+  pixi_spi_batch_init (&batch, 0) ;
+  pixi_spi_batch_set (&batch, 0x04, 0x1234) ;
+  pixi_spi_batch_get (&batch, 0x04) ;
+  if (pixi_spi_batch_submit (&batch, results) < 0)
+    results [1] = -1 ;
+  failed += pixi_selftest_check ("batch write/read (inverted)", results [1], 0xedcb) ;
+
+  readback [0] = 0x5a ; readback [1] = 0xc3 ;
+  if (pixi_spi_write (0, 0x05, 0, 2, readback) < 0)
+    failed++ ;
+  failed += pixi_selftest_check ("8-bit burst", pixi_spi_get (0, 0x05, 0), 0x5ac3) ;
+
+  readback [0] = 0xbeef ;
+  if (pixi_spi_write (0, 0x06, 1, 1, readback) < 0)
+    failed++ ;
+  readback [0] = 0 ;
+  if (pixi_spi_read (0, 0x06, 1, 1, readback) < 0)
+    failed++ ;
+  failed += pixi_selftest_check ("16-bit burst write/read", readback [0], 0xbeef) ;
+
+  // The FPGA latches the first halfword of each frame, so a write split into
+  // bursts leaves the first word of the last burst in the register
+  for (i = 0 ; i < count ; i++)
+    words [i] = 0x1000 + i ;
+  if (pixi_spi_write (0, 0x07, 1, count, words) != count)
+    failed++ ;
+  failed += pixi_selftest_check ("chunked 16-bit burst", pixi_spi_get (0, 0x07, 0),
+                                 0x1000 + (count - 1) / (PIXI_BURST_BYTES / 2) * (PIXI_BURST_BYTES / 2)) ;
+
+  memset (over, 0, sizeof (over)) ;
+  failed += pixi_selftest_check ("oversized burst refused",
+                                 pixi_spi_burst_write16 (0, 0x07, over, PIXI_BURST_BYTES / 2 + 1), -1) ;
+
+  if (failed)
+  {
+    fprintf (stderr, "%s: %d SPI self-check(s) failed\n", argv [0], failed) ;
+    exit (1) ;
+  }
+  printf ("All SPI self-checks passed\n") ;
+}
+
+
+/*
+ * gpio1_mode:
+ *	Basic function to select GPIO3 mode ...
+ *********************************************************************************
+ */
+void gpio1_mode(int mode)
+{
+   pixi_spi_batch batch;
+   int value;
+
+   if      (mode == 0)  value = 0x0000; // All bits are configured for input
+   else if (mode == 1)  value = 0x0001; // All bits are configured as output, tied to gpio1_out register
+   else if (mode == 2)  value = 0x0002; // TBD (spare)
+   else if (mode == 3)  value = 0x0003; // TBD (spare)
+   else if (mode == 8)  value = 0x0003; // Factory Test Mode1
+   else if (mode == 9)  value = 0x0003; // Factory Test Mode2
+   else if (mode == 10) value = 0x0003; // Factory Test Mode2
+   else return;
+
+   pixi_spi_batch_init(&batch, 0);
+   pixi_spi_batch_set(&batch, 0x27, value); // Configure lower byte
+   pixi_spi_batch_set(&batch, 0x28, value); // Configure middle byte
+   pixi_spi_batch_set(&batch, 0x29, value); // Configure upper byte
+   pixi_spi_batch_submit(&batch, NULL);
+}
+ 
+
+/*
+ * gpio2_mode:
+ *	Basic function to select GPIO1 mode ...
+ *********************************************************************************
+ */
+void gpio2_mode(int mode)
+{
+   pixi_spi_batch batch;
+   int value;
+
+   if      (mode == 0) value = 0x0000; // All bits are configured for input
+   else if (mode == 1) value = 0x0001; // All bits are configured as output, tied to gpio3_out register
+   else if (mode == 2) value = 0x0002; // All bits are configured as output, specific for directly driving LCD or VFD. Tied to VFDLCD register
+   else if (mode == 3) value = 0x0003; // TBD (spare)
+   else return;
+
+   pixi_spi_batch_init(&batch, 0);
+   pixi_spi_batch_set(&batch, 0x2A, value); // Configure lower byte
+   pixi_spi_batch_set(&batch, 0x2B, value); // Configure upper byte
+   pixi_spi_batch_submit(&batch, NULL);
+}
+ 
+
+/*
+ * gpio3_mode:
+ *	Basic function to select GPIO3 mode ...
+ *********************************************************************************
+ */
+void gpio3_mode(int mode)
+{
+   pixi_spi_batch batch;
+   int value;
+
+   if      (mode == 0) value = 0x0000; // All bits are configured for input
+   else if (mode == 1) value = 0x0001; // All bits are configured as output, tied to gpio3_out register
+   else if (mode == 2) value = 0x0002; // All bits are configured as output, specific for directly driving LCD or VFD. Tied to VFDLCD register
+   else if (mode == 3) value = 0x0003; // TBD (spare)
+   else return;
+
+   pixi_spi_batch_init(&batch, 0);
+   pixi_spi_batch_set(&batch, 0x2C, value); // Configure lower byte
+   pixi_spi_batch_set(&batch, 0x2D, value); // Configure upper byte
+   pixi_spi_batch_submit(&batch, NULL);
+}
+ 
+
+/*
+ * pixi_lcd:
+ *	LCD / VFD framebuffer. Keeps a copy of what the display RAM holds, and
+ *	where the cursor is, in PIXI_LCD_STATE so that it outlives each gpio
+ *	command. Writing text compares it with the copy and only sends the
+ *	characters that differ. A cursor move (goto_xy) is sent before each
+ *	changed run that doesn't follow on from the last. The result goes
+ *	through pixi_lcd_stream, in as few transfers as the display FIFO
+ *	allows. The GPIO3 mode setup is only sent once after the display is
+ *	initialised. A position holding
+ *	0 is unknown and is always sent. The copy is thrown away when the FPGA
+ *	is reprogrammed, since its start-up string rewrites the display.
+ *	Anything else that writes the display (pio, the web server, raw
+ *	spi_set 0x38) leaves the copy stale, so the next printlcd would skip
+ *	characters it thinks are already there: run 'gpio pixi_lcdredraw'
+ *	after such writes, or set PIXI_LCD_NOCACHE for gpio to send all the
+ *	text every time. The state file is opened with pixi_state_map.
+ *********************************************************************************
+ */
+
+typedef struct
+{
+  int modeSet ;                               // GPIO3 is in LCD / VFD mode
+  int x, y ;                                  // Display cursor, or -1 if not known
+  int nextX, nextY ;                          // Where printlcd carries on from
+  char text [PIXI_LCD_ROWS][PIXI_LCD_COLS] ;
+} pixi_lcd ;
+
+static pixi_lcd *pixiLcd ;
+static int pixiLcdFd = -1 ;
+
+// Forget what is on the display, keeping where printlcd carries on from:
+// every character is sent again, after a cursor move and the mode setup
+static void pixi_lcd_invalidate (pixi_lcd *lcd)
+{
+  memset (lcd->text, 0, sizeof (lcd->text)) ;
+  lcd->modeSet = FALSE ;
+  lcd->x = lcd->y = -1 ;
+}
+
+static pixi_lcd *pixi_lcd_open (void)
+{
+  static pixi_lcd local ;
+  void *map ;
+
+  if (pixiLcd != NULL)
+    return pixiLcd ;
+
+  // Without the shared copy everything is still sent, just not remembered between commands
+  local.x = local.y = local.nextX = local.nextY = -1 ;
+  map = pixi_state_map (PIXI_LCD_STATE, &local, sizeof (local), &pixiLcdFd) ;
+  pixiLcd = (map != NULL) ? map : &local ;
+
+  if (getenv ("PIXI_LCD_NOCACHE") != NULL)
+  {
+    if (pixiLcdFd >= 0)
+      flock (pixiLcdFd, LOCK_EX) ;
+    pixi_lcd_invalidate (pixiLcd) ;
+    if (pixiLcdFd >= 0)
+      flock (pixiLcdFd, LOCK_UN) ;
+  }
+  return pixiLcd ;
+}
+
+// The display has been cleared (or reset): all spaces, cursor home
+static void pixi_lcd_cleared (pixi_lcd *lcd)
+{
+  memset (lcd->text, ' ', sizeof (lcd->text)) ;
+  lcd->modeSet = TRUE ;
+  lcd->x = lcd->y = lcd->nextX = lcd->nextY = 0 ;
+}
+
+// Forget the display contents, e.g. when the FPGA is reprogrammed
+void pixi_lcd_forget (void)
+{
+  unlink (PIXI_LCD_STATE) ;
+  if (pixiLcd != NULL)
+  {
+    memset (pixiLcd, 0, sizeof (*pixiLcd)) ;
+    pixiLcd->x = pixiLcd->y = pixiLcd->nextX = pixiLcd->nextY = -1 ;
+  }
+}
+
+/*
+ * pixi_lcd_stream:
+ *	Display FIFO writer. Entries (commands, characters and pauses) are
+ *	queued, then sent in batches no bigger than the free space in the
+ *	FPGA's display FIFO. The free space is read from reg_vfd_status (0x3A)
+ *	at the end of each batch. A pause entry (0x8000 + n) holds up the
+ *	FIFO for n x 4096 FPGA clocks (about 124us), so a delay between
+ *	commands needs no sleep on the Pi. Builds without the status register
+ *	read 0 there (bit 15 clear). For those a FIFO's worth is sent at a
+ *	time, and then the writer waits for it to drain at the rate set in
+ *	reg_vfd_ctrl.
+ *********************************************************************************
+ */
+
+#define PIXI_LCD_STATUS_VALID 0x8000
+#define PIXI_LCD_STATUS_LEVEL 0x00ff
+
+typedef struct
+{
+  int count ;
+  int frames ;                          // Sent so far, status reads included
+  uint16_t entry [PIXI_LCD_STREAM_MAX] ;
+} pixi_lcd_stream ;
+
+void pixi_lcd_stream_init (pixi_lcd_stream *stream)
+{
+  stream->count  = 0 ;
+  stream->frames = 0 ;
+}
+
+// Time (us) for the FIFO to work through some entries
+static long pixi_lcd_drain_us (const uint16_t *entry, int count)
+{
+  long long cycles = 0 ;
+  int i ;
+
+  for (i = 0 ; i < count ; i++)
+    if ((entry [i] & 0xf000) == 0x8000)
+      cycles += (entry [i] & 0x0fff) << 12 ;
+    else
+      cycles += 2 * ((pixi_shadow_get (0, 0x39) >> 8) << 8) ; // Write strobe + hold (lcd_timing)
+  return (long)((cycles * 1000000LL) / PIXI_FPGA_CLOCK) + 1 ;
+}
+
+int pixi_lcd_stream_flush (pixi_lcd_stream *stream)
+{
+  static const uint16_t character = 0x0200 ;
+  pixi_spi_batch batch ;
+  int results [PIXI_BATCH_MAX] ;
+  int status = -1 ;
+  int space = 0 ;
+  int sent = 0 ;
+  int n, i ;
+
+  while (sent < stream->count)
+  {
+    if (space == 0)
+    {
+      // FIFO full (or as good as): give it time to take the next entry...
+      if (status & PIXI_LCD_STATUS_VALID)
+        usleep (pixi_lcd_drain_us (&character, 1)) ;
+      else if (status >= 0)
+        usleep (pixi_lcd_drain_us (stream->entry + sent - PIXI_LCD_FIFO_DEPTH, PIXI_LCD_FIFO_DEPTH)) ;
+
+      // ...then see how much room there is
+      if ((status < 0) || (status & PIXI_LCD_STATUS_VALID))
+      {
+        pixi_spi_batch_init (&batch, 0) ;
+        pixi_spi_batch_get (&batch, 0x3A) ; // reg_vfd_status
+        if (pixi_spi_batch_submit (&batch, results) < 0)
+          return -1 ;
+        stream->frames++ ;
+        status = results [0] ;
+      }
+
+      if (status & PIXI_LCD_STATUS_VALID)
+        space = PIXI_LCD_FIFO_DEPTH - (status & PIXI_LCD_STATUS_LEVEL) ;
+      else
+        space = PIXI_LCD_FIFO_DEPTH ;
+      if (space <= 0)
+      {
+        space = 0 ;
+        continue ;
+      }
+    }
+
+    // Leave room for the status read at the end
+    n = stream->count - sent ;
+    if (n > space)
+      n = space ;
+    if (n > PIXI_BATCH_MAX - 1)
+      n = PIXI_BATCH_MAX - 1 ;
+
+    pixi_spi_batch_init (&batch, 0) ;
+    for (i = 0 ; i < n ; i++)
+      pixi_spi_batch_set (&batch, 0x38, stream->entry [sent + i]) ; // reg_vfd
+    if ((sent + n < stream->count) && (status & PIXI_LCD_STATUS_VALID))
+      pixi_spi_batch_get (&batch, 0x3A) ;
+    if (pixi_spi_batch_submit (&batch, results) < 0)
+      return -1 ;
+    stream->frames += batch.count ;
+    sent  += n ;
+    space -= n ;
+
+    if (batch.count > n)
+    {
+      status = results [n] ;
+      space  = PIXI_LCD_FIFO_DEPTH - (status & PIXI_LCD_STATUS_LEVEL) ;
+      if (space < 0)
+        space = 0 ;
+    }
+  }
+
+  stream->count = 0 ;
+  return 0 ;
+}
+
+int pixi_lcd_stream_put (pixi_lcd_stream *stream, int entry)
+{
+  if ((stream->count == PIXI_LCD_STREAM_MAX) && (pixi_lcd_stream_flush (stream) < 0))
+    return -1 ;
+  stream->entry [stream->count++] = entry & 0xffff ;
+  return 0 ;
+}
+
+// Hold up the display FIFO for (at least) some microseconds
+int pixi_lcd_stream_pause (pixi_lcd_stream *stream, long us)
+{
+  long long ticks = ((long long)us * PIXI_FPGA_CLOCK / 1000000 + 4095) >> 12 ;
+  int n ;
+
+  for ( ; ticks > 0 ; ticks -= n)
+  {
+    n = (ticks > 0x0fff) ? 0x0fff : (int)ticks ;
+    if (pixi_lcd_stream_put (stream, 0x8000 | n) < 0)
+      return -1 ;
+  }
+  return 0 ;
+}
+
+
+// Write text at x, y (x < 0 for the cursor position). Returns the no. of SPI frames sent.
+int pixi_lcd_write (int x, int y, const char *text)
+{
+  pixi_lcd *lcd = pixi_lcd_open () ;
+  pixi_lcd_stream stream ;
+  char c ;
+
+  if (pixiLcdFd >= 0)
+    flock (pixiLcdFd, LOCK_EX) ;
+
+  if (!lcd->modeSet)
+  {
+    gpio3_mode (2) ;
+    lcd->modeSet = TRUE ;
+  }
+
+  pixi_lcd_stream_init (&stream) ;
+
+  if (x < 0)
+  {
+    x = lcd->nextX ;
+    y = lcd->nextY ;
+  }
+  if ((x < 0) || (y < 0))
+  {
+    // Cursor position not known: write it all, and the contents are not known either
+    for ( ; *text ; text++)
+      pixi_lcd_stream_put (&stream, 0x0200 | (*text & 0xff)) ;
+    memset (lcd->text, 0, sizeof (lcd->text)) ;
+    lcd->x = lcd->y = lcd->nextX = lcd->nextY = -1 ;
+  }
+  else
+  {
+    x %= PIXI_LCD_COLS ;
+    y %= PIXI_LCD_ROWS ;
+    for ( ; (c = *text) != '\0' ; text++)
+    {
+      if (lcd->text [y][x] != c)
+      {
+        if ((lcd->x != x) || (lcd->y != y))
+          pixi_lcd_stream_put (&stream, 0x0080 + (y << 6) + x) ; // goto_xy
+        pixi_lcd_stream_put (&stream, 0x0200 | (c & 0xff)) ;
+        lcd->text [y][x] = c ;
+        lcd->x = x + 1 ;
+        lcd->y = y ;
+      }
+      // Display RAM runs on from the end of one row to the start of the next
+      if (++x == PIXI_LCD_COLS)
+      {
+        x = 0 ;
+        y = (y + 1) % PIXI_LCD_ROWS ;
+      }
+      if (lcd->x == PIXI_LCD_COLS)
+      {
+        lcd->x = 0 ;
+        lcd->y = (lcd->y + 1) % PIXI_LCD_ROWS ;
+      }
+    }
+    lcd->nextX = x ;
+    lcd->nextY = y ;
+  }
+
+  pixi_lcd_stream_flush (&stream) ;
+
+  if (pixiLcdFd >= 0)
+    flock (pixiLcdFd, LOCK_UN) ;
+  return stream.frames ;
+}
+
+
+/*
+ * printlcd:
+ *	Basic function to send a text string to the LCD / VFD ...
+ *	(at the cursor, only sending what has changed - see pixi_lcd)
+ *********************************************************************************
+ */
+void printlcd(char * a)
+{
+   pixi_lcd_write(-1, 0, a);
+}
+
+
+ /*
+ * configurelcd:
+ *	Basic function to send a config string to the LCD / VFD ...
+ *********************************************************************************
+ */
+int configurelcd(char * cfg_name, int *cfg_values)
+{
+   // init        : cfg_values[0] = TBD...
+   // brightness  : cfg_values[0] = brightness, 0 => 25%, 1 => 50%, 2 => 75%, 3 => 100%
+   // goto_xy     : cfg_values[0] = x, cfg_values[1] = y
+
+   unsigned long buffer[256];
+   pixi_lcd *lcd = pixi_lcd_open();
+   pixi_lcd_stream stream;
+
+   // Configure GPIO3 I/O mode as LCD/VFD (unless it already is)
+   if (!lcd->modeSet) {
+      gpio3_mode(2);
+      lcd->modeSet = TRUE;
+   }
+   pixi_lcd_stream_init(&stream);
+   
+   if      (strcasecmp (cfg_name, "init")       == 0) { pixi_lcd_stream_put(&stream, 0x0030); // 0x30 = Function Set
+                                                        pixi_lcd_stream_put(&stream, 0x0203); // 0x83 = Brightness Control (low)
+                                                        pixi_lcd_stream_put(&stream, 0x0001); // 0x01 = Display Clear
+                                                        pixi_lcd_stream_pause(&stream, 2000); // Let the clear finish (the FPGA holds the FIFO)
+                                                        pixi_lcd_stream_put(&stream, 0x0002); // 0x02 = Cursor Home
+                                                        pixi_lcd_stream_put(&stream, 0x0006); // 0x06 = Entry Mode Set
+                                                        pixi_lcd_stream_put(&stream, 0x000C); // 0x0C = Display On
+                                                        pixi_lcd_stream_flush(&stream);
+                                                        pixi_lcd_cleared(lcd);
+                                                        printlcd("Welcome to the PiXi-200!");
+                                                        return(0);}
+   else if (strcasecmp (cfg_name, "init1")      == 0) { pixi_lcd_stream_put(&stream, 0x0030); // 0x30 = Function Set
+                                                        pixi_lcd_stream_put(&stream, 0x0200); // 0x83 = Brightness Control (full)
+                                                        pixi_lcd_stream_put(&stream, 0x0001); // 0x01 = Display Clear
+                                                        pixi_lcd_stream_pause(&stream, 2000); // Let the clear finish (the FPGA holds the FIFO)
+                                                        pixi_lcd_stream_put(&stream, 0x0002); // 0x02 = Cursor Home
+                                                        pixi_lcd_stream_put(&stream, 0x0006); // 0x06 = Entry Mode Set
+                                                        pixi_lcd_stream_put(&stream, 0x000F); // 0x0C = Display On, Cursor On, Curson Blink Enabled
+                                                        pixi_lcd_stream_flush(&stream);
+                                                        pixi_lcd_cleared(lcd);
+                                                        printlcd("Welcome to the PiXi-200!");
+                                                        return(0);}
+   else if (strcasecmp (cfg_name, "brightness") == 0) { buffer[0] = 0x0030; pixi_spi_write(0, 0x38, 1, 1, buffer); buffer[0] = 0x0200 + (cfg_values[0] & 0x0003); pixi_spi_write(0, 0x38, 1, 1, buffer); return(0);}
+   else if (strcasecmp (cfg_name, "clear")      == 0) { return(0);}
+   else if (strcasecmp (cfg_name, "goto_xy")    == 0) { buffer[0] = 0x0080 + ((cfg_values[1] & 0x3f) << 6) + (cfg_values[0] & 0x3f); pixi_spi_write(0, 0x38, 1, 1, buffer);
+                                                        lcd->x = lcd->nextX = (cfg_values[0] & 0x3f) % PIXI_LCD_COLS; lcd->y = lcd->nextY = (cfg_values[1] & 0x3f) % PIXI_LCD_ROWS; return(0);}
+   else return(1);
+
+}
+
+
+/*
+ * lcdwritexy:
+ *	gpio LCV / VFD display write ...
+ *********************************************************************************
+ */
+
+void lcdwritexy (char * lcdstring, int x, int y)
+{
+   // Only the characters that have changed are sent (see pixi_lcd)
+   pixi_lcd_write(x, y, lcdstring);
+}
+
+
+/*
+ * doLCDRedraw:
+ *	gpio LCD / VFD cache reset, after something other than gpio has
+ *	written the display: the next text is sent in full
+ *********************************************************************************
+ */
+
+void doLCDRedraw (void)
+{
+   pixi_lcd *lcd = pixi_lcd_open();
+
+   if (pixiLcdFd >= 0)
+      flock(pixiLcdFd, LOCK_EX);
+   pixi_lcd_invalidate(lcd);
+   if (pixiLcdFd >= 0)
+      flock(pixiLcdFd, LOCK_UN);
+}
+
+
+/*
+ * doLCDWriteXY:
+ *	gpio LCV / VFD display write ...
+ *********************************************************************************
+ */
+
+void doLCDWriteXY (int argc, char *argv [])
+{
+   int x;
+   int y;
+   char lcdstring[128];
+    
+   if (argc < 5)
+   {
+      fprintf (stderr, "Usage: %s pixi_lcdwr <x> <y> <string1>\n", argv [0]) ;
+      exit (1) ;
+   }
+
+   x = atoi (argv [2]) ;
+   y = atoi (argv [3]) ;
+   sprintf(lcdstring, argv[4]);
+   
+   lcdwritexy(lcdstring, x, y);
+
+   printf ("Done\n") ;
+}
+
+
+/*
+ * pixi_pwm_set_frequency:
+ *	Give a PWM channel (0..7) its own timebase: 'hz' cycles per second
+ *	with 2^bits steps each (1..15 bits). The control value then runs
+ *	from 0 (off) to 2^bits - 1, with bit 15 still the direction. A
+ *	frequency of 0 puts the channel back on the shared 50Hz, 10-bit
+ *	timebase used for servos. Returns the frequency actually set (the
+ *	divider is a whole no. of clocks), 0 for the default timebase, or
+ *	-1 if the channel can't go that fast or the FPGA build has no
+ *	per-channel timebase (reg_pwm_periodN does not read back).
+ *********************************************************************************
+ */
+
+long pixi_pwm_set_frequency (int channel, int pin, long hz, int bits)
+{
+  pixi_spi_batch batch ;
+  int results [3] ;
+  long period, divider ;
+
+  if ((pin < 0) || (pin > 7) || (bits < 1) || (bits > 15) || (hz < 0))
+    return -1 ;
+
+  period = (hz == 0) ? 0 : (1L << bits) ;
+  divider = 0 ;
+  if (hz > PIXI_FPGA_CLOCK / (period ? period : 1))
+    return -1 ;
+  if (hz > 0)
+  {
+    divider = (PIXI_FPGA_CLOCK + hz * period / 2) / (hz * period) ;
+    if ((divider < 1) || (divider > 0x10000))
+      return -1 ;
+  }
+
+  pixi_spi_batch_init (&batch, channel) ;
+  pixi_spi_batch_set (&batch, PIXI_PWM_PERIOD + pin, 0) ; // Back to the default timebase while the divider changes
+  pixi_spi_batch_set (&batch, PIXI_PWM_DIV + pin, (divider > 0) ? divider - 1 : 0) ;
+  pixi_spi_batch_set (&batch, PIXI_PWM_PERIOD + pin, period) ;
+  pixi_spi_batch_get (&batch, PIXI_PWM_PERIOD + pin) ;
+  if (pixi_spi_batch_submit (&batch, results) < 0)
+    return -1 ;
+
+  if (period == 0)
+    return 0 ;
+  if (pixi_spi_batch_result (&batch, 3) != period)
+    return -1 ;
+  return PIXI_FPGA_CLOCK / (divider * period) ;
+}
+
+
+/*
+ * doPiXi_PWMSeq:
+ *	Automated test & verification process ...
+ *********************************************************************************
+ */
+int pixi_pwmgo(int seq_no)
+{
+
+   int i;
+   unsigned long buffer[] = {// FL      FR      RL      RR
+                             0x0066, 0x0066, 0x0066, 0x0066, // Forward, 10%
+                             0x0132, 0x0132, 0x0132, 0x0132, // Forward, 30%
+                             0x01FE, 0x01FE, 0x01FE, 0x01FE, // Forward, 50%
+                             0x0132, 0x0132, 0x0132, 0x0132, // Forward, 30%
+                             0x0066, 0x0066, 0x0066, 0x0066, // Forward, 10%
+                             0x8066, 0x0066, 0x8066, 0x0066, // Left turn, 10%
+                             0x8066, 0x8066, 0x8066, 0x8066, // Reverse, 10%
+                             0x8066, 0x0066, 0x8066, 0x0066, // Left turn, 10%
+                             0x0066, 0x0066, 0x0066, 0x0066, // Forward, 10%
+                             0x0066, 0x0066, 0x0066, 0x0066, // Forward, 10%
+                             0x8066, 0x0066, 0x0066, 0x0066, // Left turn, 10%
+                             0x0066, 0x0066, 0x0066, 0x0066, // Forward, 10%
+                             0x0066, 0x8066, 0x0066, 0x8066, // Right turn, 10%
+                             0x0066, 0x8066, 0x0066, 0x8066, // Right turn, 10%
+                             0x0066, 0x8066, 0x0066, 0x8066, // Right turn, 10%
+                             0x8066, 0x8066, 0x8066, 0x8066};// Reverse, 10%
+
+   pixi_spi_batch batch;
+
+   // The whole sequence goes out as one batched SPI transfer
+   pixi_spi_batch_init(&batch, 0);
+
+   pixi_spi_batch_set(&batch, 0x4f, 0x0000); // Disable PWM sequencer
+   
+   if (seq_no > 0) {
+      pixi_spi_batch_set(&batch, PIXI_PWMSEQ_STATUS, 0); // Start on a frame boundary
+      for (i = 0; i <= 51; i=i+4) {
+         pixi_spi_batch_set(&batch, PIXI_PWMSEQ_DATA, buffer[i]);   // PWM4
+         pixi_spi_batch_set(&batch, PIXI_PWMSEQ_DATA, buffer[i+1]); // PWM5
+         pixi_spi_batch_set(&batch, PIXI_PWMSEQ_DATA, buffer[i+2]); // PWM6
+         pixi_spi_batch_set(&batch, PIXI_PWMSEQ_DATA, buffer[i+3]); // PWM7: queues the frame
+      }
+   }
+   
+   pixi_spi_batch_set(&batch, 0x4f, 0x01f0); // PWM 4..7 from the sequencer, stepping at 1Hz
+
+   return(pixi_spi_batch_submit(&batch, NULL));
+}
+ 
+ 
+/*
+ * pixi_pwm_write_pins:
+ *	Set several PWM channels (0..7, selected by mask) so they all change
+ *	together. The writes go out as one batched transfer, bracketed by
+ *	writes to reg_pwm_commit (0x4C): the first holds the selected
+ *	channels at their present values, the second moves them all to the
+ *	new values on the same FPGA clock edge, and the last hands them back
+ *	to 0x40..0x47 (which now hold the same values) so single-register
+ *	writes keep working. Builds without the commit register ignore it,
+ *	leaving the channels a frame (~5us) apart instead of a whole
+ *	pixi_spi_set() call each.
+ *********************************************************************************
+ */
+
+int pixi_pwm_write_pins (int channel, unsigned int mask, const unsigned int *values)
+{
+  pixi_spi_batch batch ;
+  int i ;
+
+  mask &= 0xff ;
+  pixi_spi_batch_init (&batch, channel) ;
+  pixi_spi_batch_set (&batch, PIXI_PWM_COMMIT, mask) ;
+  for (i = 0 ; i < 8 ; i++)
+    if (mask & (1 << i))
+      pixi_spi_batch_set (&batch, 0x40 + i, values [i]) ;
+  pixi_spi_batch_set (&batch, PIXI_PWM_COMMIT, mask) ;
+  pixi_spi_batch_set (&batch, PIXI_PWM_COMMIT, 0x8000 | mask) ;
+
+  return pixi_spi_batch_submit (&batch, NULL) ;
+}
+
+
+/*
+ * doPiXi_PWMSeq:
+ *	Automated test & verification process ...
+ *********************************************************************************
+ */
+int pixi_pwmprog (int argc, char *argv [])
+{
+   int speed;
+   unsigned long pwm;
+   unsigned long cmd_fl;
+   unsigned long cmd_fr;
+   unsigned long cmd_rl;
+   unsigned long cmd_rr;
+   unsigned int values[8];
+    
+   if (argc < 3)
+   {
+      fprintf (stderr, "Usage: %s pixi_pwmseq <cmd (f, r, l, r)> <speed>\n", argv [0]) ;
+      exit (1) ;
+   }
+
+   pixi_spi_open (0) ;
+
+   speed = atoi (argv [3]) ;
+   if (speed > 100)
+      speed = 100;
+   else if (speed < 0)
+      speed = 0;
+      
+   pwm = (speed * 1023 / 100) & 0x000003ff;
+
+   /**/ if (strcasecmp (argv [2], "f" )   == 0) { cmd_fl = 0x0000 + pwm; cmd_fr = 0x0000 + pwm; cmd_rl = 0x8000 + pwm; cmd_rr = 0x8000 + pwm; }
+   else if (strcasecmp (argv [2], "b" )   == 0) { cmd_fl = 0x8000 + pwm; cmd_fr = 0x8000 + pwm; cmd_rl = 0x0000 + pwm; cmd_rr = 0x0000 + pwm; }
+   else if (strcasecmp (argv [2], "l")    == 0) { cmd_fl = 0x8000 + pwm; cmd_fr = 0x0000 + pwm; cmd_rl = 0x0000 + pwm; cmd_rr = 0x8000 + pwm; }
+   else if (strcasecmp (argv [2], "r")    == 0) { cmd_fl = 0x0000 + pwm; cmd_fr = 0x8000 + pwm; cmd_rl = 0x8000 + pwm; cmd_rr = 0x0000 + pwm; }
+   else                                         { cmd_fl = 0x0000;       cmd_fr = 0x0000;       cmd_rl = 0x8000;       cmd_rr = 0x8000; }
+   
+   // All four motors change together (0x47 still goes last within the batch)
+   values[4] = cmd_rr; // RR
+   values[5] = cmd_fr; // FR
+   values[6] = cmd_rl; // RL
+   values[7] = cmd_fl; // FL
+   
+   return(pixi_pwm_write_pins(0, 0xf0, values));
+}
+
+
+/*
+ * pixi_pwmseq:
+ *	PWM sequencer streaming. The FPGA's sequencer plays 4-channel frames
+ *	(PWM 4..7) from a 64-frame FIFO, one per step, at 1Hz or 50Hz. A
+ *	frame is queued by writing its four words to reg_pwm_seq_data (0x4A),
+ *	PWM 4 first; the outputs only change as the sequencer plays it.
+ *	Frames are pushed into a host-side ring. A feeder thread keeps the
+ *	FIFO topped up from the ring, in batched transfers of up to 15
+ *	frames. Each transfer starts with a write of reg_pwm_seq_status
+ *	(0x4D), which puts the FPGA back on a frame boundary, and ends with a
+ *	read of it.
+ *	The thread sleeps while the FIFO holds more than half its depth. A
+ *	gap on the outputs only happens if the FIFO runs dry after playback
+ *	has started, which is counted as an underrun. Builds without the
+ *	status register read 0 there (bit 15 clear). For those the FIFO
+ *	level is estimated from the frames sent and the time since the start.
+ *********************************************************************************
+ */
+
+#define PIXI_PWMSEQ_STATUS_VALID 0x8000
+#define PIXI_PWMSEQ_STATUS_EMPTY 0x0100
+#define PIXI_PWMSEQ_STATUS_LEVEL 0x00ff
+
+typedef struct
+{
+  uint16_t pwm [4] ;                      // PWM 4..7: duty in bits 9..0, direction in bit 15
+} pixi_pwm_frame ;
+
+typedef struct
+{
+  pixi_pwm_frame ring [PIXI_PWMSEQ_RING] ;
+  volatile unsigned head ;                // Next slot to fill (pixi_pwmseq_push only)
+  volatile unsigned tail ;                // Next slot to send (feeder thread only)
+  volatile int running ;
+  volatile int draining ;                 // No more frames coming: stop once they're played
+  int channel ;
+  int rate ;                              // Steps per second: 1 or 50
+  unsigned long sent ;
+  unsigned long transfers ;
+  unsigned long underruns ;
+  unsigned long errors ;
+  uint64_t startNs ;
+  pthread_mutex_t lock ;
+  pthread_cond_t space ;                  // Signalled as frames leave the ring
+  pthread_t thread ;
+} pixi_pwmseq ;
+
+static void *pixi_pwmseq_thread (void *arg)
+{
+  pixi_pwmseq *seq = arg ;
+  pixi_spi_batch batch ;
+  int results [PIXI_BATCH_MAX] ;
+  pixi_pwm_frame *frame ;
+  uint64_t periodNs = 1000000000ULL / seq->rate ;
+  uint64_t played ;
+  int level = 0 ;
+  int status ;
+  int started = FALSE ;
+  int n, i, c ;
+
+  while (seq->running)
+  {
+    // Top up the FIFO from the ring
+    n = seq->head - seq->tail ;
+    if (n > PIXI_PWMSEQ_DEPTH - level)
+      n = PIXI_PWMSEQ_DEPTH - level ;
+    if (n > (PIXI_BATCH_MAX - 2) / 4)
+      n = (PIXI_BATCH_MAX - 2) / 4 ;
+
+    __sync_synchronize () ;               // See the frames the head points past
+    pixi_spi_batch_init (&batch, seq->channel) ;
+    pixi_spi_batch_set (&batch, PIXI_PWMSEQ_STATUS, 0) ;
+    for (i = 0 ; i < n ; i++)
+    {
+      frame = &seq->ring [(seq->tail + i) & (PIXI_PWMSEQ_RING - 1)] ;
+      for (c = 0 ; c < 4 ; c++)
+        pixi_spi_batch_set (&batch, PIXI_PWMSEQ_DATA, frame->pwm [c]) ; // The fourth queues the frame
+    }
+    pixi_spi_batch_get (&batch, PIXI_PWMSEQ_STATUS) ;
+    if (pixi_spi_batch_submit (&batch, results) < 0)
+    {
+      seq->errors++ ;
+      status = 0 ;
+      n = 0 ;
+    }
+    else
+      status = results [1 + n * 4] ;
+    seq->transfers++ ;
+
+    if (n > 0)
+    {
+      pthread_mutex_lock (&seq->lock) ;
+      seq->tail += n ;
+      seq->sent += n ;
+      pthread_cond_signal (&seq->space) ;
+      pthread_mutex_unlock (&seq->lock) ;
+      if (!started)
+      {
+        seq->startNs = pixi_sampler_now () ;
+        started = TRUE ;
+      }
+    }
+
+    if (status & PIXI_PWMSEQ_STATUS_VALID)
+    {
+      level = status & PIXI_PWMSEQ_STATUS_LEVEL ;
+      if ((status & PIXI_PWMSEQ_STATUS_EMPTY) && started && (seq->head != seq->tail))
+        seq->underruns++ ;
+    }
+    else if (started)
+    {
+      played = (pixi_sampler_now () - seq->startNs) / periodNs ;
+      level = (played < seq->sent) ? (int)(seq->sent - played) : 0 ;
+    }
+
+    if (seq->draining && (seq->head == seq->tail) && (level == 0))
+      break ;
+
+    // Sleep until the FIFO is down to half full, or a frame's time if there's nothing to send
+    if (level > PIXI_PWMSEQ_DEPTH / 2)
+      usleep ((level - PIXI_PWMSEQ_DEPTH / 2) * (periodNs / 1000)) ;
+    else if (seq->head == seq->tail)
+      usleep (periodNs / 1000) ;
+  }
+
+  __sync_synchronize () ;
+  seq->running = FALSE ;
+  pthread_cond_broadcast (&seq->space) ;
+  return NULL ;
+}
+
+// Start the sequencer stepping at rate (1 or 50) frames per second, fed from the ring
+int pixi_pwmseq_start (pixi_pwmseq *seq, int channel, int rate)
+{
+  pixi_spi_batch batch ;
+
+  if ((rate != 1) && (rate != 50))
+    return -1 ;
+
+  memset (seq, 0, sizeof (*seq)) ;
+  seq->channel = channel ;
+  seq->rate    = rate ;
+  seq->running = TRUE ;
+  pthread_mutex_init (&seq->lock, NULL) ;
+  pthread_cond_init  (&seq->space, NULL) ;
+
+  // PWM 4..7 from the sequencer, stepping at 1Hz or 50Hz (reg_pwm_cfg)
+  pixi_spi_batch_init (&batch, channel) ;
+  pixi_spi_batch_set (&batch, 0x4f, 0x00f0 | 0x0100 | ((rate == 50) ? 0x0400 : 0)) ;
+  if (pixi_spi_batch_submit (&batch, NULL) < 0)
+    return -1 ;
+
+  if (pthread_create (&seq->thread, NULL, pixi_pwmseq_thread, seq) != 0)
+  {
+    fprintf (stderr, "Unable to start PWM sequencer thread\n") ;
+    return -1 ;
+  }
+  return 0 ;
+}
+
+// Queue frames, waiting for room in the ring as needed. Returns the no. queued.
+int pixi_pwmseq_push (pixi_pwmseq *seq, const pixi_pwm_frame *frames, int count)
+{
+  int i ;
+
+  for (i = 0 ; i < count ; i++)
+  {
+    if (seq->head - seq->tail == PIXI_PWMSEQ_RING)
+    {
+      pthread_mutex_lock (&seq->lock) ;
+      while ((seq->head - seq->tail == PIXI_PWMSEQ_RING) && seq->running)
+        pthread_cond_wait (&seq->space, &seq->lock) ;
+      pthread_mutex_unlock (&seq->lock) ;
+      if (!seq->running)
+        break ;
+    }
+    seq->ring [seq->head & (PIXI_PWMSEQ_RING - 1)] = frames [i] ;
+    __sync_synchronize () ;               // Publish the frame before the new head
+    seq->head++ ;
+  }
+  return i ;
+}
+
+// Wait for everything queued to be played (drain) or stop straight away, then stop the sequencer
+void pixi_pwmseq_stop (pixi_pwmseq *seq, int drain)
+{
+  pixi_spi_batch batch ;
+
+  if (drain)
+    seq->draining = TRUE ;
+  else
+    seq->running = FALSE ;
+  pthread_join (seq->thread, NULL) ;
+
+  pixi_spi_batch_init (&batch, seq->channel) ;
+  pixi_spi_batch_set (&batch, 0x4f, 0x0000) ; // Disable PWM sequencer
+  pixi_spi_batch_submit (&batch, NULL) ;
+}
+
+
+/*
+ * doPwmStream:
+ *	gpio pixi_pwmstream <file|-> [1|50]
+ *	Play a trajectory through the PWM sequencer: one frame per line, the
+ *	four PWM 4..7 values (decimal or 0x hex) separated by spaces.
+ *********************************************************************************
+ */
+
+static void doPwmStream (int argc, char *argv [])
+{
+  static pixi_pwmseq seq ;
+  pixi_pwm_frame frame ;
+  unsigned long value [4] ;
+  char line [256] ;
+  int rate = 50 ;
+  int lineNo = 0 ;
+  FILE *fp ;
+  int c ;
+
+  if ((argc < 3) || (argc > 4))
+  {
+    fprintf (stderr, "Usage: %s pixi_pwmstream <file|-> [1|50]\n", argv [0]) ;
+    exit (1) ;
+  }
+  if (argc == 4)
+    rate = atoi (argv [3]) ;
+
+  if (strcmp (argv [2], "-") == 0)
+    fp = stdin ;
+  else if ((fp = fopen (argv [2], "r")) == NULL)
+  {
+    fprintf (stderr, "%s: Unable to open %s: %s\n", argv [0], argv [2], strerror (errno)) ;
+    exit (1) ;
+  }
+
+  pixi_spi_open (0) ;
+  if (pixi_pwmseq_start (&seq, 0, rate) < 0)
+  {
+    fprintf (stderr, "%s: Unable to start the PWM sequencer (rate must be 1 or 50)\n", argv [0]) ;
+    exit (1) ;
+  }
+
+  while (fgets (line, sizeof (line), fp) != NULL)
+  {
+    lineNo++ ;
+    if ((line [0] == '#') || (line [strspn (line, " \t\r\n")] == '\0'))
+      continue ;
+    if (sscanf (line, "%li %li %li %li", (long *)&value [0], (long *)&value [1], (long *)&value [2], (long *)&value [3]) != 4)
+    {
+      fprintf (stderr, "%s: line %d: expected 4 PWM values\n", argv [0], lineNo) ;
+      continue ;
+    }
+    for (c = 0 ; c < 4 ; c++)
+      frame.pwm [c] = value [c] & 0xffff ;
+    if (pixi_pwmseq_push (&seq, &frame, 1) < 1)
+      break ;
+  }
+  if (fp != stdin)
+    fclose (fp) ;
+
+  pixi_pwmseq_stop (&seq, TRUE) ;
+  printf ("%lu frames in %lu transfers, %lu underruns, %lu errors\n", seq.sent, seq.transfers, seq.underruns, seq.errors) ;
+}
+
+
+/*
+ * doPwmFreq:
+ *	gpio pwm_freq <pin> <hz> [bits]
+ *	Set the frequency and resolution (default 10 bits) of a PWM channel.
+ *	0Hz returns it to the default 50Hz servo timebase.
+ *********************************************************************************
+ */
+
+static void doPwmFreq (int argc, char *argv [])
+{
+  int pin, bits = 10 ;
+  long hz, actual ;
+
+  if ((argc < 4) || (argc > 5))
+  {
+    fprintf (stderr, "Usage: %s pwm_freq <pin> <hz> [bits]\n", argv [0]) ;
+    exit (1) ;
+  }
+  pin = atoi (argv [2]) ;
+  hz  = atol (argv [3]) ;
+  if (argc == 5)
+    bits = atoi (argv [4]) ;
+
+  if ((actual = pixi_pwm_set_frequency (0, pin, hz, bits)) < 0)
+  {
+    fprintf (stderr, "%s: unable to run PWM %d at %ldHz with %d bits (pin 0..7, bits 1..15, or the FPGA build has no per-channel timebase)\n",
+      argv [0], pin, hz, bits) ;
+    exit (1) ;
+  }
+  if (actual == 0)
+    printf ("PWM %d: default timebase (50Hz, 10 bits)\n", pin) ;
+  else
+    printf ("PWM %d: %ldHz, %d bits (0..%d)\n", pin, actual, bits, (1 << bits) - 1) ;
+}
+
+
+/*
+ * doPwmSkew:
+ *	gpio pwm_skew [count]
+ *	Compare how far apart the PWM channels can change. Each run sets all
+ *	eight channels (to the values last written, so the outputs do not
+ *	move) first one pixi_spi_set() at a time, then with
+ *	pixi_pwm_write_pins(). Both are timed the same way, on the Pi's
+ *	clock: from the start of the first transfer carrying a new value to
+ *	the end of the last one. No channel can change outside that window,
+ *	so it is an upper bound on the skew. The FPGA has no clock that the
+ *	Pi can read at this resolution, so the actual skew within a transfer
+ *	is not measured: with reg_pwm_commit it is one FPGA clock by design,
+ *	without it one frame per channel.
+ *********************************************************************************
+ */
+
+typedef struct
+{
+  long long total ;
+  long long max ;
+} pwmSkewWindow ;
+
+static void pwmSkewRecord (pwmSkewWindow *window, const struct timespec *start, const struct timespec *end)
+{
+  long long ns = (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec) ;
+
+  window->total += ns ;
+  if (ns > window->max)
+    window->max = ns ;
+}
+
+static void doPwmSkew (int argc, char *argv [])
+{
+  struct timespec start, end ;
+  unsigned int values [8] ;
+  pwmSkewWindow sequential = { 0, 0 } ;
+  pwmSkewWindow committed = { 0, 0 } ;
+  int count = 100 ;
+  int run, i ;
+
+  if (argc > 3)
+  {
+    fprintf (stderr, "Usage: %s pwm_skew [count]\n", argv [0]) ;
+    exit (1) ;
+  }
+  if ((argc == 3) && ((count = atoi (argv [2])) < 1))
+    count = 1 ;
+
+  pixi_spi_open (0) ;
+  for (i = 0 ; i < 8 ; i++)
+    values [i] = pixi_shadow_get (0, 0x40 + i) ;
+
+  for (run = 0 ; run < count ; run++)
+  {
+    clock_gettime (CLOCK_MONOTONIC, &start) ;
+    for (i = 0 ; i < 8 ; i++)
+      pixi_spi_set (0, 0x40 + i, values [i]) ;
+    clock_gettime (CLOCK_MONOTONIC, &end) ;
+    pwmSkewRecord (&sequential, &start, &end) ;
+
+    clock_gettime (CLOCK_MONOTONIC, &start) ;
+    if (pixi_pwm_write_pins (0, 0xff, values) < 0)
+      exit (1) ;
+    clock_gettime (CLOCK_MONOTONIC, &end) ;
+    pwmSkewRecord (&committed, &start, &end) ;
+  }
+
+  printf ("8 channels, %d run%s. Window: first transfer start to last transfer end (host clock)\n",
+    count, (count == 1) ? "" : "s") ;
+  printf ("%-12s %10s %12s %12s\n", "Writes", "Transfers", "Window (us)", "Max (us)") ;
+  printf ("%-12s %10d %12.1f %12.1f\n", "Sequential", 8, sequential.total / 1e3 / count, sequential.max / 1e3) ;
+  printf ("%-12s %10d %12.1f %12.1f\n", "Committed",  1, committed.total / 1e3 / count,  committed.max / 1e3) ;
+}
+
+
+/*
+ * doPiXi_Test:
+ *	Automated test & verification process ...
+ *********************************************************************************
+ */
+int pixi_test(int test_no)
+{
+
+   // 1: test GPIO1(a) odd = out, even = in, "000000000000", "111111111111", walking '1'...
+   // 2: test GPIO1(a) odd = in, even = out, "000000000000", "111111111111", walking '1'...
+   
+   return(0);
+}
+ 
+ 
+ /*
+ * pixi_prog:
+ *	Fast slave-serial bitstream loader. Rather than three digitalWrite
+ *	calls per bit, CCLK and DATA are driven by writing the GPSET0/GPCLR0
+ *	registers directly, using a table built beforehand. For every byte
+ *	value and bit the table holds the GPCLR word (CCLK low, plus DATA low
+ *	for a 0 bit) and the GPSET word (DATA high for a 1 bit). The rising
+ *	CCLK edge is a third write of the CCLK mask alone. The inner loop is
+ *	just table lookups and stores, with no branches.
+ *
+ *	pixi_prog_map (TRUE) gives a block of anonymous memory in place of
+ *	the GPIO registers, so the loader can be exercised without hardware.
+ *********************************************************************************
+ */
+
+static uint32_t pixiProgTable [256][8][2] ;             // [byte][bit]: GPCLR word, GPSET word
+static uint32_t pixiProgCclk ;
+
+static void pixi_prog_table (int cclkGpio, int dataGpio)
+{
+  uint32_t data = 1 << dataGpio ;
+  int byte ;
+  int bit ;
+
+  pixiProgCclk = 1 << cclkGpio ;
+
+  for (byte = 0 ; byte < 256 ; byte++)
+    for (bit = 0 ; bit < 8 ; bit++)         // MSB first
+    {
+      if (byte & (0x80 >> bit))
+      {
+        pixiProgTable [byte][bit][0] = pixiProgCclk ;
+        pixiProgTable [byte][bit][1] = data ;
+      }
+      else
+      {
+        pixiProgTable [byte][bit][0] = pixiProgCclk | data ;
+        pixiProgTable [byte][bit][1] = 0 ;
+      }
+    }
+}
+
+// Physical base of the peripherals: from the device tree if present, else the original Pi's
+static off_t pixi_prog_peripheral_base (void)
+{
+  unsigned char ranges [8] ;
+  off_t base = 0x20000000 ;
+  FILE *fp ;
+
+  if ((fp = fopen ("/proc/device-tree/soc/ranges", "rb")) != NULL)
+  {
+    if (fread (ranges, 1, sizeof (ranges), fp) == sizeof (ranges))
+      base = (ranges [4] << 24) | (ranges [5] << 16) | (ranges [6] << 8) | ranges [7] ;
+    fclose (fp) ;
+  }
+  return base ;
+}
+
+// Map the GPIO registers (or a fake block of memory), with the CCLK & DATA tables set up
+volatile uint32_t *pixi_prog_map (int fake)
+{
+  void *map ;
+  int fd ;
+
+  if (wpMode == WPI_MODE_PINS)
+    pixi_prog_table (wpiPinToGpio (CCLK_PIN), wpiPinToGpio (DATA_PIN)) ;
+  else
+    pixi_prog_table (CCLK_PIN, DATA_PIN) ;
+
+  if (fake)
+    map = mmap (NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) ;
+  else if ((fd = open ("/dev/gpiomem", O_RDWR | O_SYNC)) >= 0)
+  {
+    map = mmap (NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ;
+    close (fd) ;
+  }
+  else if ((fd = open ("/dev/mem", O_RDWR | O_SYNC)) >= 0)
+  {
+    map = mmap (NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, pixi_prog_peripheral_base () + BCM_GPIO_OFFSET) ;
+    close (fd) ;
+  }
+  else
+    map = MAP_FAILED ;
+
+  if (map == MAP_FAILED)
+  {
+    fprintf (stderr, "Unable to map the GPIO registers: %s\n", strerror (errno)) ;
+    return NULL ;
+  }
+  return (volatile uint32_t *)map ;
+}
+
+void pixi_prog_unmap (volatile uint32_t *gpio)
+{
+  munmap ((void *)gpio, 4096) ;
+}
+
+#define PIXI_PROG_BIT(n) \
+  *clr = bits [n][0] ; \
+  *set = bits [n][1] ; \
+  *set = cclk ;
+
+// Clock a buffer out on CCLK/DATA, MSB first
+void pixi_prog_load (volatile uint32_t *gpio, const uint8_t *data, long length)
+{
+  volatile uint32_t *set = gpio + BCM_GPIO_GPSET0 ;
+  volatile uint32_t *clr = gpio + BCM_GPIO_GPCLR0 ;
+  const uint32_t cclk = pixiProgCclk ;
+  const uint32_t (*bits)[2] ;
+  long i ;
+
+  for (i = 0 ; i < length ; i++)
+  {
+    bits = (const uint32_t (*)[2])pixiProgTable [data [i]] ;
+    PIXI_PROG_BIT (0) PIXI_PROG_BIT (1) PIXI_PROG_BIT (2) PIXI_PROG_BIT (3)
+    PIXI_PROG_BIT (4) PIXI_PROG_BIT (5) PIXI_PROG_BIT (6) PIXI_PROG_BIT (7)
+  }
+}
+
+// Extra CCLK cycles to finish start-up after the bitstream
+void pixi_prog_clocks (volatile uint32_t *gpio, int count)
+{
+  while (count--)
+  {
+    gpio [BCM_GPIO_GPCLR0] = pixiProgCclk ;
+    gpio [BCM_GPIO_GPSET0] = pixiProgCclk ;
+  }
+}
+
+
+/*
+ * pixi_prog_buffer:
+ *	Bitstream file contents. Regular files are mapped rather than copied
+ *	into a malloc'd buffer: that avoids the extra copy, and the pages can
+ *	be dropped again under memory pressure. With MADV_SEQUENTIAL the
+ *	kernel reads ahead as the loader goes, while 'populate' reads the whole
+ *	file in up front (MAP_POPULATE). Pipes, character devices and files
+ *	that fail to map are read into memory instead.
+ *********************************************************************************
+ */
+
+typedef struct
+{
+  uint8_t *data ;
+  long length ;
+  int mapped ;
+} pixi_prog_buffer ;
+
+void pixi_prog_buffer_free (pixi_prog_buffer *buffer)
+{
+  if (buffer->mapped)
+    munmap (buffer->data, buffer->length) ;
+  else
+    free (buffer->data) ;
+  memset (buffer, 0, sizeof (*buffer)) ;
+}
+
+int pixi_prog_buffer_load (pixi_prog_buffer *buffer, FILE *fp, int populate)
+{
+  struct stat st ;
+  long size = 0 ;
+  long length ;
+  void *map ;
+  uint8_t *grown ;
+
+  memset (buffer, 0, sizeof (*buffer)) ;
+
+  if ((fstat (fileno (fp), &st) == 0) && S_ISREG (st.st_mode) && (st.st_size > 0))
+  {
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fileno (fp), 0) ;
+    if (map != MAP_FAILED)
+    {
+      if (!populate)
+        madvise (map, st.st_size, MADV_SEQUENTIAL) ;
+      buffer->data   = map ;
+      buffer->length = st.st_size ;
+      buffer->mapped = TRUE ;
+      return 0 ;
+    }
+  }
+
+  // Not mappable: read it all, growing the buffer as needed
+  for (;;)
+  {
+    if (buffer->length == size)
+    {
+      size = size ? size * 2 : 256 * 1024 ;
+      if ((grown = realloc (buffer->data, size)) == NULL)
+      {
+        pixi_prog_buffer_free (buffer) ;
+        return -1 ;
+      }
+      buffer->data = grown ;
+    }
+    if ((length = fread (buffer->data + buffer->length, 1, size - buffer->length, fp)) == 0)
+      break ;
+    buffer->length += length ;
+  }
+
+  if (ferror (fp))
+  {
+    pixi_prog_buffer_free (buffer) ;
+    return -1 ;
+  }
+  return 0 ;
+}
+
+
+/*
+ * pixi_prog_stream:
+ *	Compressed bitstreams (.bin.gz or .bin.zst).
+ *	A producer thread reads the output of gzip/zstd into a ring of
+ *	buffers. The decompressor is run directly (no shell, fixed path, empty
+ *	environment) with the invoking user's privileges, and reads the file
+ *	on its stdin. Meanwhile this thread clocks each buffer out to the FPGA as
+ *	soon as it is filled, so decompression and SD card reads overlap the
+ *	bit-banging. The bytes clocked out are exactly those of the
+ *	uncompressed file, and the checksum reported by pixi_prog shows this.
+ *********************************************************************************
+ */
+
+#define PIXI_PROG_CHECKSUM_INIT 0x811c9dc5      // FNV-1a
+
+static uint32_t pixi_prog_checksum (uint32_t hash, const uint8_t *data, long length)
+{
+  while (length--)
+    hash = (hash ^ *data++) * 0x01000193 ;
+  return hash ;
+}
+
+// Loader progress: bytes clocked out so far, of 'total' (0 if not known), 'elapsed' ns since the start
+typedef void (*pixi_prog_progress) (long done, long total, long long elapsed, void *context) ;
+
+static long long pixi_prog_elapsed (const struct timespec *start)
+{
+  struct timespec now ;
+
+  clock_gettime (CLOCK_MONOTONIC, &now) ;
+  return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec) ;
+}
+
+// Clock out a bitstream held in memory, PIXI_PROG_CHUNK bytes between progress reports
+void pixi_prog_buffer_clock (volatile uint32_t *gpio, const uint8_t *data, long length, uint32_t *checksum,
+                             pixi_prog_progress progress, void *context)
+{
+  struct timespec start ;
+  long chunk ;
+  long i ;
+
+  clock_gettime (CLOCK_MONOTONIC, &start) ;
+  *checksum = PIXI_PROG_CHECKSUM_INIT ;
+  for (i = 0 ; i < length ; i += chunk)
+  {
+    chunk = (length - i < PIXI_PROG_CHUNK) ? length - i : PIXI_PROG_CHUNK ;
+    pixi_prog_load (gpio, data + i, chunk) ;
+    *checksum = pixi_prog_checksum (*checksum, data + i, chunk) ;
+    if (progress != NULL)
+      progress (i + chunk, length, pixi_prog_elapsed (&start), context) ;
+  }
+}
+
+// Program that decompresses a file, or NULL if it isn't compressed
+static const char *pixi_prog_decompressor (const char *file)
+{
+  size_t length = strlen (file) ;
+
+  if ((length > 3) && (strcmp (file + length - 3, ".gz") == 0))
+    return PIXI_PROG_GZIP ;
+  if ((length > 4) && (strcmp (file + length - 4, ".zst") == 0))
+    return PIXI_PROG_ZSTD ;
+  return NULL ;
+}
+
+// Start decompressing a file. Returns a stream of the decompressed data, or NULL.
+static FILE *pixi_prog_decompress_open (const char *file, pid_t *pid)
+{
+  static char *const environment [] = { NULL } ;
+  const char *program = pixi_prog_decompressor (file) ;
+  char *argv [4] ;
+  int fds [2] ;
+  int fd ;
+  FILE *fp ;
+
+  if ((program == NULL) || (pipe2 (fds, O_CLOEXEC) < 0))
+    return NULL ;
+
+  if ((*pid = fork ()) == 0)
+  {
+    // Give up the setuid privileges before touching the file
+    if ((geteuid () == 0) && (getuid () != 0) && (setgroups (0, NULL) < 0))
+      _exit (127) ;
+    if ((setgid (getgid ()) < 0) || (setuid (getuid ()) < 0))
+      _exit (127) ;
+
+    if ((fd = open (file, O_RDONLY)) < 0)
+      _exit (127) ;
+    if ((dup2 (fd, 0) < 0) || (dup2 (fds [1], 1) < 0))
+      _exit (127) ;
+    for (fd = 3 ; fd < 1024 ; fd++)
+      close (fd) ;
+
+    argv [0] = (char *)program ;
+    argv [1] = "-dc" ;
+    argv [2] = (strcmp (program, PIXI_PROG_ZSTD) == 0) ? "-q" : NULL ;
+    argv [3] = NULL ;
+    execve (program, argv, environment) ;
+    _exit (127) ;
+  }
+
+  close (fds [1]) ;
+  if (*pid < 0)
+  {
+    close (fds [0]) ;
+    return NULL ;
+  }
+  if ((fp = fdopen (fds [0], "r")) == NULL)
+  {
+    close (fds [0]) ;
+    waitpid (*pid, NULL, 0) ;
+  }
+  return fp ;
+}
+
+// Finish decompressing. Returns 0 if the decompressor succeeded, else -1.
+static int pixi_prog_decompress_close (FILE *fp, pid_t pid)
+{
+  int status ;
+
+  fclose (fp) ;
+  while (waitpid (pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return -1 ;
+  return (WIFEXITED (status) && (WEXITSTATUS (status) == 0)) ? 0 : -1 ;
+}
+
+typedef struct
+{
+  FILE *pipe ;
+  pid_t pid ;                           // Decompressor
+  uint8_t data [PIXI_PROG_SLOTS][PIXI_PROG_CHUNK] ;
+  long length [PIXI_PROG_SLOTS] ;
+  unsigned head ;                       // Slots filled (producer)
+  unsigned tail ;                       // Slots clocked out (consumer)
+  int done ;
+  int error ;
+  pthread_mutex_t lock ;
+  pthread_cond_t filled ;
+  pthread_cond_t emptied ;
+} pixi_prog_ring ;
+
+static void *pixi_prog_producer (void *arg)
+{
+  pixi_prog_ring *ring = arg ;
+  unsigned slot ;
+  long length ;
+
+  for (;;)
+  {
+    pthread_mutex_lock (&ring->lock) ;
+    while (ring->head - ring->tail == PIXI_PROG_SLOTS)
+      pthread_cond_wait (&ring->emptied, &ring->lock) ;
+    slot = ring->head % PIXI_PROG_SLOTS ;
+    pthread_mutex_unlock (&ring->lock) ;
+
+    length = fread (ring->data [slot], 1, PIXI_PROG_CHUNK, ring->pipe) ;
+
+    pthread_mutex_lock (&ring->lock) ;
+    if (length > 0)
+    {
+      ring->length [slot] = length ;
+      ring->head++ ;
+    }
+    if (length < PIXI_PROG_CHUNK)
+    {
+      ring->error = ferror (ring->pipe) ;
+      ring->done  = TRUE ;
+    }
+    pthread_cond_signal (&ring->filled) ;
+    pthread_mutex_unlock (&ring->lock) ;
+
+    if (length < PIXI_PROG_CHUNK)
+      return NULL ;
+  }
+}
+
+// Decompress a bitstream while clocking it out. Returns the no. of bytes loaded, or -1.
+long pixi_prog_stream (volatile uint32_t *gpio, const char *file, uint32_t *checksum,
+                       pixi_prog_progress progress, void *context)
+{
+  struct timespec start ;
+  pixi_prog_ring *ring ;
+  pthread_t producer ;
+  unsigned slot ;
+  long total = 0 ;
+  int status ;
+
+  if ((ring = calloc (1, sizeof (*ring))) == NULL)
+    return -1 ;
+
+  if ((ring->pipe = pixi_prog_decompress_open (file, &ring->pid)) == NULL)
+  {
+    free (ring) ;
+    return -1 ;
+  }
+  pthread_mutex_init (&ring->lock, NULL) ;
+  pthread_cond_init  (&ring->filled, NULL) ;
+  pthread_cond_init  (&ring->emptied, NULL) ;
+  pthread_create (&producer, NULL, pixi_prog_producer, ring) ;
+
+  clock_gettime (CLOCK_MONOTONIC, &start) ;
+  *checksum = PIXI_PROG_CHECKSUM_INIT ;
+  for (;;)
+  {
+    pthread_mutex_lock (&ring->lock) ;
+    while ((ring->tail == ring->head) && !ring->done)
+      pthread_cond_wait (&ring->filled, &ring->lock) ;
+    if (ring->tail == ring->head)
+    {
+      pthread_mutex_unlock (&ring->lock) ;
+      break ;
+    }
+    slot = ring->tail % PIXI_PROG_SLOTS ;
+    pthread_mutex_unlock (&ring->lock) ;
+
+    pixi_prog_load (gpio, ring->data [slot], ring->length [slot]) ;
+    *checksum = pixi_prog_checksum (*checksum, ring->data [slot], ring->length [slot]) ;
+    total += ring->length [slot] ;
+    if (progress != NULL)
+      progress (total, 0, pixi_prog_elapsed (&start), context) ;
+
+    pthread_mutex_lock (&ring->lock) ;
+    ring->tail++ ;
+    pthread_cond_signal (&ring->emptied) ;
+    pthread_mutex_unlock (&ring->lock) ;
+  }
+
+  pthread_join (producer, NULL) ;
+  status = pixi_prog_decompress_close (ring->pipe, ring->pid) ;
+  if (ring->error || (status != 0))
+    total = -1 ;
+  free (ring) ;
+  return total ;
+}
+
+
+/*
+ * pixi_image:
+ *	The FPGA image store: the bitstreams in PIXI_IMAGE_DIR (name.bin,
+ *	name.bin.gz or name.bin.zst) and a manifest, PIXI_IMAGE_MANIFEST, with
+ *	one line per image:
+ *	    name file demo size mtime checksum build
+ *	'demo' is the image's place in the demo sequence (register 0xF8 names
+ *	the next one to load), or -1. pixi_demo_001 is 0, pixi_demo_002 is 1,
+ *	and so on. 'size' and 'mtime' are those of the file. 'checksum' is
+ *	the FNV-1a checksum of the bitstream as clocked out, and 'build' is
+ *	the BUILD_TIME (build_time_pkg.vhd) read back after the image was last
+ *	loaded, or 0.
+ *
+ *	The store is user-writable, so every manifest entry is checked when
+ *	it is read (names, file suffix, demo no. and build in range) and bad
+ *	entries are dropped. The manifest is read once and images are then
+ *	found with a single lookup. The directory is only scanned to create the manifest or when
+ *	asked to (gpio fpga_index). An entry whose file has changed size or
+ *	mtime is re-checksummed and its build forgotten. Fast boot relies on
+ *	the build field: the FPGA already holds an image when registers
+ *	0x00-0x02 match it.
+ *********************************************************************************
+ */
+
+typedef struct
+{
+  char name [64] ;
+  char file [128] ;                     // In PIXI_IMAGE_DIR
+  int demo ;
+  long long size ;
+  long long mtime ;
+  uint32_t checksum ;
+  unsigned long long build ;
+} pixi_image ;
+
+static pixi_image pixiImages [PIXI_IMAGE_MAX] ;
+static int pixiImageCount = -1 ;         // -1 until the manifest has been loaded
+static pixi_image *pixiImageDemo [256] ; // By demo sequence no.
+
+// Image names and files are plain names in PIXI_IMAGE_DIR: letters, digits, '.', '_', '-' and '+',
+// not starting with '.' or '-'
+static int pixi_image_name_valid (const char *name)
+{
+  const char *c ;
+
+  if ((name [0] == '\0') || (name [0] == '.') || (name [0] == '-'))
+    return FALSE ;
+  for (c = name ; *c != '\0' ; c++)
+    if (!isalnum ((unsigned char)*c) && (strchr ("._-+", *c) == NULL))
+      return FALSE ;
+  return TRUE ;
+}
+
+static const char *pixiImageSuffix [] = { ".bin", ".bin.gz", ".bin.zst" } ; // In order of precedence
+
+// A manifest entry can be trusted: its file is its name plus a bitstream suffix and the numbers are in range
+static int pixi_image_valid (const pixi_image *image)
+{
+  size_t length = strlen (image->name) ;
+  unsigned s ;
+
+  if (!pixi_image_name_valid (image->name) || !pixi_image_name_valid (image->file) ||
+      (strncmp (image->file, image->name, length) != 0))
+    return FALSE ;
+  for (s = 0 ; s < sizeof (pixiImageSuffix) / sizeof (pixiImageSuffix [0]) ; s++)
+    if (strcmp (image->file + length, pixiImageSuffix [s]) == 0)
+      break ;
+  if (s == sizeof (pixiImageSuffix) / sizeof (pixiImageSuffix [0]))
+    return FALSE ;
+
+  return (image->demo >= -1) && (image->demo < 256) && (image->size >= 0) && (image->build <= 0xffffffffffffULL) ;
+}
+
+static void pixi_image_path (const pixi_image *image, char *path)
+{
+  snprintf (path, PATH_MAX, "%s/%s", PIXI_IMAGE_DIR, image->file) ;
+}
+
+// Checksum of the bitstream as it would be clocked out (decompressed if need be)
+static int pixi_image_checksum (const char *path, uint32_t *checksum)
+{
+  uint8_t data [PIXI_PROG_CHUNK] ;
+  pixi_prog_buffer buffer ;
+  long length ;
+  pid_t pid ;
+  FILE *fp ;
+
+  *checksum = PIXI_PROG_CHECKSUM_INIT ;
+
+  if (pixi_prog_decompressor (path) != NULL)
+  {
+    if ((fp = pixi_prog_decompress_open (path, &pid)) == NULL)
+      return -1 ;
+    while ((length = fread (data, 1, sizeof (data), fp)) > 0)
+      *checksum = pixi_prog_checksum (*checksum, data, length) ;
+    return (pixi_prog_decompress_close (fp, pid) == 0) ? 0 : -1 ;
+  }
+
+  if ((fp = fopen (path, "rb")) == NULL)
+    return -1 ;
+  if (pixi_prog_buffer_load (&buffer, fp, FALSE) < 0)
+  {
+    fclose (fp) ;
+    return -1 ;
+  }
+  *checksum = pixi_prog_checksum (*checksum, buffer.data, buffer.length) ;
+  pixi_prog_buffer_free (&buffer) ;
+  fclose (fp) ;
+  return 0 ;
+}
+
+// Bring an entry up to date with its file. Returns FALSE if it was already.
+static int pixi_image_refresh (pixi_image *image)
+{
+  char path [PATH_MAX] ;
+  struct stat st ;
+
+  pixi_image_path (image, path) ;
+  if (stat (path, &st) < 0)
+    return FALSE ;
+  if ((image->size == (long long)st.st_size) && (image->mtime == (long long)st.st_mtime))
+    return FALSE ;
+
+  image->size  = st.st_size ;
+  image->mtime = st.st_mtime ;
+  image->build = 0 ;
+  if (pixi_image_checksum (path, &image->checksum) < 0)
+    fprintf (stderr, "Unable to read FPGA image %s\n", path) ;
+  return TRUE ;
+}
+
+static void pixi_images_index (void)
+{
+  int i ;
+
+  memset (pixiImageDemo, 0, sizeof (pixiImageDemo)) ;
+  for (i = pixiImageCount - 1 ; i >= 0 ; i--)
+    if ((pixiImages [i].demo >= 0) && (pixiImages [i].demo < 256))
+      pixiImageDemo [pixiImages [i].demo] = &pixiImages [i] ;
+}
+
+// Write the manifest. The store belongs to the user, so this is done with the
+// real uid and gid: a setuid gpio writes nothing there the user couldn't.
+void pixi_images_save (void)
+{
+  char path [PATH_MAX] ;
+  char temp [PATH_MAX + 8] ;
+  uid_t euid = geteuid () ;
+  gid_t egid = getegid () ;
+  FILE *fp = NULL ;
+  int fd ;
+  int i ;
+
+  if ((setegid (getgid ()) < 0) || (seteuid (getuid ()) < 0))
+  {
+    setegid (egid) ;
+    return ;
+  }
+
+  snprintf (path, sizeof (path), "%s/%s", PIXI_IMAGE_DIR, PIXI_IMAGE_MANIFEST) ;
+  snprintf (temp, sizeof (temp), "%s.XXXXXX", path) ;
+  if ((fd = mkstemp (temp)) >= 0)
+  {
+    if ((fchmod (fd, 0644) < 0) || ((fp = fdopen (fd, "w")) == NULL))
+    {
+      close (fd) ;
+      unlink (temp) ;
+    }
+  }
+
+  // No fp: read-only store, the manifest is rebuilt in memory each time
+  if (fp != NULL)
+  {
+    fprintf (fp, "# name file demo size mtime checksum build\n") ;
+    for (i = 0 ; i < pixiImageCount ; i++)
+      fprintf (fp, "%s %s %d %lld %lld %08x %012llx\n", pixiImages [i].name, pixiImages [i].file, pixiImages [i].demo,
+        pixiImages [i].size, pixiImages [i].mtime, pixiImages [i].checksum, pixiImages [i].build) ;
+
+    if ((fclose (fp) != 0) || (rename (temp, path) < 0))
+      unlink (temp) ;
+  }
+
+  if ((seteuid (euid) < 0) || (setegid (egid) < 0))
+  {
+    fprintf (stderr, "Unable to restore privileges: %s\n", strerror (errno)) ;
+    exit (1) ;
+  }
+}
+
+// Rebuild the manifest from the bitstreams in the image store
+void pixi_images_scan (void)
+{
+  pixi_image previous [PIXI_IMAGE_MAX] ;
+  int previousCount = (pixiImageCount > 0) ? pixiImageCount : 0 ;
+  struct dirent *entry ;
+  pixi_image *image ;
+  size_t length ;
+  size_t suffix ;
+  unsigned s ;
+  DIR *dir ;
+  int i, j ;
+
+  memcpy (previous, pixiImages, sizeof (previous)) ;
+  pixiImageCount = 0 ;
+
+  // Uncompressed images take precedence over compressed copies
+  for (s = 0 ; s < sizeof (pixiImageSuffix) / sizeof (pixiImageSuffix [0]) ; s++)
+  {
+    if ((dir = opendir (PIXI_IMAGE_DIR)) == NULL)
+      break ;
+    while (((entry = readdir (dir)) != NULL) && (pixiImageCount < PIXI_IMAGE_MAX))
+    {
+      length = strlen (entry->d_name) ;
+      suffix = strlen (pixiImageSuffix [s]) ;
+      if ((length <= suffix) || (strcmp (entry->d_name + length - suffix, pixiImageSuffix [s]) != 0) ||
+          (length - suffix >= sizeof (image->name)) || (length >= sizeof (image->file)) ||
+          !pixi_image_name_valid (entry->d_name))
+        continue ;
+
+      image = &pixiImages [pixiImageCount] ;
+      memset (image, 0, sizeof (*image)) ;
+      memcpy (image->name, entry->d_name, length - suffix) ;
+      strcpy (image->file, entry->d_name) ;
+      for (i = 0 ; (i < pixiImageCount) && (strcmp (pixiImages [i].name, image->name) != 0) ; i++)
+        ;
+      if (i < pixiImageCount)
+        continue ;
+
+      // pixi_demo_001 .. pixi_demo_256 are demos 0 .. 255
+      image->demo = ((sscanf (image->name, "pixi_demo_%d", &i) == 1) && (i >= 1) && (i <= 256)) ? i - 1 : -1 ;
+
+      // Keep what we knew about an unchanged file
+      for (j = 0 ; j < previousCount ; j++)
+        if (strcmp (previous [j].file, image->file) == 0)
+          *image = previous [j] ;
+
+      pixi_image_refresh (image) ;
+      pixiImageCount++ ;
+    }
+    closedir (dir) ;
+  }
+
+  pixi_images_index () ;
+  pixi_images_save () ;
+}
+
+// Read the manifest (once), creating it if there isn't one
+void pixi_images_load (void)
+{
+  char path [PATH_MAX] ;
+  char line [512] ;
+  pixi_image *image ;
+  int changed = FALSE ;
+  FILE *fp ;
+
+  if (pixiImageCount >= 0)
+    return ;
+
+  snprintf (path, sizeof (path), "%s/%s", PIXI_IMAGE_DIR, PIXI_IMAGE_MANIFEST) ;
+  if ((fp = fopen (path, "r")) == NULL)
+  {
+    pixi_images_scan () ;
+    return ;
+  }
+
+  pixiImageCount = 0 ;
+  while ((fgets (line, sizeof (line), fp) != NULL) && (pixiImageCount < PIXI_IMAGE_MAX))
+  {
+    image = &pixiImages [pixiImageCount] ;
+    if ((line [0] == '#') ||
+        (sscanf (line, "%63s %127s %d %lld %lld %x %llx", image->name, image->file, &image->demo,
+                 &image->size, &image->mtime, &image->checksum, &image->build) != 7) ||
+        !pixi_image_valid (image))
+    {
+      changed |= (line [0] != '#') ; // Drop the bad entry from the saved manifest
+      continue ;
+    }
+    changed |= pixi_image_refresh (image) ;
+    pixiImageCount++ ;
+  }
+  fclose (fp) ;
+
+  pixi_images_index () ;
+  if (changed)
+    pixi_images_save () ;
+}
+
+pixi_image *pixi_image_find (const char *name)
+{
+  int i ;
+
+  pixi_images_load () ;
+  for (i = 0 ; i < pixiImageCount ; i++)
+    if (strcmp (pixiImages [i].name, name) == 0)
+      return &pixiImages [i] ;
+  return NULL ;
+}
+
+// The image to load at boot: the next demo in the sequence if there is one,
+// else the default image, else the first demo
+pixi_image *pixi_image_select (int demo)
+{
+  pixi_image *image ;
+
+  pixi_images_load () ;
+  if ((demo >= 0) && (demo < 256) && (pixiImageDemo [demo] != NULL))
+    return pixiImageDemo [demo] ;
+  if ((image = pixi_image_find (PIXI_IMAGE_DEFAULT)) != NULL)
+    return image ;
+  return pixiImageDemo [0] ;
+}
+
+
+// FPGA build time, as read from registers 0x02, 0x01, 0x00
+static unsigned long long pixi_prog_version (void)
+{
+  pixi_spi_batch batch ;
+  int results [3] ;
+
+  pixi_spi_batch_init (&batch, 0) ;
+  pixi_spi_batch_get (&batch, 0x02) ;
+  pixi_spi_batch_get (&batch, 0x01) ;
+  pixi_spi_batch_get (&batch, 0x00) ;
+  if (pixi_spi_batch_submit (&batch, results) < 0)
+    return 0 ;
+
+  return ((unsigned long long)results [0] << 32) | ((unsigned long long)results [1] << 16) | results [2] ;
+}
+
+// An unconfigured FPGA reads back all 0s or all 1s
+static int pixi_prog_version_valid (unsigned long long version)
 {
-   int buffer[256];
-    
-   // Send x,y address
-   buffer[0] = x;
-   buffer[1] = y;
-   configurelcd("goto_xy", buffer);
-  
-   printlcd(lcdstring);
+  return (version != 0) && (version != 0xffffffffffffULL) ;
 }
 
-
 /*
- * doLCDWriteXY:
- *	gpio LCV / VFD display write ...
+ * pixi_prog_verify:
+ *	Check a freshly loaded build: the bitstream clocked out must match the
+ *	image's checksum, INIT must stay high (the FPGA pulls it low on a CRC
+ *	error), the build must answer over SPI within PIXI_PROG_VERIFY_US and
+ *	be the one last seen for this image, and the test registers must
+ *	echo (reg_test4 reads back inverted). Once the build answers, the
+ *	shadow copies of the write registers (ours and pixid's) go back to the
+ *	reset values. Returns NULL if all is well or the reason it isn't.
  *********************************************************************************
  */
 
-void doLCDWriteXY (int argc, char *argv [])
+static const char *pixi_prog_verify (const pixi_image *image, uint32_t checksum, unsigned long long *version)
 {
-   int x;
-   int y;
-   char lcdstring[128];
-    
-   if (argc < 5)
-   {
-      fprintf (stderr, "Usage: %s pixi_lcdwr <x> <y> <string1>\n", argv [0]) ;
-      exit (1) ;
-   }
+  static const int pattern [5] = { 0xa55a, 0x5aa5, 0x0ff0, 0xf00f, 0x1234 } ;
+  struct timespec start, now ;
+  pixi_spi_batch batch ;
+  int results [10] ;
+  int i ;
 
-   x = atoi (argv [2]) ;
-   y = atoi (argv [3]) ;
-   sprintf(lcdstring, argv[4]);
-   
-   lcdwritexy(lcdstring, x, y);
+  *version = 0 ;
+  if (checksum != image->checksum)
+    return "bitstream checksum mismatch" ;
 
-   printf ("Done\n") ;
+  pixi_spi_open (0) ;
+  clock_gettime (CLOCK_MONOTONIC, &start) ;
+  for (;;)
+  {
+    if (digitalRead (INIT_PIN) == LOW)
+      return "CRC error (INIT low)" ;
+    if (pixi_prog_version_valid (*version = pixi_prog_version ()))
+      break ;
+    clock_gettime (CLOCK_MONOTONIC, &now) ;
+    if ((now.tv_sec - start.tv_sec) * 1000000LL + (now.tv_nsec - start.tv_nsec) / 1000 > PIXI_PROG_VERIFY_US)
+      return "no answer over SPI" ;
+    usleep (100) ;
+  }
+
+  if ((image->build != 0) && (*version != image->build))
+    return "unexpected build time" ;
+
+  pixi_shadow_reset () ; // The new configuration starts from its reset values
+
+  pixi_spi_batch_init (&batch, 0) ;
+  for (i = 0 ; i < 5 ; i++)
+    pixi_spi_batch_set (&batch, 0x03 + i, pattern [i]) ;
+  for (i = 0 ; i < 5 ; i++)
+    pixi_spi_batch_get (&batch, 0x03 + i) ;
+  if (pixi_spi_batch_submit (&batch, results) < 0)
+    return "SPI error" ;
+
+  for (i = 0 ; i < 5 ; i++)
+    if (results [5 + i] != ((i == 1) ? (~pattern [i] & 0xffff) : pattern [i]))
+      return "test registers do not echo" ;
+
+  return NULL ;
 }
 
 
 /*
- * doPiXi_PWMSeq:
- *	Automated test & verification process ...
+ * doFpgaList:
+ *	gpio fpga_list / fpga_index - show (or rebuild) the FPGA image store
  *********************************************************************************
  */
-int pixi_pwmgo(int seq_no)
+
+static void doFpgaList (int rescan)
 {
+  int i ;
 
-   int i;
-   unsigned long buffer[] = {// FL      FR      RL      RR
-                             0x0066, 0x0066, 0x0066, 0x0066, // Forward, 10%
-                             0x0132, 0x0132, 0x0132, 0x0132, // Forward, 30%
-                             0x01FE, 0x01FE, 0x01FE, 0x01FE, // Forward, 50%
-                             0x0132, 0x0132, 0x0132, 0x0132, // Forward, 30%
-                             0x0066, 0x0066, 0x0066, 0x0066, // Forward, 10%
-                             0x8066, 0x0066, 0x8066, 0x0066, // Left turn, 10%
-                             0x8066, 0x8066, 0x8066, 0x8066, // Reverse, 10%
-                             0x8066, 0x0066, 0x8066, 0x0066, // Left turn, 10%
-                             0x0066, 0x0066, 0x0066, 0x0066, // Forward, 10%
-                             0x0066, 0x0066, 0x0066, 0x0066, // Forward, 10%
-                             0x8066, 0x0066, 0x0066, 0x0066, // Left turn, 10%
-                             0x0066, 0x0066, 0x0066, 0x0066, // Forward, 10%
-                             0x0066, 0x8066, 0x0066, 0x8066, // Right turn, 10%
-                             0x0066, 0x8066, 0x0066, 0x8066, // Right turn, 10%
-                             0x0066, 0x8066, 0x0066, 0x8066, // Right turn, 10%
-                             0x8066, 0x8066, 0x8066, 0x8066};// Reverse, 10%
+  if (rescan)
+    pixi_images_scan () ;
+  else
+    pixi_images_load () ;
 
-   if (wiringPiSPISetup (0, 8000000) < 0) { // setup for 8MHz
-      fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-      exit(1);
-   }
+  printf ("%-20s %-24s %4s %8s %8s %12s\n", "Name", "File", "Demo", "Size", "Checksum", "Build") ;
+  for (i = 0 ; i < pixiImageCount ; i++)
+  {
+    printf ("%-20s %-24s ", pixiImages [i].name, pixiImages [i].file) ;
+    if (pixiImages [i].demo >= 0)
+      printf ("%4d ", pixiImages [i].demo) ;
+    else
+      printf ("%4s ", "-") ;
+    printf ("%8lld %08x ", pixiImages [i].size, pixiImages [i].checksum) ;
+    if (pixiImages [i].build != 0)
+      printf ("%012llx\n", pixiImages [i].build) ;
+    else
+      printf ("%12s\n", "-") ;
+  }
+}
 
-   buffer[0] = 0x0000;
-   pixi_spi_write(0, 0x4f, 1, 1, buffer); // Disable PWM sequencer
-   
-   if (seq_no > 0) {
-      for (i = 0; i <= 51; i=i+4) {
-         pixi_spi_write(0, 0x40, 1, 1, &buffer[i]); // Configure lower byte
-         pixi_spi_write(0, 0x41, 1, 1, &buffer[i+1]); // Configure lower byte
-         pixi_spi_write(0, 0x42, 1, 1, &buffer[i+2]); // Configure lower byte
-         pixi_spi_write(0, 0x43, 1, 1, &buffer[i+3]); // Configure lower byte
-      }
-   }
-   
-   buffer[0] = 0x0001;
-   pixi_spi_write(0, 0x4f, 1, 1, buffer); // Enable PWM sequencer
 
-   return(0);
-}
- 
- 
-/*
- * doPiXi_PWMSeq:
- *	Automated test & verification process ...
- *********************************************************************************
- */
-int pixi_pwmprog (int argc, char *argv [])
+// Pulse PROG low to clear the FPGA ready for a new configuration
+static void pixi_prog_pulse (void)
 {
-   int speed;
-   unsigned long pwm;
-   unsigned long cmd_fl;
-   unsigned long cmd_fr;
-   unsigned long cmd_rl;
-   unsigned long cmd_rr;
-   unsigned long buffer[4];
-    
-   if (argc < 3)
-   {
-      fprintf (stderr, "Usage: %s pixi_pwmseq <cmd (f, r, l, r)> <speed>\n", argv [0]) ;
-      exit (1) ;
-   }
+  digitalWrite (PROG_PIN, LOW);
+  usleep (1000);
+  digitalWrite (PROG_PIN, HIGH);
+}
 
-   if (wiringPiSPISetup (0, 8000000) < 0) { // setup for 8MHz
-      fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-      exit(1);
-   }
+// Wait (up to 100ms) for INIT to go high once the FPGA is cleared
+static int pixi_prog_wait_init (void)
+{
+  int timeout;
 
-   speed = atoi (argv [3]) ;
-   if (speed > 100)
-      speed = 100;
-   else if (speed < 0)
-      speed = 0;
-      
-   pwm = (speed * 1023 / 100) & 0x000003ff;
+  for (timeout = 1000; (timeout > 1) && (digitalRead(INIT_PIN) != HIGH); timeout--)
+    usleep (100);
 
-   /**/ if (strcasecmp (argv [2], "f" )   == 0) { cmd_fl = 0x0000 + pwm; cmd_fr = 0x0000 + pwm; cmd_rl = 0x8000 + pwm; cmd_rr = 0x8000 + pwm; }
-   else if (strcasecmp (argv [2], "b" )   == 0) { cmd_fl = 0x8000 + pwm; cmd_fr = 0x8000 + pwm; cmd_rl = 0x0000 + pwm; cmd_rr = 0x0000 + pwm; }
-   else if (strcasecmp (argv [2], "l")    == 0) { cmd_fl = 0x8000 + pwm; cmd_fr = 0x0000 + pwm; cmd_rl = 0x0000 + pwm; cmd_rr = 0x8000 + pwm; }
-   else if (strcasecmp (argv [2], "r")    == 0) { cmd_fl = 0x0000 + pwm; cmd_fr = 0x8000 + pwm; cmd_rl = 0x8000 + pwm; cmd_rr = 0x0000 + pwm; }
-   else                                         { cmd_fl = 0x0000;       cmd_fr = 0x0000;       cmd_rl = 0x8000;       cmd_rr = 0x8000; }
-   
-   buffer[0] = cmd_fr; // FR
-   pixi_spi_write(0, 0x45, 1, 1, buffer);
-   
-   buffer[0] = cmd_rl; // RL
-   pixi_spi_write(0, 0x46, 1, 1, buffer);
-   
-   buffer[0] = cmd_rr; // RR
-   pixi_spi_write(0, 0x44, 1, 1, buffer);
+  return (digitalRead(INIT_PIN) == HIGH) ? 0 : -1;
+}
 
-   buffer[0] = cmd_fl; // FL
-   pixi_spi_write(0, 0x47, 1, 1, buffer); // Must write to 0x47 last!
+// Progress as it used to be shown, every 10%, with the loading rate so far
+static void pixi_prog_report (long done, long total, long long elapsed, void *context)
+{
+  int *next = context;
+  int percent;
 
-   
-   return(0);
+  if (total <= 0)
+    return;
+  percent = (int)((done * 100LL) / total);
+  if (percent >= *next)
+  {
+    if (elapsed > 0)
+      printf("%3d%% complete (%.0f bytes/s)...\n", percent, done * 1e9 / elapsed);
+    else
+      printf("%3d%% complete...\n", percent);
+    *next = (percent / 10) * 10 + 10;
+  }
 }
 
 
 /*
- * doPiXi_Test:
- *	Automated test & verification process ...
- *********************************************************************************
- */
-int pixi_test(int test_no)
-{
-
-   // 1: test GPIO1(a) odd = out, even = in, "000000000000", "111111111111", walking '1'...
-   // 2: test GPIO1(a) odd = in, even = out, "000000000000", "111111111111", walking '1'...
-   
-   return(0);
-}
- 
- 
- /*
  * doPixiProg:
  *	gpio Program PiXi FPGA
+ *	Loads the named image from the image store, or the next one in the
+ *	demo sequence. With 'fast', programming is skipped when the FPGA
+ *	already holds the build that would be loaded (see pixi_image).
  *********************************************************************************
  */
-static void doPixiProg (void)
+static void doPixiProg (int fast, const char *name)
 {
-  unsigned short repeat;
-  unsigned char byte, shift_byte;
   FILE *fp;
-  long filesize;
-  long i;
-  int j;
-  char * buffer;
+  char path [PATH_MAX];
+  const char *filename;
+  pixi_image *image;
+  uint32_t checksum;
+  unsigned long long version;
+  pixi_prog_buffer buffer;
   long bytes_read;
-  long bytes_readDIV10;
   int percent_complete;
-  int byte_counter;
-  int timeout;
-  int demo_build;
+  int attempt;
+  int compressed;
+  const char *error;
+  volatile uint32_t *gpio;
+  struct timespec start, end;
+  double seconds;
   
 
   // Setup pin I/O direction
@@ -1733,159 +5263,295 @@ static void doPixiProg (void)
   pinMode (DATA_PIN, OUTPUT);
 
  
-  demo_build = spi_single_read(0, 0xf8); // Check if a demo build is currently active in the FPGA
-  
-  // ***** Set PROG low *****
-  printf("Setting PROG low...\n");
-  digitalWrite (PROG_PIN, LOW);
+  // ***** Pick the image *****
+  // A named image if given, else the next demo in the sequence (register 0xF8), else the default image
 
+  if (name != NULL)
+    image = pixi_image_find(name);
+  else
+    image = pixi_image_select(spi_single_read(0, 0xf8)); // Check if a demo build is currently active in the FPGA
 
-  // ***** Hold PROG low line for a short while *****
-  usleep (1000);
+  if (image == NULL) {
+    printf("FPGA configuration file not found! No %s in %s\n", (name != NULL) ? name : PIXI_IMAGE_DEFAULT, PIXI_IMAGE_DIR);
+    exit(1);
+  }
+
+  pixi_image_path(image, path);
+  filename = path;
+  printf("Open file for reading...\n");
+  if ((fp = fopen(filename, "rb")) == NULL) {
+    printf("Unable to open %s: %s\n", filename, strerror(errno));
+    exit(1);
+  }
 
+  if (fast)
+  {
+    version = pixi_prog_version ();
+    if (pixi_prog_version_valid (version) && (version == image->build))
+    {
+      printf("FPGA already holds %s (build %012llx), skipping\n", image->name, version);
+      fclose(fp);
+      return;
+    }
+  }
 
-  // ***** Return PROG high *****
-  printf("Setting PROG high...\n");
-  digitalWrite (PROG_PIN, HIGH);
+  printf("Loading %s...\n", filename);
 
+  if ((gpio = pixi_prog_map (getenv ("PIXI_PROG_FAKE") != NULL)) == NULL)
+    exit(1);
 
-  // ***** Wait for init to go high... *****
-  printf("Wait for INIT...\n");
-  timeout = 100;
-  while ((timeout > 1) && (!(digitalRead(INIT_PIN) == HIGH)))
+  // ***** Read file in preparation for programming *****
+  // Compressed images are decompressed while loading instead
+  compressed = (pixi_prog_decompressor (filename) != NULL);
+  if (!compressed)
   {
-    usleep (1000);
-    timeout--;
+    if (pixi_prog_buffer_load (&buffer, fp, FALSE) < 0)
+    {
+      printf("Error reading file!\n");
+      exit(1);
+    }
+    printf("%s %ld bytes\n", buffer.mapped ? "Mapped" : "Read", buffer.length);
   }
-   
-  if (digitalRead(INIT_PIN) == HIGH) 
-    printf("Ready to program PiXi...\n");
-  else
+
+  for (attempt = 1; ; attempt++)
   {
-    printf("INIT did not go high!\n");
-    exit(1);
+    // ***** Pulse PROG low *****
+    printf("Setting PROG low...\n");
+    pixi_prog_pulse ();
+
+
+    // ***** Wait for init to go high... *****
+    printf("Wait for INIT...\n");
+    if (pixi_prog_wait_init () == 0)
+      printf("Ready to program PiXi...\n");
+    else
+    {
+      printf("INIT did not go high!\n");
+      exit(1);
+    }
+
+
+    // ***** Download to FPGA *****
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    percent_complete = 0;
+    if (compressed)
+    {
+      // Decompress & download at the same time
+      printf("Decompressing while loading...\n");
+      if ((bytes_read = pixi_prog_stream (gpio, filename, &checksum, pixi_prog_report, &percent_complete)) < 0)
+      {
+        printf("Error reading file!\n");
+        exit(1);
+      }
+    }
+    else
+    {
+      printf("%3d%% complete...\n", percent_complete);
+      percent_complete = 10;
+      bytes_read = buffer.length;
+      pixi_prog_buffer_clock (gpio, buffer.data, bytes_read, &checksum, pixi_prog_report, &percent_complete);
+    }
+
+    // Need to contine clocking CCLK for a little while after download...
+    pixi_prog_clocks (gpio, 8);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Loaded %ld bytes in %.3fs (%.0f bytes/s), checksum %08x\n", bytes_read, seconds, bytes_read / seconds, checksum);
+
+    // ***** Check the new build *****
+    if ((error = pixi_prog_verify (image, checksum, &version)) == NULL)
+      break;
+
+    printf("Verify failed: %s\n", error);
+    if (attempt == PIXI_PROG_ATTEMPTS)
+    {
+      printf("Giving up after %d attempts!\n", attempt);
+      exit(1);
+    }
+    printf("Retrying (%d of %d)...\n", attempt + 1, PIXI_PROG_ATTEMPTS);
   }
-  
-  
-  // ***** Read file in preparation for programming *****
-  // Check for main file first then look for demo files
-  // If main file doesn't exist check for a demo configuration in the FPGA and load the next available demo build in the sequence...
-  // If the FPGA has already been configured and the default FPGAFILE doesn't exist then it reads register 0xff to identify the next FPGA in the demo sequence...
-  
-  printf("Open file for reading...\n");
-  if (((fp = fopen(FPGADEMO_001, "rb"))      != NULL) && (demo_build == 0)) {
-    printf("Loading %s...\n", FPGADEMO_001); }
-  else if (((fp = fopen(FPGADEMO_002, "rb")) != NULL) && (demo_build == 1)) {
-    printf("Loading %s...\n", FPGADEMO_002); }
-  else if (((fp = fopen(FPGADEMO_003, "rb")) != NULL) && (demo_build == 2)) {
-    printf("Loading %s...\n", FPGADEMO_003); }
-  else if (((fp = fopen(FPGADEMO_004, "rb")) != NULL) && (demo_build == 3)) {
-    printf("Loading %s...\n", FPGADEMO_004); }
-  else if (((fp = fopen(FPGADEMO_005, "rb")) != NULL) && (demo_build == 4)) {
-    printf("Loading %s...\n", FPGADEMO_005); }
-  else if (((fp = fopen(FPGADEMO_006, "rb")) != NULL) && (demo_build == 5)) {
-    printf("Loading %s...\n", FPGADEMO_006); }
-  else if ((fp = fopen(FPGAFILE, "rb"))      != NULL) { // Default to loading FPGAFILE if there are no demo builds...
-    printf("Loading %s...\n", FPGAFILE); }
-  else if (((fp = fopen(FPGADEMO_001, "rb")) != NULL)) { // Loop demo back to demo_001 if default FPGAFILE is not present
-    printf("Loading %s...\n", FPGADEMO_001); }
-  else {
-    printf("FPGA configuration file not found! Missing %s\n", FPGAFILE);
-    exit(1);
+
+  if (!compressed)
+    pixi_prog_buffer_free (&buffer);
+  pixi_prog_unmap (gpio);
+  pixi_lcd_forget ();
+
+  printf ("FPGA Version: %012llx\n", version);
+  if (pixi_prog_version_valid (version) && (version != image->build))
+  {
+    image->build = version;
+    pixi_images_save ();
   }
+  fclose (fp);
+  printf ("Done!\n");
+}
+
 
-  fseek(fp, 0, SEEK_END);
-  filesize = ftell(fp);
-  printf("File size: %ld\n", filesize);
-  rewind(fp);
+/*
+ * doFpgaLoad:
+ *	gpio fpga_load <name> [fast] - program the FPGA with an image from the store
+ *********************************************************************************
+ */
 
-  printf("Allocate memory...\n");
-  buffer = (char*) malloc (sizeof(char)*filesize);
-  if (buffer == NULL)
+static void doFpgaLoad (int argc, char *argv [])
+{
+  if ((argc < 3) || (argc > 4))
   {
-    printf("Memmory allocation error!\n");
-    exit(2);
+    fprintf (stderr, "Usage: %s fpga_load name [fast]\n", argv [0]) ;
+    exit (1) ;
   }
+  doPixiProg ((argc == 4) && (strcasecmp (argv [3], "fast") == 0), argv [2]) ;
+}
 
-  byte_counter = 0;
-  percent_complete = 0;
-  byte = (unsigned char) 0;
-  
-  usleep(1000000);
 
-  bytes_read = fread(buffer, 1, filesize, fp);
-  bytes_readDIV10 = bytes_read / 10;
-   
-  printf("Bytes read from file: %ld\n", bytes_read);
-   
+/*
+ * doFpgaBench:
+ *	gpio fpga_bench <name> [count] [real]
+ *	Time each phase of loading an image: the PROG pulse, the wait for
+ *	INIT, reading or mapping the file, clocking it out, and the wait for
+ *	the new build to answer. By default the GPIO is simulated: CCLK and
+ *	DATA go to a block of memory, PROG is not driven and INIT reads as
+ *	ready at once, so this runs anywhere (and only measures the software).
+ *	With 'real' the FPGA is programmed for each run.
+ *	Decompression overlaps clocking, so for a compressed image it is
+ *	counted in with the clocking.
+ *********************************************************************************
+ */
+
+enum { PIXI_BENCH_PULSE, PIXI_BENCH_INIT, PIXI_BENCH_FILE, PIXI_BENCH_CLOCK, PIXI_BENCH_POST, PIXI_BENCH_PHASES } ;
+
+static void doFpgaBench (int argc, char *argv [])
+{
+  static const char *phases [PIXI_BENCH_PHASES] = { "PROG pulse", "INIT wait", "File I/O", "Clocking", "Post-wait" } ;
+  long long total [PIXI_BENCH_PHASES] ;
+  long long least [PIXI_BENCH_PHASES] ;
+  long long sample [PIXI_BENCH_PHASES] ;
+  volatile uint32_t *gpio ;
+  pixi_prog_buffer buffer ;
+  struct timespec start ;
+  char path [PATH_MAX] ;
+  pixi_image *image ;
+  unsigned long long version ;
+  uint32_t checksum ;
+  const char *error ;
+  long bytes = 0 ;
+  int count = 10 ;
+  int simulate = TRUE ;
+  int compressed ;
+  int run, p ;
+  FILE *fp ;
+
+  if ((argc < 3) || (argc > 5))
+  {
+    fprintf (stderr, "Usage: %s fpga_bench name [count] [real]\n", argv [0]) ;
+    exit (1) ;
+  }
+  for (p = 3 ; p < argc ; p++)
+    if (strcasecmp (argv [p], "real") == 0)
+      simulate = FALSE ;
+    else if ((count = atoi (argv [p])) < 1)
+      count = 1 ;
+
+  if ((image = pixi_image_find (argv [2])) == NULL)
+  {
+    fprintf (stderr, "%s: no %s in %s\n", argv [0], argv [2], PIXI_IMAGE_DIR) ;
+    exit (1) ;
+  }
+  pixi_image_path (image, path) ;
+  compressed = (pixi_prog_decompressor (path) != NULL) ;
 
-  // ***** Download to FPGA *****
+  if (!simulate)
+  {
+    pinMode (PROG_PIN, OUTPUT) ;
+    pinMode (INIT_PIN, INPUT) ;
+    pinMode (CCLK_PIN, OUTPUT) ;
+    pinMode (DATA_PIN, OUTPUT) ;
+  }
+  if ((gpio = pixi_prog_map (simulate)) == NULL)
+    exit (1) ;
+
+  memset (total, 0, sizeof (total)) ;
+  for (p = 0 ; p < PIXI_BENCH_PHASES ; p++)
+    least [p] = LLONG_MAX ;
 
-  if (bytes_read == filesize) 
+  for (run = 0 ; run < count ; run++)
   {
-    printf("%3d%% complete...\n", percent_complete);      
-    for (i = 0; i < bytes_read; i++)
+    memset (sample, 0, sizeof (sample)) ;
+
+    clock_gettime (CLOCK_MONOTONIC, &start) ;
+    if (simulate)
+      usleep (1000) ;
+    else
+      pixi_prog_pulse () ;
+    sample [PIXI_BENCH_PULSE] = pixi_prog_elapsed (&start) ;
+
+    clock_gettime (CLOCK_MONOTONIC, &start) ;
+    if (!simulate && (pixi_prog_wait_init () < 0))
     {
-      byte = *(buffer+i);
-      shift_byte = byte;
-      repeat = 1;
+      fprintf (stderr, "%s: INIT did not go high\n", argv [0]) ;
+      exit (1) ;
+    }
+    sample [PIXI_BENCH_INIT] = pixi_prog_elapsed (&start) ;
 
-      while (repeat--)
+    if (compressed)
+    {
+      clock_gettime (CLOCK_MONOTONIC, &start) ;
+      bytes = pixi_prog_stream (gpio, path, &checksum, NULL, NULL) ;
+      sample [PIXI_BENCH_CLOCK] = pixi_prog_elapsed (&start) ;
+    }
+    else
+    {
+      // The page cache is left alone: runs after the first read from memory
+      clock_gettime (CLOCK_MONOTONIC, &start) ;
+      if ((fp = fopen (path, "rb")) == NULL)
+        bytes = -1 ;
+      else
       {
-        for (j = 0; j < 8; j++)       //data goes out serially
-        {
-          // Set CCLK = '0'
-          digitalWrite (CCLK_PIN, LOW);
-
-          if (!(shift_byte & 0x80))
-            digitalWrite (DATA_PIN, LOW);
-          else
-            digitalWrite (DATA_PIN, HIGH);
-           
-          // Set CCLK = '1', PROG = '1', DIN = data
-          digitalWrite (CCLK_PIN, HIGH);
-               
-          shift_byte = shift_byte << 1;
-        }
-        byte_counter++;
+        bytes = (pixi_prog_buffer_load (&buffer, fp, TRUE) < 0) ? -1 : buffer.length ;
+        fclose (fp) ;
       }
+      sample [PIXI_BENCH_FILE] = pixi_prog_elapsed (&start) ;
 
-      if (byte_counter >= bytes_readDIV10)
+      if (bytes >= 0)
       {
-        percent_complete += 10;
-        printf("%3d%% complete...\n", percent_complete);
-        //printf(".");
-        byte_counter -= bytes_readDIV10;   
+        clock_gettime (CLOCK_MONOTONIC, &start) ;
+        pixi_prog_buffer_clock (gpio, buffer.data, buffer.length, &checksum, NULL, NULL) ;
+        sample [PIXI_BENCH_CLOCK] = pixi_prog_elapsed (&start) ;
+        pixi_prog_buffer_free (&buffer) ;
       }
     }
-
-    printf("\n");
-    // Need to contine clocking CCLK for a little while after download...
-    for (j = 0; j < 8; j++)
+    if (bytes < 0)
     {
-      // Set CCLK low
-      digitalWrite (CCLK_PIN, LOW);
-
-      // Set CCLK high
-      digitalWrite (CCLK_PIN, HIGH);
+      fprintf (stderr, "%s: unable to read %s\n", argv [0], path) ;
+      exit (1) ;
     }
 
-    usleep(100000);
-    
-    if (wiringPiSPISetup (0, 8000000) < 0) { // setup for 8MHz
-      fprintf (stderr, "SPI Setup failed: %s\n", strerror (errno));
-    }
+    clock_gettime (CLOCK_MONOTONIC, &start) ;
+    pixi_prog_clocks (gpio, 8) ;
+    if (!simulate && ((error = pixi_prog_verify (image, checksum, &version)) != NULL))
+      fprintf (stderr, "%s: run %d: %s\n", argv [0], run + 1, error) ;
+    sample [PIXI_BENCH_POST] = pixi_prog_elapsed (&start) ;
 
-    printf ("FPGA Version: %04x%04x%04x\n", pixi_spi_get(0, 0x02, 0x00), pixi_spi_get(0, 0x01, 0x00), pixi_spi_get(0, 0x00, 0x00));
-    printf ("Freeing up memory...\n");
-    free (buffer); // De-allocate memory...
-    printf ("Done!\n");
-  }
-  else
-  {
-    printf("Error reading file!\n");
-    exit(1);
+    for (p = 0 ; p < PIXI_BENCH_PHASES ; p++)
+    {
+      total [p] += sample [p] ;
+      if (sample [p] < least [p])
+        least [p] = sample [p] ;
+    }
   }
+  pixi_prog_unmap (gpio) ;
+
+  printf ("%s: %ld bytes, %d run%s, %s GPIO, checksum %08x\n", image->file, bytes, count, (count == 1) ? "" : "s",
+    simulate ? "simulated" : "real", checksum) ;
+  printf ("%-12s %12s %12s\n", "Phase", "Mean (us)", "Min (us)") ;
+  for (p = 0 ; p < PIXI_BENCH_PHASES ; p++)
+    printf ("%-12s %12.1f %12.1f\n", phases [p], total [p] / 1e3 / count, least [p] / 1e3) ;
+
+  printf ("Clocking: %.2f Mbit/s, end to end: %.2f Mbit/s\n",
+    (bytes * 8.0 * count) / (total [PIXI_BENCH_CLOCK] / 1e3),
+    (bytes * 8.0 * count) / ((total [PIXI_BENCH_PULSE] + total [PIXI_BENCH_INIT] + total [PIXI_BENCH_FILE] +
+                              total [PIXI_BENCH_CLOCK] + total [PIXI_BENCH_POST]) / 1e3)) ;
 }
 
 
@@ -1944,6 +5610,22 @@ int main (int argc, char *argv [])
     return 0 ;
   }
 
+// Check for -d arguments (more diagnostics for each one)
+
+  while ((argc > 1) && (strcasecmp (argv [1], "-d") == 0))
+  {
+    ++pixiVerbose ;
+    for (i = 2 ; i < argc ; ++i)
+      argv [i - 1] = argv [i] ;
+    --argc ;
+  }
+
+  if (argc == 1)
+  {
+    fprintf (stderr, "%s\n", usage) ;
+    return 1 ;
+  }
+
   if (geteuid () != 0)
   {
     fprintf (stderr, "%s: Must be root to run. Program should be suid root. This is an error.\n", argv [0]) ;
@@ -2011,6 +5693,11 @@ int main (int argc, char *argv [])
     wpMode = WPI_MODE_PINS ;
   }
 
+// Optional SPI instrumentation, dumped at exit
+
+  if (getenv ("PIXI_SPI_STATS") != NULL)
+    pixi_spi_stats_enable (TRUE) ;
+
 // Check for PWM or Pad Drive operations
 
   if (wpMode != WPI_MODE_PIFACE)
@@ -2029,19 +5716,34 @@ int main (int argc, char *argv [])
   else if (strcasecmp (argv [1], "write")           == 0) doWrite         (argc, argv) ;
   else if (strcasecmp (argv [1], "pwm"  )           == 0) doPwm           (argc, argv) ;
   else if (strcasecmp (argv [1], "mode" )           == 0) doMode          (argc, argv) ;
-  else if (strcasecmp (argv [1], "pixi_prog" )      == 0) doPixiProg      () ;
+  else if (strcasecmp (argv [1], "pixi_prog" )      == 0) doPixiProg      ((argc > 2) && (strcasecmp (argv [2], "fast") == 0), NULL) ;
+  else if (strcasecmp (argv [1], "fpga_load" )      == 0) doFpgaLoad      (argc, argv) ;
+  else if (strcasecmp (argv [1], "fpga_list" )      == 0) doFpgaList      (FALSE) ;
+  else if (strcasecmp (argv [1], "fpga_index" )     == 0) doFpgaList      (TRUE) ;
+  else if (strcasecmp (argv [1], "fpga_bench" )     == 0) doFpgaBench     (argc, argv) ;
   else if (strcasecmp (argv [1], "pixi_gpiocheck" ) == 0) doPixiGPIOCheck () ;
   else if (strcasecmp (argv [1], "spi_set" )        == 0) doSPIset        (argc, argv) ;
   else if (strcasecmp (argv [1], "spi_get" )        == 0) doSPIget        (argc, argv) ;
+  else if (strcasecmp (argv [1], "spi_batch" )      == 0) doSPIbatch      (argc, argv) ;
+  else if (strcasecmp (argv [1], "spi_setmask" )    == 0) doSPIsetmask    (argc, argv) ;
+  else if (strcasecmp (argv [1], "spi_stress" )     == 0) doSPIstress     (argc, argv) ;
+  else if (strcasecmp (argv [1], "spi_selftest" )   == 0) doSPIselftest   (argc, argv) ;
+  else if (strcasecmp (argv [1], "spi_stats" )      == 0) doSPIstats      (argc, argv) ;
+  else if (strcasecmp (argv [1], "spi_sample" )     == 0) doSPIsample     (argc, argv) ;
+  else if (strcasecmp (argv [1], "spi_mirror" )     == 0) doSPImirror     (argc, argv) ;
   else if (strcasecmp (argv [1], "pixi_lcdinit" )   == 0) configurelcd    ("init", buffer);
   else if (strcasecmp (argv [1], "pixi_lcdinit1" )  == 0) configurelcd    ("init1", buffer);
   else if (strcasecmp (argv [1], "pixi_lcdxyw" )    == 0) doLCDWriteXY    (argc, argv) ;
+  else if (strcasecmp (argv [1], "pixi_lcdredraw" ) == 0) doLCDRedraw     () ;
   else if (strcasecmp (argv [1], "pixi_lcdcfgb0" )  == 0) {buffer[0] = 0; configurelcd ("brightness", buffer);}
   else if (strcasecmp (argv [1], "pixi_lcdcfgb1" )  == 0) {buffer[0] = 1; configurelcd ("brightness", buffer);}
   else if (strcasecmp (argv [1], "pixi_lcdcfgb3" )  == 0) {buffer[0] = 3; configurelcd ("brightness", buffer);}
   else if (strcasecmp (argv [1], "pixi_pwmseq1" )   == 0) pixi_pwmgo      (1);
   else if (strcasecmp (argv [1], "pixi_pwmstart" )  == 0) pixi_pwmgo      (0);
   else if (strcasecmp (argv [1], "pixi_pwmprog" )   == 0) pixi_pwmprog    (argc, argv) ;
+  else if (strcasecmp (argv [1], "pixi_pwmstream" ) == 0) doPwmStream     (argc, argv) ;
+  else if (strcasecmp (argv [1], "pwm_freq" )       == 0) doPwmFreq       (argc, argv) ;
+  else if (strcasecmp (argv [1], "pwm_skew" )       == 0) doPwmSkew       (argc, argv) ;
   else
   {
     fprintf (stderr, "%s: Unknown command: %s.\n", argv [0], argv [1]) ;
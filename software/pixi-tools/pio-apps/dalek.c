@@ -22,12 +22,16 @@
 #include <libpixi/util/string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include "Command.h"
+#include "inputwait.h"
+#include "motion.h"
+#include "servo.h"
 #include "log.h"
 
 static int pixi_dalek_stop(int duration);
@@ -89,7 +93,7 @@ static const char keyLeft[]  = {0x1b, 0x5b, 0x44, 0};
 
 
 
-//	Should replace calls to pixi_spi_set/pixi_spi_get with
+//	Should replace calls to pixi_spi_set with
 //	pixiOpen, gpioSetPinMode, gpioWritePin, pwmWritePin, etc.
 //	but meanwhile...
 
@@ -98,12 +102,6 @@ static int pixi_spi_set (int channel, int address, int data) {
 	return registerWrite (address, data);
 }
 
-static int pixi_spi_get (int channel, int address, int data) {
-	LIBPIXI_UNUSED(channel);
-	LIBPIXI_UNUSED(data);
-	return registerRead (address);
-}
-
 /*
  * dalek_stop:
  *********************************************************************************
@@ -192,38 +190,59 @@ int pixi_dalek_r(int speed, int duration)
    return(0);
 }
 
+// Eye-piece servos: pulse widths (us) at -90, 0 and +90 degrees. Alt is mounted the other way round.
+static const ServoPulses lookAltPulses = {.minUs = 2988, .centreUs = 1992, .maxUs =  996, .range = 90};
+static const ServoPulses lookAzPulses  = {.minUs =  498, .centreUs = 1494, .maxUs = 2490, .range = 90};
+static ServoCalibration lookAlt;
+static ServoCalibration lookAz;
+
+static void dalekLookCalibrate(void)
+{
+   static bool calibrated = false;
+
+   if (!calibrated)
+   {
+      servoCalibrate(&lookAlt, &lookAltPulses);
+      servoCalibrate(&lookAz, &lookAzPulses);
+      calibrated = true;
+   }
+}
+
+// Register units per second for inc degrees per servo frame. Uses the shallower side of the
+// servo's calibration, so neither side goes faster than inc degrees per frame.
+static double dalekLookSpeed(const ServoCalibration *servo, int inc)
+{
+   int32 slope = abs(servo->slopeQ8[0]) < abs(servo->slopeQ8[1]) ? abs(servo->slopeQ8[0]) : abs(servo->slopeQ8[1]);
+
+   return inc * 50.0 * slope / 256.0;
+}
+
 /*
  * dalek_look:
+ *	Alt (0x42) and az (0x43) move together, along an S-curve, at up to
+ *	inc degrees per servo frame (20ms). Angles go through the servos'
+ *	calibration tables.
  *********************************************************************************
  */
 int pixi_dalek_look(int start_alt, int start_az, int alt, int az, int inc)
 {
-   int current_alt;
-   int current_az;
-
-   if (start_az == 0)
-      start_az = (((pixi_spi_get(0, 0x43, 0) & 1023)-76.5)/51.0)*90.0;
-   if (az < start_az) {
-      for (current_az = start_az; current_az > az; current_az = current_az - inc) {
-         pixi_spi_set(0, 0x43, (int)(((current_az/90.0)*51.0)+76.5));
-         usleep (20000); } }
-   if (az > start_az) {
-      for (current_az = start_az; current_az < az; current_az = current_az + inc) {
-         pixi_spi_set(0, 0x43, (int)(((current_az/90.0)*51.0)+76.5));
-         usleep (20000); } }
-
-   if (start_alt == 0)
-      start_alt = ((102 - (pixi_spi_get(0, 0x42, 0) & 1023))/51.0)*90;
-   if (alt < start_alt) {
-      for (current_alt = start_alt; current_alt > alt; current_alt = current_alt - inc) {
-	     pixi_spi_set(0, 0x42, (102-(int)((current_alt/90.0)*51)));
-         usleep (20000); } }
-   else {
-      for (current_alt = start_alt; current_alt < alt; current_alt = current_alt + inc) {
-	     pixi_spi_set(0, 0x42, (102-(int)((current_alt/90.0)*51)));
-         usleep (20000); } }
-
-   return(0);
+   dalekLookCalibrate();
+
+   double altSpeed = dalekLookSpeed(&lookAlt, inc);
+   double azSpeed  = dalekLookSpeed(&lookAz, inc);
+   MotionAxis axes[2] = {
+      {.address = 0x42, .target = servoDuty(&lookAlt, alt), .speed = altSpeed, .accel = altSpeed * 4},
+      {.address = 0x43, .target = servoDuty(&lookAz, az), .speed = azSpeed, .accel = azSpeed * 4}};
+   MotionMove *move;
+
+   if (start_az != 0)
+      pixi_spi_set(0, 0x43, servoDuty(&lookAz, start_az));
+   if (start_alt != 0)
+      pixi_spi_set(0, 0x42, servoDuty(&lookAlt, start_alt));
+
+   if ((move = motionStart(axes, 2, MotionSCurve)) == NULL)
+      return(-errno);
+   return(motionWait(move, -1));
 }
 
 /*
@@ -280,8 +299,7 @@ int pixi_dalek_demo(int demo)
 
    printf("Press the button to start...\n");
    // Wait for button to be pressed
-   while ((pixi_spi_get(0, 0x20, 0) & 0x0001) == 1) { // GPIO1(0)
-   }
+   inputWait (0x20, 0x0001, 0x0000, -1); // GPIO1(0), active low
 
    printf("Starting Demo...\n");
 
@@ -0,0 +1,172 @@
+/*
+    pixi-tools: a set of software to interface with the Raspberry Pi
+    and PiXi-200 hardware
+    Copyright (C) 2013 Simon Cantrill
+
+    pixi-tools is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <libpixi/pixi/simple.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "inputwait.h"
+#include "log.h"
+
+// Poll interval bounds (microseconds). The interval doubles while the input
+// is idle, and drops back to the minimum as soon as a watched bit changes.
+static const int InputWaitMinUs    = 500;
+static const int InputWaitMaxUs    = 20000;
+static const int InputWaitMaxIrqUs = 200000; // Edge interrupts wake us, so poll less
+
+static int  irqGpio      = -1;
+static int  irqFd        = -1;
+static bool irqEnvChecked = false;
+
+static int writeSysfs (const char* path, const char* value)
+{
+	int fd = open (path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	int result = write (fd, value, strlen (value));
+	result = (result < 0) ? -errno : 0;
+	close (fd);
+	return result;
+}
+
+int inputWaitSetIrq (int gpio)
+{
+	char path[64];
+	char value[16];
+
+	if (irqFd >= 0)
+		close (irqFd);
+	irqFd   = -1;
+	irqGpio = gpio;
+	irqEnvChecked = true;
+	if (gpio < 0)
+		return 0;
+
+	snprintf (path, sizeof (path), "/sys/class/gpio/gpio%d/value", gpio);
+	if (access (path, F_OK) != 0)
+	{
+		snprintf (value, sizeof (value), "%d", gpio);
+		writeSysfs ("/sys/class/gpio/export", value);
+	}
+	snprintf (path, sizeof (path), "/sys/class/gpio/gpio%d/direction", gpio);
+	writeSysfs (path, "in");
+	snprintf (path, sizeof (path), "/sys/class/gpio/gpio%d/edge", gpio);
+	int result = writeSysfs (path, "both");
+	if (result < 0)
+	{
+		PIO_ERROR (-result, "Failed to set edge on GPIO %d, using polling only", gpio);
+		return result;
+	}
+
+	snprintf (path, sizeof (path), "/sys/class/gpio/gpio%d/value", gpio);
+	irqFd = open (path, O_RDONLY);
+	if (irqFd < 0)
+	{
+		result = -errno;
+		PIO_ERROR (-result, "Failed to open %s, using polling only", path);
+		return result;
+	}
+	read (irqFd, value, sizeof (value)); // Clear any pending edge
+	PIO_LOG_DEBUG ("Input waits will use GPIO %d edge interrupts", gpio);
+	return 0;
+}
+
+static int64 nowMs (void)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (int64) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Sleep for up to delayUs, returning early on an edge of the interrupt pin
+static void sleepOrEdge (int delayUs)
+{
+	if (irqFd < 0)
+	{
+		usleep (delayUs);
+		return;
+	}
+	struct pollfd fds = {.fd = irqFd, .events = POLLPRI | POLLERR};
+	if (poll (&fds, 1, (delayUs + 999) / 1000) > 0)
+	{
+		char value[4];
+		lseek (irqFd, 0, SEEK_SET);
+		read (irqFd, value, sizeof (value));
+	}
+}
+
+static int waitFor (uint address, uint mask, uint value, bool change, int timeoutMs)
+{
+	if (!irqEnvChecked)
+	{
+		const char* env = getenv ("PIXI_INPUT_IRQ");
+		irqEnvChecked = true;
+		if (env)
+			inputWaitSetIrq (atoi (env));
+	}
+
+	int64 deadline = (timeoutMs < 0) ? -1 : nowMs() + timeoutMs;
+	int maxUs   = (irqFd < 0) ? InputWaitMaxUs : InputWaitMaxIrqUs;
+	int delayUs = InputWaitMinUs;
+	int initial = registerRead (address);
+	int last    = initial;
+	if (initial < 0)
+		return initial;
+
+	for (;;)
+	{
+		int current = registerRead (address);
+		if (current < 0)
+			return current;
+		if (change ? ((current ^ initial) & mask) != 0 : (current & mask) == value)
+			return current;
+
+		if (((current ^ last) & mask) != 0)
+			delayUs = InputWaitMinUs;
+		else if (delayUs < maxUs)
+			delayUs = (delayUs * 2 < maxUs) ? delayUs * 2 : maxUs;
+		last = current;
+
+		if (deadline >= 0)
+		{
+			int64 remaining = deadline - nowMs();
+			if (remaining <= 0)
+				return -ETIMEDOUT;
+			if (remaining * 1000 < delayUs)
+				delayUs = remaining * 1000;
+		}
+		sleepOrEdge (delayUs);
+	}
+}
+
+int inputWait (uint address, uint mask, uint value, int timeoutMs)
+{
+	return waitFor (address, mask, value & mask, false, timeoutMs);
+}
+
+int inputWaitChange (uint address, uint mask, int timeoutMs)
+{
+	return waitFor (address, mask, 0, true, timeoutMs);
+}
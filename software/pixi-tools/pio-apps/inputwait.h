@@ -0,0 +1,50 @@
+/*
+    pixi-tools: a set of software to interface with the Raspberry Pi
+    and PiXi-200 hardware
+    Copyright (C) 2013 Simon Cantrill
+
+    pixi-tools is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef pio_inputwait_h__included
+#define pio_inputwait_h__included
+
+#include <libpixi/common.h>
+
+///@defgroup PioInputWait Waiting for PiXi inputs
+///	Wait for a PiXi register (e.g. GPIO1 inputs at 0x20, switches at 0x32)
+///	to reach a condition without spinning on the SPI bus. The register is
+///	polled with an exponential backoff that resets whenever a watched bit
+///	changes. If a Pi GPIO pin is wired to an FPGA interrupt output, set it
+///	with @ref inputWaitSetIrq (or the PIXI_INPUT_IRQ environment variable)
+///	and the wait sleeps in poll() on its sysfs edge until the pin toggles.
+///@{
+
+///	Wait until <tt>(register & mask) == value</tt>.
+///	@param timeoutMs	maximum wait in milliseconds, or -1 to wait forever
+///	@return the register value on success, -ETIMEDOUT on timeout, or -errno on error
+int inputWait (uint address, uint mask, uint value, int timeoutMs);
+
+///	Wait until any of the @c mask bits of a register change from their current value.
+///	@return the new register value on success, -ETIMEDOUT on timeout, or -errno on error
+int inputWaitChange (uint address, uint mask, int timeoutMs);
+
+///	Use a Pi GPIO pin (BCM number) as an input-change interrupt, or -1 for polling only.
+///	@return 0 on success, or -errno on error
+int inputWaitSetIrq (int gpio);
+
+///@} defgroup
+
+#endif // !defined pio_inputwait_h__included
@@ -28,6 +28,7 @@
 #include <unistd.h>
 
 #include "Command.h"
+#include "inputwait.h"
 #include "log.h"
 
 static int pixi_truck_stop(int duration);
@@ -91,7 +92,7 @@ static const char keyLeft[]  = {0x1b, 0x5b, 0x44, 0};
 
 
 
-//	Should replace calls to pixi_spi_set/pixi_spi_get with
+//	Should replace calls to pixi_spi_set with
 //	pixiOpen, gpioSetPinMode, gpioWritePin, pwmWritePin, etc.
 //	but meanwhile...
 
@@ -100,12 +101,6 @@ static int pixi_spi_set (int channel, int address, int data) {
 	return registerWrite (address, data);
 }
 
-static int pixi_spi_get (int channel, int address, int data) {
-	LIBPIXI_UNUSED(channel);
-	LIBPIXI_UNUSED(data);
-	return registerRead (address);
-}
-
 /*
  * truck_stop:
  *********************************************************************************
@@ -356,8 +351,7 @@ int pixi_truck_demo(int demo)
 
    printf("Press the button to start...\n");
    // Wait for button to be pressed
-   while ((pixi_spi_get(0, 0x20, 0) & 0x0001) == 1) { // GPIO1(0)
-   }
+   inputWait (0x20, 0x0001, 0x0000, -1); // GPIO1(0), active low
 
    printf("Starting Demo...\n");
 
@@ -0,0 +1,373 @@
+/*
+    pixi-tools: a set of software to interface with the Raspberry Pi
+    and PiXi-200 hardware
+    Copyright (C) 2013 Simon Cantrill
+
+    pixi-tools is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <libpixi/pixi/registers.h>
+#include <libpixi/pixi/simple.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "motion.h"
+#include "pwmpins.h"
+#include "log.h"
+
+// Moves advance once per servo frame: updating the PWM faster than the servo
+// samples it would only cost SPI traffic.
+static const int64 MotionTickNs = 20000000;
+
+enum
+{
+	MotionMaxMoves = 16,
+	MotionMaxAxes  = 8,
+	MotionPwmMask  = 0x3ff	// Position bits of a PWM register; the rest (direction) are kept
+};
+
+struct MotionMove
+{
+	bool          inUse;
+	bool          done;
+	bool          detached;	// Nobody holds the handle: release the slot as soon as the move is done
+	MotionProfile profile;
+	int64         startNs;
+	int64         durationNs;
+	double        accelFraction;	// Trapezoid: part of the move spent accelerating (and decelerating)
+	uint          count;
+	uint          address[MotionMaxAxes];
+	bool          active[MotionMaxAxes];	// Cleared when a later move takes the channel over
+	double        from[MotionMaxAxes];
+	double        distance[MotionMaxAxes];
+	int           flags[MotionMaxAxes];
+	int           last[MotionMaxAxes];	// Last position written
+};
+
+static MotionMove      moves[MotionMaxMoves];
+static uint            movesActive;
+static pthread_mutex_t motionLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  motionWake;	// Thread: there's something to move
+static pthread_cond_t  motionDone;	// Waiters: a move has finished
+static pthread_once_t  motionOnce = PTHREAD_ONCE_INIT;
+static int             motionError = EAGAIN;	// Why the motion thread isn't running, or 0
+
+static int64 nowNs (void)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (int64) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Fraction of the distance covered at fraction u of the move
+static double profilePosition (const MotionMove* move, double u)
+{
+	if (u >= 1)
+		return 1;
+	if (move->profile == MotionSCurve)
+		return u * u * u * (10 + u * (-15 + 6 * u));
+
+	double f = move->accelFraction;
+	if (f <= 0)
+		return u;
+	if (u < f)
+		return (u * u) / (2 * f * (1 - f));
+	if (u <= 1 - f)
+		return (u - f / 2) / (1 - f);
+	return 1 - ((1 - u) * (1 - u)) / (2 * f * (1 - f));
+}
+
+// Time (s) one channel needs to cover a distance, and the part of it spent accelerating
+static double profileDuration (MotionProfile profile, double distance, double speed, double accel, double* accelTime)
+{
+	*accelTime = 0;
+	if (distance <= 0)
+		return 0;
+	if (profile == MotionSCurve)
+	{
+		// Peak speed is 1.875 d/T, peak acceleration 5.77 d/T^2
+		double t = 1.875 * distance / speed;
+		if (accel > 0 && sqrt (5.7735 * distance / accel) > t)
+			t = sqrt (5.7735 * distance / accel);
+		return t;
+	}
+	if (accel <= 0)
+		return distance / speed;
+	if (distance * accel >= speed * speed)
+	{
+		*accelTime = speed / accel;
+		return distance / speed + *accelTime;
+	}
+	*accelTime = sqrt (distance / accel);	// Never reaches top speed
+	return 2 * *accelTime;
+}
+
+static void finishMove (MotionMove* move)
+{
+	if (!move->done)
+	{
+		move->done = true;
+		movesActive--;
+		pthread_cond_broadcast (&motionDone);
+	}
+	if (move->detached)
+		move->inUse = false;
+}
+
+static void* motionThread (void* arg)
+{
+	LIBPIXI_UNUSED(arg);
+	uint  writeAddress[MotionMaxMoves * MotionMaxAxes];
+	int   writeValue[MotionMaxMoves * MotionMaxAxes];
+	int64 deadline = 0;
+
+	pthread_mutex_lock (&motionLock);
+	for (;;)
+	{
+		if (movesActive == 0)
+		{
+			while (movesActive == 0)
+				pthread_cond_wait (&motionWake, &motionLock);
+			deadline = nowNs();
+		}
+
+		// Work out where every channel should be now
+		uint  writes = 0;
+		int64 now    = nowNs();
+		for (uint m = 0; m < MotionMaxMoves; m++)
+		{
+			MotionMove* move = &moves[m];
+			if (!move->inUse || move->done)
+				continue;
+			double u = (move->durationNs > 0) ? (double) (now - move->startNs) / move->durationNs : 1;
+			double s = profilePosition (move, u);
+			for (uint a = 0; a < move->count; a++)
+			{
+				if (!move->active[a])
+					continue;
+				int position = (int) lround (move->from[a] + move->distance[a] * s);
+				if (position != move->last[a])
+				{
+					move->last[a] = position;
+					writeAddress[writes] = move->address[a];
+					writeValue[writes++] = move->flags[a] | (position & MotionPwmMask);
+				}
+			}
+			if (u >= 1)
+				finishMove (move);
+		}
+
+		pthread_mutex_unlock (&motionLock);
+		uint pwmMask = 0;
+		uint pwmValues[PwmPins];
+		for (uint w = 0; w < writes; w++)
+		{
+			uint pin = writeAddress[w] - Pixi_PWM0_control;
+			if (pin < PwmPins)
+			{
+				// PWM channels all step together, so axes stay in line
+				pwmMask |= 1 << pin;
+				pwmValues[pin] = writeValue[w];
+			}
+			else
+				registerWrite (writeAddress[w], writeValue[w]);
+		}
+		if (pwmMask)
+			pwmWritePins (pwmMask, pwmValues);
+
+		// Next frame; frames that have already gone by are skipped, not caught up
+		deadline += MotionTickNs;
+		if (deadline < nowNs())
+			deadline = nowNs() + MotionTickNs;
+		struct timespec wake = {.tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000};
+		while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+			;
+		pthread_mutex_lock (&motionLock);
+	}
+	return NULL;
+}
+
+static void motionInit (void)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&motionDone, &attr);
+	pthread_cond_init (&motionWake, NULL);
+	pthread_condattr_destroy (&attr);
+
+	pthread_t thread;
+	int result = pthread_create (&thread, NULL, motionThread, NULL);
+	if (result != 0)
+	{
+		// pthread_create returns its error rather than setting errno
+		motionError = result;
+		PIO_ERROR (result, "Failed to start the motion thread");
+		return;
+	}
+	pthread_detach (thread);
+	motionError = 0;
+}
+
+MotionMove* motionStart (const MotionAxis* axes, uint count, MotionProfile profile)
+{
+	if (count == 0 || count > MotionMaxAxes)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	pthread_once (&motionOnce, motionInit);
+	if (motionError != 0)
+	{
+		errno = motionError;
+		return NULL;
+	}
+
+	// Current positions, outside the lock: channels that are already moving are picked up below
+	int current[MotionMaxAxes];
+	for (uint a = 0; a < count; a++)
+	{
+		if (axes[a].speed <= 0)
+		{
+			errno = EINVAL;
+			return NULL;
+		}
+		current[a] = registerRead (axes[a].address);
+		if (current[a] < 0)
+		{
+			errno = -current[a];
+			return NULL;
+		}
+	}
+
+	pthread_mutex_lock (&motionLock);
+	MotionMove* move = NULL;
+	for (uint m = 0; m < MotionMaxMoves && !move; m++)
+		if (!moves[m].inUse)
+			move = &moves[m];
+	if (!move)
+	{
+		pthread_mutex_unlock (&motionLock);
+		errno = EBUSY;
+		return NULL;
+	}
+
+	memset (move, 0, sizeof (*move));
+	move->inUse   = true;
+	move->profile = profile;
+	move->count   = count;
+
+	double duration = 0;
+	for (uint a = 0; a < count; a++)
+	{
+		double from = current[a] & MotionPwmMask;
+
+		// Take the channel over from any move that's driving it
+		for (uint m = 0; m < MotionMaxMoves; m++)
+		{
+			MotionMove* other = &moves[m];
+			if (other == move || !other->inUse || other->done)
+				continue;
+			bool stillActive = false;
+			for (uint o = 0; o < other->count; o++)
+			{
+				if (other->active[o] && other->address[o] == axes[a].address)
+				{
+					other->active[o] = false;
+					from = other->last[o];
+				}
+				stillActive |= other->active[o];
+			}
+			if (!stillActive)
+				finishMove (other);
+		}
+
+		move->address[a]  = axes[a].address;
+		move->active[a]   = true;
+		move->from[a]     = from;
+		move->distance[a] = (axes[a].target & MotionPwmMask) - from;
+		move->flags[a]    = current[a] & ~MotionPwmMask & 0xffff;
+		move->last[a]     = (int) from;
+
+		double accelTime;
+		double t = profileDuration (profile, fabs (move->distance[a]), axes[a].speed, axes[a].accel, &accelTime);
+		if (t > duration)
+		{
+			duration = t;
+			move->accelFraction = (t > 0) ? accelTime / t : 0;
+		}
+	}
+
+	move->durationNs = (int64) (duration * 1e9);
+	move->startNs    = nowNs();
+	movesActive++;
+	pthread_cond_signal (&motionWake);
+	pthread_mutex_unlock (&motionLock);
+
+	PIO_LOG_DEBUG ("Motion: %u channel(s) over %.2fs", count, duration);
+	return move;
+}
+
+int motionWait (MotionMove* move, int timeoutMs)
+{
+	struct timespec deadline;
+	clock_gettime (CLOCK_MONOTONIC, &deadline);
+	if (timeoutMs > 0)
+	{
+		deadline.tv_sec  += timeoutMs / 1000;
+		deadline.tv_nsec += (timeoutMs % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	int result = 0;
+	pthread_mutex_lock (&motionLock);
+	while (!move->done && result == 0)
+	{
+		if (timeoutMs < 0)
+			pthread_cond_wait (&motionDone, &motionLock);
+		else if (pthread_cond_timedwait (&motionDone, &motionLock, &deadline) == ETIMEDOUT)
+			result = -ETIMEDOUT;
+	}
+	if (move->done)
+	{
+		move->inUse = false;
+		result = 0;
+	}
+	pthread_mutex_unlock (&motionLock);
+	return result;
+}
+
+void motionCancel (MotionMove* move)
+{
+	pthread_mutex_lock (&motionLock);
+	finishMove (move);
+	move->inUse = false;
+	pthread_mutex_unlock (&motionLock);
+}
+
+void motionDetach (MotionMove* move)
+{
+	pthread_mutex_lock (&motionLock);
+	move->detached = true;
+	if (move->done)
+		move->inUse = false;
+	pthread_mutex_unlock (&motionLock);
+}
@@ -0,0 +1,76 @@
+/*
+    pixi-tools: a set of software to interface with the Raspberry Pi
+    and PiXi-200 hardware
+    Copyright (C) 2013 Simon Cantrill
+
+    pixi-tools is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef pio_motion_h__included
+#define pio_motion_h__included
+
+#include <libpixi/common.h>
+
+///@defgroup PioMotion Servo motion profiles
+///	Smooth, concurrent moves of PWM channels (servo positions). A move takes
+///	any set of PWM registers from their current values to new ones along a
+///	trapezoidal or S-curve (minimum-jerk) velocity profile, with all of its
+///	channels arriving together. One timer thread runs every move in step
+///	with the servo frame (50Hz), waking at absolute deadlines and only
+///	writing registers whose value has changed. It sleeps when nothing is
+///	moving. @ref motionStart returns straight away; use @ref motionWait to
+///	wait for the move to finish. A new move of a channel takes over from
+///	any move already driving it, starting from where that one had got to.
+///	There are 16 move slots. Every handle must be given back through
+///	@ref motionWait, @ref motionCancel or @ref motionDetach, or its slot
+///	is never reused; this includes moves that have been taken over.
+///@{
+
+typedef enum
+{
+	MotionTrapezoid,	///< Constant acceleration up to speed, cruise, constant deceleration
+	MotionSCurve		///< Minimum-jerk: acceleration ramps smoothly, no jolts at the ends
+} MotionProfile;
+
+typedef struct
+{
+	uint   address;		///< PWM register, e.g. 0x42
+	int    target;		///< Register value to move to
+	double speed;		///< Top speed, in register units per second
+	double accel;		///< Acceleration, in register units per second per second
+} MotionAxis;
+
+typedef struct MotionMove MotionMove;
+
+///	Start moving some channels. The move takes as long as the slowest channel needs.
+///	@return a handle to wait on, or NULL on error (errno is set)
+MotionMove* motionStart (const MotionAxis* axes, uint count, MotionProfile profile);
+
+///	Wait for a move to finish. The handle is released once the move is done.
+///	@param timeoutMs	maximum wait in milliseconds, or -1 to wait forever
+///	@return 0 when the move is done, or -ETIMEDOUT (the handle is still valid)
+int motionWait (MotionMove* move, int timeoutMs);
+
+///	Stop a move where it is and release the handle.
+void motionCancel (MotionMove* move);
+
+///	Let a move run to the end without waiting for it, and release the handle.
+///	The handle must not be used again: its slot is reused once the move is done
+///	(or taken over).
+void motionDetach (MotionMove* move);
+
+///@} defgroup
+
+#endif // !defined pio_motion_h__included
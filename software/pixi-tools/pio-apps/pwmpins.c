@@ -0,0 +1,142 @@
+/*
+    pixi-tools: a set of software to interface with the Raspberry Pi
+    and PiXi-200 hardware
+    Copyright (C) 2013 Simon Cantrill
+
+    pixi-tools is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <libpixi/pixi/registers.h>
+#include <libpixi/pixi/simple.h>
+#include <libpixi/pixi/spi.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include "pwmpins.h"
+#include "log.h"
+
+enum
+{
+	CommitRelease = 0x8000,	///< Commit flag: hand the channels back to 0x40..0x47
+	MaxFrames     = PwmPins + 3
+};
+
+int pwmWritePins (uint mask, const uint* values)
+{
+	uint8_t frame[MaxFrames][4];
+	struct spi_ioc_transfer transfer[MaxFrames];
+	uint    frames = 0;
+
+	mask &= (1 << PwmPins) - 1;
+	if (mask == 0)
+		return 0;
+
+	// Hold the channels, write the new values, latch them together, then let go
+	// (0x40..0x47 now match, so handing back causes no glitch).
+	uint address[MaxFrames];
+	uint value[MaxFrames];
+	address[frames] = PwmCommitAddress;
+	value[frames++] = mask;
+	for (uint pin = 0; pin < PwmPins; pin++)
+	{
+		if (mask & (1 << pin))
+		{
+			address[frames] = Pixi_PWM0_control + pin;
+			value[frames++] = values[pin];
+		}
+	}
+	address[frames] = PwmCommitAddress;
+	value[frames++] = mask;
+	address[frames] = PwmCommitAddress;
+	value[frames++] = CommitRelease | mask;
+
+	memset (transfer, 0, sizeof (transfer));
+	for (uint f = 0; f < frames; f++)
+	{
+		frame[f][0] = address[f];
+		frame[f][1] = PixiSpiEnableWrite16;
+		frame[f][2] = (value[f] & 0xFF00) >> 8;
+		frame[f][3] = (value[f] & 0x00FF);
+		transfer[f].tx_buf        = (intptr_t) frame[f];
+		transfer[f].rx_buf        = (intptr_t) frame[f];
+		transfer[f].len           = sizeof (frame[f]);
+		transfer[f].speed_hz      = globalPixi.speed;
+		transfer[f].delay_usecs   = globalPixi.delay;
+		transfer[f].bits_per_word = globalPixi.bitsPerWord;
+		transfer[f].cs_change     = (f + 1 < frames); // Each register write is a frame of its own
+	}
+
+	PIO_LOG_DEBUG ("pwmWritePins mask=0x%02x frames=%u", mask, frames);
+	if (ioctl (globalPixi.fd, SPI_IOC_MESSAGE(frames), transfer) < 0)
+	{
+		int err = errno;
+		PIO_ERROR (err, "pwmWritePins failed");
+		return -err;
+	}
+	return 0;
+}
+
+int pwmSetFrequency (uint pin, uint hz, uint bits)
+{
+	if (pin >= PwmPins || bits < 1 || bits > 15)
+		return -EINVAL;
+
+	uint period  = hz ? 1u << bits : 0;
+	uint divider = 1;
+	if (hz)
+	{
+		if (hz > PwmClockHz / period)
+			return -ERANGE;
+		divider = (PwmClockHz + hz * period / 2) / (hz * period);
+		if (divider > 0x10000)
+			return -ERANGE;
+	}
+
+	// Fall back to the default timebase while the divider changes
+	int result = registerWrite (PwmPeriodAddress + pin, 0);
+	if (result >= 0)
+		result = registerWrite (PwmDivAddress + pin, divider - 1);
+	if (result >= 0)
+		result = registerWrite (PwmPeriodAddress + pin, period);
+	if (result >= 0)
+		result = registerRead (PwmPeriodAddress + pin);
+	if (result < 0)
+		return result;
+	if (period == 0)
+		return 0;
+	if ((uint) result != period)
+		return -ENOTSUP;
+
+	PIO_LOG_DEBUG ("pwmSetFrequency pin=%u divider=%u period=%u", pin, divider, period);
+	return PwmClockHz / (divider * period);
+}
+
+int pwmSetCalibration (uint gainQ8, int offset)
+{
+	if (gainQ8 > 0xFFFF || offset < -0x8000 || offset > 0x7FFF)
+		return -EINVAL;
+
+	int result = registerWrite (PwmOffsetAddress, offset & 0xFFFF);
+	if (result >= 0)
+		result = registerWrite (PwmGainAddress, gainQ8);
+	if (result >= 0)
+		result = registerRead (PwmGainAddress);
+	if (result < 0)
+		return result;
+	if ((uint) result != gainQ8)
+		return -ENOTSUP;
+	return 0;
+}
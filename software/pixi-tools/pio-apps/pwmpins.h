@@ -0,0 +1,71 @@
+/*
+    pixi-tools: a set of software to interface with the Raspberry Pi
+    and PiXi-200 hardware
+    Copyright (C) 2013 Simon Cantrill
+
+    pixi-tools is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef pio_pwmpins_h__included
+#define pio_pwmpins_h__included
+
+#include <libpixi/common.h>
+
+///@defgroup PioPwmPins Synchronised PWM updates
+///	Set several PWM channels so that they all change at once. The writes go
+///	to the PiXi in a single SPI transfer, and the FPGA's commit register
+///	(0x4C) moves all of the selected channels to their new values on the
+///	same clock edge. With a bitstream that predates the commit register the
+///	channels still change within a few microseconds of each other.
+///@{
+
+enum
+{
+	PwmPins          = 8,	///< PWM channels, 0..7 (registers 0x40..0x47)
+	PwmGainAddress   = 0x48,	///< reg_pwm_gain: 8.8 fixed-point, 0 = off
+	PwmOffsetAddress = 0x49,	///< reg_pwm_offset: signed, added after the gain
+	PwmCommitAddress = 0x4C,	///< reg_pwm_commit
+	PwmDivAddress    = 0x60,	///< reg_pwm_div0..7: FPGA clocks per PWM count, less one
+	PwmPeriodAddress = 0x68,	///< reg_pwm_period0..7: PWM counts per cycle, 0 = default timebase
+	PwmClockHz       = 33333333	///< FPGA clock driving the PWM timebases
+};
+
+///	Set the PWM channels selected by @c mask (bit n = channel n) together.
+///	@param values	new control value for each channel, indexed by channel
+///	@return 0 on success, or -errno on error
+int pwmWritePins (uint mask, const uint* values);
+
+///	Run a PWM channel from its own timebase instead of the shared 50Hz servo one,
+///	e.g. tens of kHz for DC motors. The channel's control value then runs from 0
+///	to 2^bits - 1 (bit 15 is still the direction).
+///	@param pin	PWM channel [0,7]
+///	@param hz	cycles per second, or 0 for the default 50Hz / 10-bit timebase
+///	@param bits	resolution [1,15]
+///	@return the frequency actually set, 0 for the default timebase, or -errno
+///	on error (-ENOTSUP if the FPGA build has no per-channel timebase)
+int pwmSetFrequency (uint pin, uint hz, uint bits);
+
+///	Set the FPGA's calibration of channels on the default timebase: each control
+///	value becomes (value * gainQ8 / 256) + offset, limited to the 10-bit range.
+///	It applies to all of those channels at once, however they are written, so
+///	libpixi's pwmWritePin / pwmWritePinPercent are calibrated too.
+///	@param gainQ8	8.8 fixed-point gain (256 = 1.0), or 0 to turn calibration off
+///	@param offset	signed offset, in register units
+///	@return 0 on success, or -errno on error (-ENOTSUP if the FPGA build has no calibration)
+int pwmSetCalibration (uint gainQ8, int offset);
+
+///@} defgroup
+
+#endif // !defined pio_pwmpins_h__included
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include "Command.h"
 #include "log.h"
+#include "pwmpins.h"
 
 const uint MotorGpioController = 2;
 const uint MotorGpioPin        = 0;
@@ -33,6 +34,10 @@ const uint BackLeft   = 6;
 const uint FrontRight = 5;
 const uint BackRight  = 4;
 
+// Motor PWM: well above audible, with the same 10-bit range as the servo timebase
+const uint MotorPwmHz   = 16000;
+const uint MotorPwmBits = 10;
+
 typedef enum MotorDirection {
 	Forward = 0,
 	Reverse = 1
@@ -40,10 +45,22 @@ typedef enum MotorDirection {
 
 const uint MotorDirectionValues[2] = {0, 0x8000};
 
+static void setMotorPwm (uint hz)
+{
+	const uint pins[] = {FrontLeft, BackLeft, FrontRight, BackRight};
+	for (uint p = 0; p < ARRAY_COUNT(pins); p++)
+	{
+		int result = pwmSetFrequency (pins[p], hz, MotorPwmBits);
+		if (result < 0)
+			PIO_ERROR_DEBUG (-result, "Motor PWM %u stays on the default timebase", pins[p]);
+	}
+}
+
 static void prepare (void)
 {
 	pixiOpenOrDie();
 	pixiAdcOpenOrDie();
+	setMotorPwm (MotorPwmHz);
 //	gpioSetPinMode (MotorGpioController, MotorGpioPin, ??);
 	gpioWritePin   (MotorGpioController, MotorGpioPin, true);
 }
@@ -51,6 +68,7 @@ static void prepare (void)
 static void unprepare (void)
 {
 	gpioWritePin (MotorGpioController, MotorGpioPin, false);
+	setMotorPwm (0);
 	pixiAdcClose();
 	pixiClose();
 }
@@ -67,11 +85,14 @@ static void moveRover (MotorDirection leftSide, MotorDirection rightSide, double
 	uint pwmSpeed = ((uint) (speed * 1023.0 / 100.0)) & 0x000003ff;
 	PIO_LOG_INFO ("moveRover left=%d right=%d speed=%f pwmSpeed=0x%4x", leftSide, rightSide, speed, pwmSpeed);
 
-	// each side must be synchronised, but each side the motors are opposed:
-	pwmWritePin (FrontRight, pwmSpeed + MotorDirectionValues[ rightSide]);
-	pwmWritePin (BackRight , pwmSpeed + MotorDirectionValues[!rightSide]);
-	pwmWritePin (BackLeft  , pwmSpeed + MotorDirectionValues[!leftSide ]);
-	pwmWritePin (FrontLeft , pwmSpeed + MotorDirectionValues[ leftSide ]); // Front left must be last!
+	// each side must be synchronised, but each side the motors are opposed.
+	// All four change together (and front left is still written last):
+	uint values[PwmPins] = {0};
+	values[FrontRight] = pwmSpeed + MotorDirectionValues[ rightSide];
+	values[BackRight ] = pwmSpeed + MotorDirectionValues[!rightSide];
+	values[BackLeft  ] = pwmSpeed + MotorDirectionValues[!leftSide ];
+	values[FrontLeft ] = pwmSpeed + MotorDirectionValues[ leftSide ];
+	pwmWritePins ((1 << FrontRight) | (1 << BackRight) | (1 << BackLeft) | (1 << FrontLeft), values);
 }
 
 static void moveForward  (double speed) {moveRover (Forward, Forward, speed);}
@@ -0,0 +1,264 @@
+/*
+    pixi-tools: a set of software to interface with the Raspberry Pi
+    and PiXi-200 hardware
+    Copyright (C) 2013 Simon Cantrill
+
+    pixi-tools is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Command.h"
+#include "servo.h"
+#include "pwmpins.h"
+#include "log.h"
+
+// Nominal servo, for hardware calibration: 1500us +/- 500us over +/-90 degrees
+static const int NominalCentreUs = 1500;
+static const int NominalSpanUs   = 500;
+static const int NominalRange    = 90;
+
+// Pulse width -> control value, 8.8 fixed point
+static int64 pulseQ8 (int64 us, int64 periodUs, int64 counts)
+{
+	return (us * counts * 256 + periodUs / 2) / periodUs;
+}
+
+// a / b, rounded to the nearest
+static int64 divRound (int64 a, int64 b)
+{
+	return ((a < 0) == (b < 0)) ? (a + b / 2) / b : (a - b / 2) / b;
+}
+
+int servoCalibrate (ServoCalibration* servo, const ServoPulses* pulses)
+{
+	uint periodUs = pulses->periodUs ? pulses->periodUs : ServoDefaultPeriodUs;
+	uint counts   = pulses->counts   ? pulses->counts   : ServoDefaultCounts;
+	int  range    = pulses->range;
+
+	if (range < 1 || range > ServoMaxRange || counts > 0x8000
+		|| pulses->minUs >= periodUs || pulses->centreUs >= periodUs || pulses->maxUs >= periodUs)
+	{
+		return -EINVAL;
+	}
+
+	int64 minQ8    = pulseQ8 (pulses->minUs   , periodUs, counts);
+	int64 centreQ8 = pulseQ8 (pulses->centreUs, periodUs, counts);
+	int64 maxQ8    = pulseQ8 (pulses->maxUs   , periodUs, counts);
+
+	memset (servo, 0, sizeof (*servo));
+	servo->range      = range;
+	servo->counts     = counts;
+	servo->centreQ16  = (int32) (centreQ8 << 8);
+	servo->slopeQ8[0] = (int32) divRound (centreQ8 - minQ8, range);
+	servo->slopeQ8[1] = (int32) divRound (maxQ8 - centreQ8, range);
+
+	// servoDutyBatch works in 32 bits: the biggest term it adds must fit
+	int64 steepest = llabs (servo->slopeQ8[0]);
+	if (llabs (servo->slopeQ8[1]) > steepest)
+		steepest = llabs (servo->slopeQ8[1]);
+	if (servo->centreQ16 + 0x8000 + (int64) range * 256 * steepest > INT32_MAX)
+		return -ERANGE;
+
+	for (int degrees = -range; degrees <= range; degrees++)
+	{
+		int64 end = (degrees < 0) ? minQ8 : maxQ8;
+		servo->dutyQ8[degrees + range] = (int32) (centreQ8 + divRound ((end - centreQ8) * llabs (degrees), range));
+	}
+
+	while ((counts >> servo->inverseShift) > ServoInverseSize)
+		servo->inverseShift++;
+	for (uint index = 0; index < ServoInverseSize; index++)
+	{
+		int64 offsetQ8 = ((int64) ((index << servo->inverseShift) + ((1u << servo->inverseShift) >> 1)) << 8) - centreQ8;
+		int64 angleQ8  = 0;
+		if (servo->slopeQ8[1] != 0)
+			angleQ8 = divRound (offsetQ8 * 256, servo->slopeQ8[1]);
+		if (angleQ8 < 0 || servo->slopeQ8[1] == 0)
+			angleQ8 = (servo->slopeQ8[0] != 0) ? divRound (offsetQ8 * 256, servo->slopeQ8[0]) : 0;
+		if (angleQ8 < -range * 256)
+			angleQ8 = -range * 256;
+		else if (angleQ8 > range * 256)
+			angleQ8 = range * 256;
+		servo->angleQ8[index] = (int32) angleQ8;
+	}
+
+	PIO_LOG_DEBUG ("servoCalibrate range=%d centre=%d.%02d slope=%d/%d (Q8 per degree)",
+		range, (int) (centreQ8 >> 8), (int) ((centreQ8 & 0xFF) * 100 / 256), servo->slopeQ8[0], servo->slopeQ8[1]);
+	return 0;
+}
+
+uint servoDutyQ8 (const ServoCalibration* servo, int32 angleQ8)
+{
+	int32 fromMin = angleQ8 + servo->range * 256;
+	if (fromMin <= 0)
+		return (uint) (servo->dutyQ8[0] + 128) >> 8;
+	if (fromMin >= servo->range * 512)
+		return (uint) (servo->dutyQ8[servo->range * 2] + 128) >> 8;
+
+	const int32* duty = &servo->dutyQ8[fromMin >> 8];
+	int32 fraction = fromMin & 0xFF;
+	return (uint) (duty[0] + (((duty[1] - duty[0]) * fraction) >> 8) + 128) >> 8;
+}
+
+void servoDutyBatch (const ServoCalibration* servo, const int32* restrict anglesQ8, uint16* restrict duties, uint count)
+{
+	const int32 limit  = servo->range * 256;
+	const int32 centre = servo->centreQ16 + 0x8000; // Rounded
+	const int32 below  = servo->slopeQ8[0];
+	const int32 above  = servo->slopeQ8[1];
+
+	for (uint i = 0; i < count; i++)
+	{
+		int32 angle = anglesQ8[i];
+		angle = (angle < -limit) ? -limit : angle;
+		angle = (angle >  limit) ?  limit : angle;
+		int32 slope = (angle < 0) ? below : above;
+		duties[i] = (uint16) ((centre + angle * slope) >> 16);
+	}
+}
+
+int servoCalibrateHardware (const ServoCalibration* servo)
+{
+	if (servo->counts != ServoDefaultCounts)
+		return -EINVAL;
+
+	// Fit the servo's two end stops to the nominal servo's pulses at the same angles
+	int   range     = servo->range;
+	int64 nominalLo = pulseQ8 (NominalCentreUs * NominalRange - NominalSpanUs * range, NominalRange * ServoDefaultPeriodUs, ServoDefaultCounts);
+	int64 nominalHi = pulseQ8 (NominalCentreUs * NominalRange + NominalSpanUs * range, NominalRange * ServoDefaultPeriodUs, ServoDefaultCounts);
+	int64 servoLo   = servo->dutyQ8[0];
+	int64 servoHi   = servo->dutyQ8[2 * range];
+
+	int64 gainQ8 = divRound ((servoHi - servoLo) * 256, nominalHi - nominalLo);
+	if (gainQ8 <= 0 || gainQ8 > 0xFFFF)
+		return -ERANGE; // A reversed servo needs a negative gain, which the FPGA doesn't do
+	int64 nominalCentre = pulseQ8 (NominalCentreUs, ServoDefaultPeriodUs, ServoDefaultCounts);
+	int64 offset = divRound ((servo->centreQ16 >> 8) - divRound (nominalCentre * gainQ8, 256), 256);
+
+	return pwmSetCalibration ((uint) gainQ8, (int) offset);
+}
+
+
+// Self-check: the fixed-point tables against the same conversions done in floating point
+static const ServoPulses checkPulses[] =
+{
+	{.minUs = 1000, .centreUs = 1500, .maxUs = 2000, .range = 90},		// Nominal
+	{.minUs = 2988, .centreUs = 1992, .maxUs =  996, .range = 90},		// Reversed (dalek alt)
+	{.minUs =  498, .centreUs = 1494, .maxUs = 2490, .range = 90},		// Dalek az
+	{.minUs =  500, .centreUs = 1400, .maxUs = 2500, .range = 135},		// Wide, off centre
+	{.minUs =  900, .centreUs = 1500, .maxUs = 2100, .range = 60, .periodUs = 3333, .counts = 32768} // 300Hz, 15 bits
+};
+
+static double checkError (double got, double expected)
+{
+	return (got > expected) ? got - expected : expected - got;
+}
+
+// Largest error (in control values) of each conversion for one servo
+static int servoCheck (const ServoPulses* pulses)
+{
+	static ServoCalibration servo;
+	int result = servoCalibrate (&servo, pulses);
+	if (result < 0)
+	{
+		PIO_LOG_ERROR ("servoCalibrate failed for %u/%u/%u: %d", pulses->minUs, pulses->centreUs, pulses->maxUs, result);
+		return result;
+	}
+
+	double periodUs  = pulses->periodUs ? pulses->periodUs : ServoDefaultPeriodUs;
+	double perUs     = servo.counts / periodUs;
+	int    range     = servo.range;
+	double dutyError = 0, fractionError = 0, batchError = 0, inverseError = 0;
+
+	for (int32 angleQ8 = -range * 256; angleQ8 <= range * 256; angleQ8 += 16)
+	{
+		double degrees  = angleQ8 / 256.0;
+		double endUs    = (degrees < 0) ? pulses->minUs : pulses->maxUs;
+		double fraction = (degrees < 0) ? -degrees / range : degrees / range;
+		double expected = (pulses->centreUs + (endUs - pulses->centreUs) * fraction) * perUs;
+
+		if ((angleQ8 & 0xFF) == 0)
+		{
+			double error = checkError (servoDuty (&servo, angleQ8 >> 8), expected);
+			if (error > dutyError)
+				dutyError = error;
+		}
+		double error = checkError (servoDutyQ8 (&servo, angleQ8), expected);
+		if (error > fractionError)
+			fractionError = error;
+
+		uint16 batch;
+		servoDutyBatch (&servo, &angleQ8, &batch, 1);
+		error = checkError (batch, expected);
+		if (error > batchError)
+			batchError = error;
+
+		// Back from the control value to an angle, and forward again
+		uint duty = servoDutyQ8 (&servo, angleQ8);
+		error = checkError (servoDutyQ8 (&servo, servoAngleQ8 (&servo, duty)), duty) / (1u << servo.inverseShift);
+		if (error > inverseError)
+			inverseError = error;
+	}
+
+	// Each conversion rounds to the nearest control value, so it should be at most one out;
+	// the inverse table is one entry per 2^inverseShift control values
+	bool ok = dutyError <= 1 && fractionError <= 1 && batchError <= 1 && inverseError <= 1;
+	printf ("%4u/%4u/%4uus +/-%3d deg, %5u counts: duty %.2f, Q8 %.2f, batch %.2f, inverse %.2f  %s\n",
+		pulses->minUs, pulses->centreUs, pulses->maxUs, range, servo.counts,
+		dutyError, fractionError, batchError, inverseError, ok ? "ok" : "FAILED");
+	return ok ? 0 : -ERANGE;
+}
+
+static int servoCheckFn (uint argc, char*const*const argv)
+{
+	if (argc != 1)
+	{
+		PIO_LOG_ERROR ("usage: %s", argv[0]);
+		return -EINVAL;
+	}
+	int result = 0;
+	for (uint i = 0; i < ARRAY_COUNT(checkPulses); i++)
+		if (servoCheck (&checkPulses[i]) < 0)
+			result = -ERANGE;
+	return result;
+}
+static Command servoCheckCmd =
+{
+	.name        = "servo-check",
+	.description = "Check the fixed-point servo calibration against floating point (no hardware needed)",
+	.function    = servoCheckFn
+};
+
+static const Command* commands[] =
+{
+	&servoCheckCmd,
+};
+
+static CommandGroup servoGroup =
+{
+	.name      = "servo",
+	.count     = ARRAY_COUNT(commands),
+	.commands  = commands,
+	.nextGroup = NULL
+};
+
+static void PIO_CONSTRUCTOR (10003) initGroup (void)
+{
+	addCommandGroup (&servoGroup);
+}
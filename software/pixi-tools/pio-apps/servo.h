@@ -0,0 +1,106 @@
+/*
+    pixi-tools: a set of software to interface with the Raspberry Pi
+    and PiXi-200 hardware
+    Copyright (C) 2013 Simon Cantrill
+
+    pixi-tools is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef pio_servo_h__included
+#define pio_servo_h__included
+
+#include <libpixi/common.h>
+
+///@defgroup PioServo Servo calibration
+///	Convert between servo angles and PWM control values without floating
+///	point. A calibration is built once from the pulse widths a servo needs at
+///	its two end stops and at its centre. After that, each conversion is a
+///	table lookup, or an integer multiply and shift for whole trajectories.
+///	Angles are in degrees, or in 8.8 fixed point (Q8: 256 = 1 degree) where
+///	fractions matter. A servo that is mounted the other way round simply has
+///	its end-stop pulse widths swapped.
+///	`pio servo-check` compares every conversion with the floating-point
+///	equivalent, with no hardware needed.
+///@{
+
+enum
+{
+	ServoMaxRange        = 180,		///< Largest angle either side of centre (degrees)
+	ServoTableSize       = 2 * ServoMaxRange + 1,
+	ServoInverseSize     = 1024,		///< Control values covered by the inverse table
+	ServoDefaultPeriodUs = 20000,	///< Default PWM timebase: 50Hz...
+	ServoDefaultCounts   = 1024		///< ...with 10 bits
+};
+
+typedef struct
+{
+	uint minUs;		///< Pulse width at -range degrees (microseconds)
+	uint centreUs;	///< Pulse width at 0 degrees
+	uint maxUs;		///< Pulse width at +range degrees
+	uint range;		///< Degrees either side of centre, at most ServoMaxRange
+	uint periodUs;	///< PWM cycle, 0 for the default timebase (ServoDefaultPeriodUs)
+	uint counts;	///< PWM steps per cycle, 0 for the default timebase (ServoDefaultCounts)
+} ServoPulses;
+
+typedef struct
+{
+	int   range;							///< Degrees either side of centre
+	uint  counts;							///< PWM steps per cycle
+	int32 centreQ16;						///< Control value at 0 degrees (16.16)
+	int32 slopeQ8[2];						///< Control value per degree (8.8): below and above centre
+	int32 dutyQ8[ServoTableSize];			///< Control value (8.8) at each whole degree, -range..+range
+	uint  inverseShift;						///< Control value >> inverseShift indexes angleQ8
+	int32 angleQ8[ServoInverseSize];		///< Angle (Q8) for each control value
+} ServoCalibration;
+
+///	Build the tables for a servo.
+///	@return 0 on success, or -EINVAL / -ERANGE if the pulse widths don't fit
+int servoCalibrate (ServoCalibration* servo, const ServoPulses* pulses);
+
+///	Control value for a whole no. of degrees (limited to the servo's range)
+static inline uint servoDuty (const ServoCalibration* servo, int degrees)
+{
+	if (degrees < -servo->range)
+		degrees = -servo->range;
+	else if (degrees > servo->range)
+		degrees = servo->range;
+	return (uint) (servo->dutyQ8[degrees + servo->range] + 128) >> 8;
+}
+
+///	Control value for a Q8 angle, interpolated between whole degrees
+uint servoDutyQ8 (const ServoCalibration* servo, int32 angleQ8);
+
+///	Convert a whole trajectory of Q8 angles to control values. The loop is
+///	branch-free integer arithmetic, so the compiler can vectorize it where
+///	the CPU has SIMD (NEON).
+void servoDutyBatch (const ServoCalibration* servo, const int32* anglesQ8, uint16* duties, uint count);
+
+///	Angle (Q8) that a control value read back from the PiXi corresponds to
+static inline int32 servoAngleQ8 (const ServoCalibration* servo, uint duty)
+{
+	uint index = duty >> servo->inverseShift;
+	return servo->angleQ8[(index < ServoInverseSize) ? index : ServoInverseSize - 1];
+}
+
+///	Have the FPGA do the calibration instead: program reg_pwm_gain / reg_pwm_offset
+///	so that plain control values for a nominal servo (1000us..2000us over -90..+90
+///	degrees, on the default timebase) come out as this servo's pulses. This is a
+///	straight-line fit, and applies to every channel on the default timebase.
+///	@return 0 on success, or -errno on error
+int servoCalibrateHardware (const ServoCalibration* servo);
+
+///@} defgroup
+
+#endif // !defined pio_servo_h__included
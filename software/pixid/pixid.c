@@ -0,0 +1,573 @@
+/*
+ * pixid.c:
+ *	PiXi-200 SPI daemon.
+ *	Astro Designs Ltd.
+ ***********************************************************************
+ * Owns /dev/spidev0.0 & /dev/spidev0.1 and serves register requests
+ * from any number of local clients (gpio, pio, scripts) over a Unix
+ * domain socket, so that clients can no longer interleave
+ * read-modify-write sequences on the bus. See pixid.h for the protocol.
+ *
+ * Every request that is waiting when the daemon wakes up is taken in
+ * one pass and sent as batched transfers (up to PIXID_MAX_OPS frames per
+ * ioctl, chip-select released between frames). Masked writes are
+ * resolved against a shadow copy of the FPGA write registers in request
+ * order, so they are serialised correctly however the requests were
+ * batched.
+ *
+ * It can also keep a shared-memory mirror of a few slowly changing read
+ * registers (build time, switches, runtime counter...) so that readers
+ * which can accept slightly stale values need no SPI traffic at all. The
+ * mirror reads are queued with the client requests and share their
+ * transfers.
+ *
+ * Usage: pixid [-f] [-s socket] [-m regs] [-p ms]
+ *	-f	Stay in the foreground and log to stderr as well as syslog
+ *	-s	Socket path (default PIXID_SOCKET)
+ *	-m	Mirror these registers, e.g. 0x00,0x01,0x02 ("none" to disable,
+ *		default PIXID_MIRROR_REGS)
+ *	-p	Mirror refresh period in ms (default PIXID_MIRROR_PERIOD)
+ *
+ * Build: make && sudo make install (see also scripts/pixid)
+ ***********************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <linux/spi/spidev.h>
+
+#include "pixid.h"
+
+#define PIXID_SPI_SPEED   8000000                       // FPGA SPI clock (Hz)
+#define PIXID_MAX_CLIENTS 32
+
+static const char *spiDevice [2] = { "/dev/spidev0.0", "/dev/spidev0.1" } ;
+
+// Registers whose read value mirrors the last write (see rreg assignments in pixi_top.vhd)
+static const uint8_t readbackRegs [] =
+{
+  0x03, 0x04, 0x05, 0x06, 0x07,                   // reg_test3..7 (reg_test4 reads back inverted)
+  0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D,       // GPIO mode registers
+  0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, // PWM control registers (ENABLE_PWM_READBACK)
+} ;
+
+
+/*
+ * SPI channel state: the device, the shadow registers and the batch
+ * being built for it.
+ *********************************************************************************
+ */
+
+typedef struct
+{
+  int fd ;
+  uint16_t shadow [256] ;
+  int count ;
+  uint8_t frame [PIXID_MAX_OPS][4] ;
+  struct spi_ioc_transfer xfer [PIXID_MAX_OPS] ;
+  int32_t *result [PIXID_MAX_OPS] ;                     // Where each frame's result goes
+  uint8_t op [PIXID_MAX_OPS] ;
+} pixid_channel ;
+
+typedef struct
+{
+  int fd ;
+  int pending ;                                         // A request has been read & awaits its reply
+  int length ;
+  pixid_request request ;
+  pixid_reply reply ;
+} pixid_client ;
+
+static pixid_channel channels [2] ;
+static pixid_client clients [PIXID_MAX_CLIENTS] ;
+static volatile sig_atomic_t running = 1 ;
+static int foreground = 0 ;
+
+static pixid_mirror *mirror ;
+static int mirrorCount ;
+static uint8_t mirrorAddress [256] ;
+static int32_t mirrorResult [256] ;
+
+static void stop (int sig)
+{
+  (void) sig ;
+  running = 0 ;
+}
+
+
+/*
+ * spi:
+ *	Batched frame transfers on one channel.
+ *********************************************************************************
+ */
+
+static int spiOpen (int channel)
+{
+  pixid_channel *ch = &channels [channel] ;
+  uint8_t mode = 0 ;
+  uint8_t bits = 8 ;
+  uint32_t speed = PIXID_SPI_SPEED ;
+
+  if ((ch->fd = open (spiDevice [channel], O_RDWR)) < 0)
+    return -errno ;
+
+  if ((ioctl (ch->fd, SPI_IOC_WR_MODE, &mode) < 0) ||
+      (ioctl (ch->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0) ||
+      (ioctl (ch->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0))
+  {
+    int err = -errno ;
+    close (ch->fd) ;
+    ch->fd = -1 ;
+    return err ;
+  }
+  return 0 ;
+}
+
+// Send the channel's queued frames and store their results
+static void spiFlush (int channel)
+{
+  pixid_channel *ch = &channels [channel] ;
+  int result ;
+  int i ;
+
+  if (ch->count == 0)
+    return ;
+
+  for (i = 0 ; i < ch->count ; i++)
+  {
+    memset (&ch->xfer [i], 0, sizeof (ch->xfer [i])) ;
+    ch->xfer [i].tx_buf        = (unsigned long)ch->frame [i] ;
+    ch->xfer [i].rx_buf        = (unsigned long)ch->frame [i] ;
+    ch->xfer [i].len           = 4 ;
+    ch->xfer [i].speed_hz      = PIXID_SPI_SPEED ;
+    ch->xfer [i].bits_per_word = 8 ;
+    ch->xfer [i].cs_change     = (i < ch->count - 1) ; // Release chip-select between frames
+  }
+
+  result = ioctl (ch->fd, SPI_IOC_MESSAGE (ch->count), ch->xfer) ;
+
+  for (i = 0 ; i < ch->count ; i++)
+  {
+    if (result < 0)
+      *ch->result [i] = -errno ;
+    else if (ch->op [i] != PIXID_SET_MASKED)    // Masked writes already hold the previous value
+      *ch->result [i] = (ch->frame [i][2] << 8) | ch->frame [i][3] ;
+  }
+  if (result < 0)
+    syslog (LOG_ERR, "SPI channel %d transfer failed: %s", channel, strerror (errno)) ;
+
+  ch->count = 0 ;
+}
+
+static void spiQueue (int channel, int op, int address, int control, int data, int32_t *result)
+{
+  pixid_channel *ch = &channels [channel] ;
+
+  if (ch->count == PIXID_MAX_OPS)
+    spiFlush (channel) ;
+
+  ch->frame [ch->count][0] = address ;
+  ch->frame [ch->count][1] = control ;
+  ch->frame [ch->count][2] = data >> 8 ;
+  ch->frame [ch->count][3] = data ;
+  ch->op     [ch->count]   = op ;
+  ch->result [ch->count]   = result ;
+  ch->count++ ;
+}
+
+// Load the shadow registers: FPGA reset values, then the registers that can be read back
+static void shadowInit (int channel)
+{
+  pixid_channel *ch = &channels [channel] ;
+  int32_t value [sizeof (readbackRegs)] ;
+  unsigned i ;
+
+  memset (ch->shadow, 0, sizeof (ch->shadow)) ;
+  ch->shadow [0x39] = 0x8000 ; // reg_vfd_ctrl: default LCD/VFD timing
+
+  for (i = 0 ; i < sizeof (readbackRegs) ; i++)
+    spiQueue (channel, PIXID_GET, readbackRegs [i], 0x80, 0, &value [i]) ;
+  spiFlush (channel) ;
+
+  for (i = 0 ; i < sizeof (readbackRegs) ; i++)
+    if (value [i] >= 0)
+      ch->shadow [readbackRegs [i]] = (readbackRegs [i] == 0x04) ? ~value [i] : value [i] ;
+}
+
+
+/*
+ * Mirror
+ *********************************************************************************
+ */
+
+static int mirrorOpen (const char *regs, int periodMs)
+{
+  char *list = strdup (regs) ;
+  char *reg ;
+  int fd ;
+
+  for (reg = strtok (list, ",") ; (reg != NULL) && (mirrorCount < 256) ; reg = strtok (NULL, ","))
+    mirrorAddress [mirrorCount++] = strtol (reg, NULL, 0) ;
+  free (list) ;
+
+  // Always a fresh file of our own: whatever is at the path (a leftover, or
+  // something planted in /dev/shm) is removed rather than opened
+  unlink (PIXID_MIRROR) ;
+  if ((fd = open (PIXID_MIRROR, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0)
+    return -1 ;
+  if ((fchmod (fd, 0644) < 0) || (ftruncate (fd, sizeof (pixid_mirror)) < 0))
+  {
+    close (fd) ;
+    return -1 ;
+  }
+  mirror = mmap (NULL, sizeof (pixid_mirror), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ;
+  close (fd) ;
+  if (mirror == MAP_FAILED)
+  {
+    mirror = NULL ;
+    return -1 ;
+  }
+
+  memset (mirror, 0, sizeof (pixid_mirror)) ;
+  mirror->periodMs = periodMs ;
+  __sync_synchronize () ;
+  mirror->magic = PIXID_MIRROR_MAGIC ;
+  return 0 ;
+}
+
+static void mirrorQueue (void)
+{
+  int i ;
+
+  for (i = 0 ; i < mirrorCount ; i++)
+    spiQueue (0, PIXID_GET, mirrorAddress [i], 0x80, 0, &mirrorResult [i]) ;
+}
+
+// Publish the values read by mirrorQueue, each under its seqlock
+static void mirrorPublish (void)
+{
+  pixid_mirror_entry *entry ;
+  struct timespec now ;
+  uint64_t timestamp ;
+  int i ;
+
+  clock_gettime (CLOCK_MONOTONIC, &now) ;
+  timestamp = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec ;
+
+  for (i = 0 ; i < mirrorCount ; i++)
+  {
+    if (mirrorResult [i] < 0)
+      continue ;
+    entry = &mirror->reg [mirrorAddress [i]] ;
+    entry->sequence++ ;
+    __sync_synchronize () ;
+    entry->value     = mirrorResult [i] ;
+    entry->timestamp = timestamp ;
+    entry->valid     = 1 ;
+    __sync_synchronize () ;
+    entry->sequence++ ;
+  }
+}
+
+
+/*
+ * Requests
+ *********************************************************************************
+ */
+
+// Queue every operation of a request, resolving masked writes against the shadow
+static void requestQueue (pixid_client *client)
+{
+  pixid_request *request = &client->request ;
+  pixid_reply *reply = &client->reply ;
+  pixid_channel *ch ;
+  pixid_op *op ;
+  int data ;
+  int i ;
+
+  reply->tag    = request->tag ;
+  reply->count  = 0 ;
+  reply->status = 0 ;
+
+  if ((client->length < (int)PIXID_REQUEST_SIZE (0)) ||
+      (request->count > PIXID_MAX_OPS) ||
+      (client->length != (int)PIXID_REQUEST_SIZE (request->count)))
+  {
+    reply->status = -EINVAL ;
+    return ;
+  }
+
+  reply->count = request->count ;
+  for (i = 0 ; i < request->count ; i++)
+  {
+    op = &request->op [i] ;
+    if ((op->channel > 1) || (channels [op->channel].fd < 0))
+    {
+      reply->result [i] = -ENODEV ;
+      continue ;
+    }
+    ch = &channels [op->channel] ;
+
+    switch (op->op)
+    {
+      case PIXID_GET:
+        spiQueue (op->channel, PIXID_GET, op->address, 0x80, 0, &reply->result [i]) ;
+        break ;
+
+      case PIXID_SET:
+        ch->shadow [op->address] = op->data ;
+        spiQueue (op->channel, PIXID_SET, op->address, 0x40, op->data, &reply->result [i]) ;
+        break ;
+
+      case PIXID_SET_MASKED:
+        reply->result [i] = ch->shadow [op->address] ;
+        data = (ch->shadow [op->address] & ~op->mask) | (op->data & op->mask) ;
+        ch->shadow [op->address] = data ;
+        spiQueue (op->channel, PIXID_SET_MASKED, op->address, 0x40, data, &reply->result [i]) ;
+        break ;
+
+      case PIXID_RESET:
+        shadowInit (op->channel) ;  // Flushes the frames queued so far first, so ordering is kept
+        reply->result [i] = 0 ;
+        break ;
+
+      default:
+        reply->result [i] = -EINVAL ;
+        break ;
+    }
+  }
+}
+
+static void clientClose (pixid_client *client)
+{
+  close (client->fd) ;
+  client->fd = -1 ;
+  client->pending = 0 ;
+}
+
+static void clientAccept (int listenFd)
+{
+  int fd ;
+  int i ;
+
+  if ((fd = accept (listenFd, NULL, NULL)) < 0)
+    return ;
+
+  for (i = 0 ; i < PIXID_MAX_CLIENTS ; i++)
+  {
+    if (clients [i].fd < 0)
+    {
+      clients [i].fd = fd ;
+      clients [i].pending = 0 ;
+      return ;
+    }
+  }
+
+  syslog (LOG_WARNING, "Too many clients, connection refused") ;
+  close (fd) ;
+}
+
+static int listenOn (const char *path)
+{
+  struct sockaddr_un addr ;
+  mode_t mask ;
+  int fd ;
+  int result ;
+
+  if ((fd = socket (AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+    return -1 ;
+
+  memset (&addr, 0, sizeof (addr)) ;
+  addr.sun_family = AF_UNIX ;
+  strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1) ;
+  unlink (path) ;
+
+  // Create the socket 0660 rather than open it up to everyone until a chmod
+  mask = umask (0117) ;
+  result = bind (fd, (struct sockaddr *)&addr, sizeof (addr)) ;
+  umask (mask) ;
+
+  if ((result < 0) || (listen (fd, 16) < 0))
+  {
+    close (fd) ;
+    return -1 ;
+  }
+  return fd ;
+}
+
+
+int main (int argc, char *argv [])
+{
+  struct pollfd fds [PIXID_MAX_CLIENTS + 2] ;
+  struct itimerspec period ;
+  const char *path = getenv ("PIXID_SOCKET") ;
+  const char *mirrorRegs = PIXID_MIRROR_REGS ;
+  int mirrorPeriod = PIXID_MIRROR_PERIOD ;
+  int timerFd = -1 ;
+  int refresh ;
+  uint64_t expirations ;
+  int listenFd ;
+  int opt ;
+  int channel ;
+  int result ;
+  int i ;
+
+  if (path == NULL)
+    path = PIXID_SOCKET ;
+
+  while ((opt = getopt (argc, argv, "fs:m:p:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'f': foreground = 1 ;              break ;
+      case 's': path = optarg ;               break ;
+      case 'm': mirrorRegs = optarg ;         break ;
+      case 'p': mirrorPeriod = atoi (optarg) ; break ;
+      default:
+        fprintf (stderr, "Usage: %s [-f] [-s socket] [-m regs] [-p ms]\n", argv [0]) ;
+        return 1 ;
+    }
+  }
+
+  openlog ("pixid", LOG_PID | (foreground ? LOG_PERROR : 0), LOG_DAEMON) ;
+
+  for (channel = 0 ; channel < 2 ; channel++)
+  {
+    if ((result = spiOpen (channel)) < 0)
+      syslog (LOG_WARNING, "Unable to open %s: %s", spiDevice [channel], strerror (-result)) ;
+    else
+      shadowInit (channel) ;
+  }
+  if ((channels [0].fd < 0) && (channels [1].fd < 0))
+  {
+    syslog (LOG_ERR, "No SPI channels available") ;
+    return 1 ;
+  }
+
+  if ((listenFd = listenOn (path)) < 0)
+  {
+    syslog (LOG_ERR, "Unable to listen on %s: %s", path, strerror (errno)) ;
+    return 1 ;
+  }
+
+  if (!foreground && (daemon (0, 0) < 0))
+  {
+    syslog (LOG_ERR, "Unable to start daemon: %s", strerror (errno)) ;
+    return 1 ;
+  }
+
+  signal (SIGINT,  stop) ;
+  signal (SIGTERM, stop) ;
+  signal (SIGPIPE, SIG_IGN) ;
+
+  for (i = 0 ; i < PIXID_MAX_CLIENTS ; i++)
+    clients [i].fd = -1 ;
+
+  if ((strcasecmp (mirrorRegs, "none") != 0) && (channels [0].fd >= 0) && (mirrorPeriod > 0))
+  {
+    if ((mirrorOpen (mirrorRegs, mirrorPeriod) < 0) || ((timerFd = timerfd_create (CLOCK_MONOTONIC, 0)) < 0))
+      syslog (LOG_WARNING, "Unable to create register mirror %s: %s", PIXID_MIRROR, strerror (errno)) ;
+    else
+    {
+      period.it_interval.tv_sec  = mirrorPeriod / 1000 ;
+      period.it_interval.tv_nsec = (mirrorPeriod % 1000) * 1000000 ;
+      period.it_value            = period.it_interval ;
+      timerfd_settime (timerFd, 0, &period, NULL) ;
+      mirrorQueue () ;
+      spiFlush (0) ;
+      mirrorPublish () ;
+    }
+  }
+
+  syslog (LOG_INFO, "Serving PiXi-200 SPI on %s", path) ;
+
+  while (running)
+  {
+    fds [0].fd     = listenFd ;
+    fds [0].events = POLLIN ;
+    for (i = 0 ; i < PIXID_MAX_CLIENTS ; i++)
+    {
+      fds [i + 1].fd     = clients [i].fd ;
+      fds [i + 1].events = POLLIN ;
+    }
+
+    fds [PIXID_MAX_CLIENTS + 1].fd     = timerFd ;
+    fds [PIXID_MAX_CLIENTS + 1].events = POLLIN ;
+
+    if (poll (fds, PIXID_MAX_CLIENTS + 2, -1) < 0)
+      continue ;
+
+    // Mirror refresh due? Its reads share the transfers with the client requests
+    refresh = (fds [PIXID_MAX_CLIENTS + 1].revents & POLLIN) && (read (timerFd, &expirations, sizeof (expirations)) > 0) ;
+    if (refresh)
+      mirrorQueue () ;
+
+    // Take one request from every client that has one waiting...
+    for (i = 0 ; i < PIXID_MAX_CLIENTS ; i++)
+    {
+      if ((clients [i].fd < 0) || !(fds [i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue ;
+
+      clients [i].length = recv (clients [i].fd, &clients [i].request, sizeof (clients [i].request), MSG_DONTWAIT) ;
+      if (clients [i].length <= 0)
+      {
+        if ((clients [i].length == 0) || (errno != EAGAIN))
+          clientClose (&clients [i]) ;
+        continue ;
+      }
+      clients [i].pending = 1 ;
+      requestQueue (&clients [i]) ;
+    }
+
+    // ...send them as batched transfers...
+    spiFlush (0) ;
+    spiFlush (1) ;
+    if (refresh)
+      mirrorPublish () ;
+
+    // ...and reply
+    for (i = 0 ; i < PIXID_MAX_CLIENTS ; i++)
+    {
+      if (!clients [i].pending)
+        continue ;
+      clients [i].pending = 0 ;
+      // A client has one request outstanding at a time, so a full socket
+      // means it has stopped reading; drop it rather than stall the bus
+      if (send (clients [i].fd, &clients [i].reply, PIXID_REPLY_SIZE (clients [i].reply.count), MSG_DONTWAIT) < 0)
+      {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+          syslog (LOG_WARNING, "Client not reading its replies, dropped") ;
+        clientClose (&clients [i]) ;
+      }
+    }
+
+    if (fds [0].revents & POLLIN)
+      clientAccept (listenFd) ;
+  }
+
+  syslog (LOG_INFO, "Stopping") ;
+  if (mirror != NULL)
+    mirror->magic = 0 ; // Readers go back to the bus
+  close (listenFd) ;
+  unlink (path) ;
+  for (channel = 0 ; channel < 2 ; channel++)
+    if (channels [channel].fd >= 0)
+      close (channels [channel].fd) ;
+  return 0 ;
+}
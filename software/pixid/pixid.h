@@ -0,0 +1,94 @@
+/*
+ * pixid.h:
+ *	Client protocol for pixid, the PiXi-200 SPI daemon.
+ *	Astro Designs Ltd.
+ ***********************************************************************
+ * pixid owns both PiXi-200 SPI channels and serves register requests
+ * over a Unix domain socket (SOCK_SEQPACKET, so one send is one
+ * message). A request is a header followed by 'count' operations; the
+ * reply is a header followed by one 32-bit result per operation.
+ * Operations within a request are applied in order, and requests from
+ * different clients are never interleaved, so a request is atomic with
+ * respect to every other pixid client.
+ *
+ * All fields are in host byte order: clients are always local.
+ ***********************************************************************
+ */
+
+#ifndef PIXID_H
+#define PIXID_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PIXID_SOCKET  "/var/run/pixid.sock"             // Default socket, override with PIXID_SOCKET in the environment
+#define PIXID_MAX_OPS 64                                // Max. no. of operations in one request
+
+// Operations
+#define PIXID_GET        1                              // Result: register value
+#define PIXID_SET        2                              // Result: data returned by the write frame
+#define PIXID_SET_MASKED 3                              // Result: register value before the write
+#define PIXID_RESET      4                              // Reload the shadow copy, e.g. after reprogramming. Result: 0
+
+typedef struct
+{
+  uint8_t  op ;
+  uint8_t  channel ;
+  uint8_t  address ;
+  uint8_t  reserved ;
+  uint16_t data ;
+  uint16_t mask ;                                       // PIXID_SET_MASKED only
+} pixid_op ;
+
+typedef struct
+{
+  uint32_t tag ;                                        // Echoed in the reply
+  uint16_t count ;
+  uint16_t reserved ;
+  pixid_op op [PIXID_MAX_OPS] ;
+} pixid_request ;
+
+typedef struct
+{
+  uint32_t tag ;
+  uint16_t count ;
+  int16_t  status ;                                     // 0, or -errno if the request was rejected
+  int32_t  result [PIXID_MAX_OPS] ;                     // Per operation: see above, or -errno
+} pixid_reply ;
+
+/*
+ * Register mirror: an optional shared-memory copy of slowly changing
+ * FPGA read registers (channel 0), refreshed by pixid at a fixed rate.
+ * Readers map PIXID_MIRROR read-only and never touch the bus. Each entry
+ * has a sequence count that is odd while pixid is updating it: read the
+ * count, the entry, then the count again, and retry if it was odd or has
+ * changed. Retry a bounded number of times only (pixid may have died
+ * mid-update) and then read the bus, and only trust a mirror owned by
+ * root. The timestamp is CLOCK_MONOTONIC, so it compares directly with
+ * the reader's own clock.
+ */
+
+#define PIXID_MIRROR         "/dev/shm/pixid-mirror"
+#define PIXID_MIRROR_MAGIC   0x5058494D                 // "PXIM"
+#define PIXID_MIRROR_REGS    "0x00,0x01,0x02,0x32,0x33,0xF0,0xF1,0xF8" // Build time, switches, keypad, runtime counter, demo no.
+#define PIXID_MIRROR_PERIOD  100                        // Default refresh period (ms)
+
+typedef struct
+{
+  volatile uint32_t sequence ;
+  uint16_t value ;
+  uint16_t valid ;                                      // Non-zero once the register has been read
+  uint64_t timestamp ;                                  // CLOCK_MONOTONIC, ns
+} pixid_mirror_entry ;
+
+typedef struct
+{
+  uint32_t magic ;
+  uint32_t periodMs ;
+  pixid_mirror_entry reg [256] ;
+} pixid_mirror ;
+
+#define PIXID_REQUEST_SIZE(n) (offsetof (pixid_request, op) + (n) * sizeof (pixid_op))
+#define PIXID_REPLY_SIZE(n)   (offsetof (pixid_reply, result) + (n) * sizeof (int32_t))
+
+#endif
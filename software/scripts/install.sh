@@ -1 +1,5 @@
 cp /home/pixi-200/github/pixi-200/software/gpio/gpio.c /root/wiringPi/gpio/gpio.c
+cp /home/pixi-200/github/pixi-200/software/pixid/pixid.h /root/wiringPi/gpio/pixid.h
+make -C /home/pixi-200/github/pixi-200/software/pixid install
+cp /home/pixi-200/github/pixi-200/software/scripts/pixid /etc/init.d/pixid
+update-rc.d pixid defaults
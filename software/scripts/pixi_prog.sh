@@ -19,7 +19,7 @@ case "$1" in
     echo "Starting PiXi-200"
     # run application you want to start
     /usr/local/bin/gpio load spi
-    /usr/local/bin/gpio pixi_prog
+    /usr/local/bin/gpio pixi_prog fast   # Skips programming if the FPGA already holds this build
     ;;
   stop)
     echo "Stopping PiXi-200"